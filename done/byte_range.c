@@ -0,0 +1,70 @@
+/**
+ * @file byte_range.c
+ * @brief imgStore server: HTTP byte ranges implementation.
+ */
+
+#include "byte_range.h"
+#include <errno.h> // for errno
+#include <stdlib.h> // for strtoull
+#include <string.h> // for strncmp, strlen
+
+/**
+ * Parses a decimal number of a Range header
+ *
+ * @param str the number, followed by anything but a digit
+ * @param value output value
+ * @return the character following the number, NULL if there is no number
+ */
+static const char* parse_range_bound(const char* str, uint64_t* value)
+{
+    if (*str < '0' || *str > '9') {
+        return NULL;
+    }
+    char* end = NULL;
+    errno = 0;
+    *value = strtoull(str, &end, 10);
+    return errno == 0 ? end : NULL;
+}
+
+int byte_range_parse(const char* spec, uint32_t size, uint32_t* start, uint32_t* length)
+{
+    if (spec == NULL || start == NULL || length == NULL || strncmp(spec, "bytes=", strlen("bytes="))) {
+        return 0;
+    }
+    const char* cursor = spec + strlen("bytes=");
+    uint64_t first = 0;
+    uint64_t last = (uint64_t) size - 1;
+    if (*cursor == '-') {
+        // suffix: the last bytes
+        uint64_t suffix = 0;
+        cursor = parse_range_bound(cursor + 1, &suffix);
+        if (cursor == NULL || *cursor != '\0') {
+            return 0;
+        }
+        if (suffix == 0 || size == 0) {
+            return -1;
+        }
+        first = suffix < size ? size - suffix : 0;
+    } else {
+        cursor = parse_range_bound(cursor, &first);
+        if (cursor == NULL || *cursor != '-') {
+            return 0;
+        }
+        if (cursor[1] != '\0') {
+            cursor = parse_range_bound(cursor + 1, &last);
+            if (cursor == NULL || *cursor != '\0' || last < first) {
+                return 0;
+            }
+        }
+        if (first >= size) {
+            return -1;
+        }
+        if (last >= size) {
+            last = (uint64_t) size - 1;
+        }
+    }
+
+    *start = (uint32_t) first;
+    *length = (uint32_t) (last - first + 1);
+    return 1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+/**
+ * @file byte_range.h
+ * @brief Byte ranges of HTTP Range headers: "bytes=first-last", "bytes=first-"
+ *        or "bytes=-suffix". Only a single range is served in part; several
+ *        ranges, or any other unit or syntax, get the whole content.
+ */
+
+#include <stdint.h> // for uint32_t
+
+/**
+ * Parses the value of a Range header against the size of the content
+ *
+ * @param spec value of the header, NUL-terminated
+ * @param size size of the content
+ * @param start output first byte of the range, if satisfiable
+ * @param length output number of bytes of the range, if satisfiable
+ * @return 1 if the range is to be sent, 0 if the header is ignored (the whole
+ *         content is sent), -1 if no byte of the range is in the content
+ */
+int byte_range_parse(const char* spec, uint32_t size, uint32_t* start, uint32_t* length);
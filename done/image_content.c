@@ -8,98 +8,125 @@
 #include <stdio.h>
 #include <vips/vips.h>
 #include <stdlib.h>
+#include <string.h> // for memset
+#include <unistd.h> // for pread
 
 /**
- * Computes the ratio to shrink the image
+ * Encodes the given image resized to fit the given size
  *
- * @param image
- * @param max_width
- * @param max_height
- * @return ratio
- */
-double shrink_value(const VipsImage *image, int max_width, int max_height)
-{
-    const double h_shrink = (double) max_width / (double) image->Xsize;
-    const double v_shrink = (double) max_height / (double) image->Ysize;
-    return h_shrink > v_shrink ? v_shrink : h_shrink;
-}
-
-/**
- * Take an image from input_buffer, resize it, and can be used on output_buffer
+ * The original is decoded directly at about the new size (libjpeg shrinks in
+ * the DCT domain, the original is never decoded at full resolution), then
+ * only a small residual resize is left to libvips.
  *
- * @param output_buffer new image
- * @param input_buffer input image
- * @param im_file imgst_file structure
- * @param im_size_orig original size
- * @param res new resolution to be computed
- * @param im_size_new pointer on the new size of the new image
+ * @param input_buffer the original image
+ * @param im_size_orig size of the original image
+ * @param max_width maximum width of the new image
+ * @param max_height maximum height of the new image
+ * @param output_buffer pointer where to store the new (allocated) image
+ * @param output_size pointer where to store the size of the new image
  * @return error code according error.h
  */
-int inp_to_out_buffer(void ** output_buffer, void ** input_buffer, const struct imgst_file *im_file, uint64_t im_size_orig, int res, size_t* im_size_new)
+static int inp_to_out_buffer(void* input_buffer, uint64_t im_size_orig, uint16_t max_width, uint16_t max_height,
+                             void** output_buffer, size_t* output_size)
 {
-    VipsImage **im_resized_array = NULL;
-    VipsImage *array;
-    array = vips_image_new();
-    int err = 0;
-
-    // Create an empty array for the future resized image
-    im_resized_array = (VipsImage **) vips_object_local_array(VIPS_OBJECT(array), 1);
-
-    VipsImage *im_input;
-    // Convert the buffer to a Vips Image and resize it
-    err = vips_jpegload_buffer(*input_buffer, im_size_orig, &im_input, NULL); // VIPS ERROR: 0 if ok, -1 if error
+    VipsImage *im_resized;
+    int err = vips_thumbnail_buffer(input_buffer, im_size_orig, &im_resized, max_width,
+                                    "height", (int) max_height, NULL); // VIPS ERROR: 0 if ok, -1 if error
     if(err != 0) {
         return ERR_IMGLIB;
     }
 
-    const double ratio = shrink_value(im_input, im_file->header.res_resized[2 * res],
-                                      im_file->header.res_resized[2 * res + 1]);
-    vips_resize(im_input, im_resized_array, ratio, NULL);
+    err = vips_jpegsave_buffer(im_resized, output_buffer, output_size, NULL);
+    g_object_unref(im_resized);
+    return err != 0 ? ERR_IMGLIB : ERR_NONE;
+}
 
-    // Write the resized vips image to an output buffer
-    err = vips_jpegsave_buffer(im_resized_array[0], output_buffer, im_size_new, NULL);
-    g_object_unref(im_input);
-    g_object_unref(array);
-    if(err != 0) {
-        return ERR_IMGLIB;
+/**
+ * Encodes every missing resolution of the original
+ *
+ * Each resolution is shrunk on load from the original on its own: a shrunk
+ * decoding costs less than one full decoding, and the images stored are the
+ * same whichever request created them.
+ *
+ * @param input_buffer the original image
+ * @param im_size_orig size of the original image
+ * @param meta metadata of the image (resolutions whose size is 0 are missing)
+ * @param res_resized maximum width and height of each resized resolution, as in the header
+ * @param set where to store the new images
+ * @return error code according error.h
+ */
+static int inp_to_out_buffers(void* input_buffer, uint64_t im_size_orig, const struct img_metadata* meta,
+                              const uint16_t* res_resized, struct resized_set* set)
+{
+    int err = ERR_NONE;
+    for (int res = 0; res < RES_ORIG && err == ERR_NONE; ++res) {
+        if (meta->size[res] == 0) {
+            err = inp_to_out_buffer(input_buffer, im_size_orig, res_resized[2 * res], res_resized[2 * res + 1],
+                                    &set->buffer[res], &set->size[res]);
+        }
     }
-
-    return ERR_NONE;
+    return err;
 }
 
-int lazily_resize(int res, const struct imgst_file *im_file, size_t index)
+int resize_original(int fd, const struct img_metadata* meta, const uint16_t* res_resized, struct resized_set* set)
 {
-    if (res == RES_ORIG) {
-        return ERR_NONE;
-    } else if (im_file == NULL || res < 0 || NB_RES <= res || index >= im_file->header.max_files) {
+    if (fd < 0 || meta == NULL || res_resized == NULL || set == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
-    if (im_file->metadata[index].size[res] != 0) {
-        return ERR_NONE;
-    } else {
+    memset(set, 0, sizeof(struct resized_set));
 
-        // Load the metadata where we are going to work
-        struct img_metadata meta = im_file->metadata[index];
-        uint64_t im_size_orig = meta.size[RES_ORIG];
+    const uint32_t im_size_orig = meta->size[RES_ORIG];
 
-        // Create an input buffer to load the image
-        void *input_buffer = malloc(im_size_orig);
-        void *output_buffer = NULL;
+    // Create an input buffer to load the image
+    void *input_buffer = malloc(im_size_orig);
+    if (input_buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
 
-        // Loading the image from binary
-        fseek(im_file->file, (int64_t)meta.offset[RES_ORIG], SEEK_SET);
-        size_t nb_read = fread(input_buffer, im_size_orig, 1, im_file->file);
-        if(nb_read != 1) {
+    // Loading the image from binary, without touching the FILE position shared with other users
+    size_t nb_read = 0;
+    while (nb_read < im_size_orig) {
+        const ssize_t chunk = pread(fd, (char*) input_buffer + nb_read, im_size_orig - nb_read,
+                                    (off_t) (meta->offset[RES_ORIG] + nb_read));
+        if (chunk <= 0) {
             free(input_buffer);
-            return  ERR_IO;
+            return ERR_IO;
         }
+        nb_read += (size_t) chunk;
+    }
 
-        size_t im_size_new = 0;
+    int err = inp_to_out_buffers(input_buffer, im_size_orig, meta, res_resized, set);
+    free(input_buffer);
+    if (err != ERR_NONE) {
+        resized_free(set);
+    }
+    return err;
+}
 
-        int err = inp_to_out_buffer(&output_buffer, &input_buffer, im_file, im_size_orig, res, &im_size_new);
-        if(err != ERR_NONE) {
-            free(input_buffer);
-            return err;
+void resized_free(struct resized_set* set)
+{
+    if (set == NULL) {
+        return;
+    }
+    for (int res = 0; res < RES_ORIG; ++res) {
+        free(set->buffer[res]);
+        set->buffer[res] = NULL;
+        set->size[res] = 0;
+    }
+}
+
+int store_resized(const struct imgst_file *im_file, size_t index, const struct resized_set* set)
+{
+    if (im_file == NULL || set == NULL || index >= im_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct img_metadata* meta = &im_file->metadata[index];
+    int nb_stored = 0;
+    for (int res = 0; res < RES_ORIG; ++res) {
+        // another path may have stored it first
+        if (set->buffer[res] == NULL || meta->size[res] != 0) {
+            continue;
         }
 
         fseek(im_file->file, 0, SEEK_END);
@@ -107,50 +134,134 @@ int lazily_resize(int res, const struct imgst_file *im_file, size_t index)
         //reading offset from ftell, which is first signed, if <0 there is an error, otherwise cast to unsigned
         int64_t signed_new_offset = ftell(im_file->file);
         if(signed_new_offset < 0) {
-            free(input_buffer);
-            free(output_buffer);
             return ERR_IO;
         }
-        uint64_t new_offset = (uint64_t)signed_new_offset;
 
-        size_t nb_written = 0;
-        nb_written = fwrite(output_buffer, im_size_new, 1, im_file->file);
-
-        free(input_buffer);
-        free(output_buffer);
-        output_buffer = NULL;
-        input_buffer = NULL;
+        size_t nb_written = fwrite(set->buffer[res], set->size[res], 1, im_file->file);
         if (nb_written != 1) {
             return ERR_IO;
         }
 
-        meta.offset[res] = new_offset;
-        meta.size[res] = (uint32_t)im_size_new;
-
-        im_file->metadata[index] = meta;
+        meta->offset[res] = (uint64_t)signed_new_offset;
+        meta->size[res] = (uint32_t)set->size[res];
+        nb_stored += 1;
+    }
 
-        fseek(im_file->file, (uint32_t)(sizeof(struct imgst_header) + sizeof(struct img_metadata) * (index)), SEEK_SET);
-        fwrite(&im_file->metadata[index], sizeof(struct img_metadata), 1, im_file->file);
+    // a single metadata update for all of them
+    return nb_stored > 0 ? write_metadata(im_file, index) : ERR_NONE;
+}
 
+int lazily_resize(int res, const struct imgst_file *im_file, size_t index)
+{
+    if (res == RES_ORIG) {
         return ERR_NONE;
+    } else if (im_file == NULL || res < 0 || NB_RES <= res || index >= im_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (im_file->metadata[index].size[res] != 0) {
+        return ERR_NONE;
+    }
+
+    // the original is read through the descriptor: stdio must not hold part of it
+    if (fflush(im_file->file) != 0) {
+        return ERR_IO;
+    }
+
+    // every missing resolution at once: the next request will not decode the original again
+    struct resized_set set;
+    int err = resize_original(fileno(im_file->file), &im_file->metadata[index], im_file->header.res_resized, &set);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    err = store_resized(im_file, index, &set);
+    resized_free(&set);
+    return err;
+}
+
+/**
+ * Reads the dimensions of a JPEG image from its frame header (SOF marker),
+ * without decoding it
+ *
+ * @param height pointer where to store the height of the image
+ * @param width pointer where to store the width of the image
+ * @param data the image
+ * @param size size of the image
+ * @return ERR_NONE if found, ERR_IMGLIB otherwise
+ */
+static int read_sof(uint32_t* height, uint32_t* width, const unsigned char* data, size_t size)
+{
+    size_t pos = 2; // after SOI
+    while (pos + 1 < size) {
+        if (data[pos] != 0xFF) {
+            return ERR_IMGLIB;
+        }
+        const unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos += 1; // fill byte
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            pos += 2; // no length
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA || pos + 4 > size) {
+            return ERR_IMGLIB; // no frame header before the data
+        }
+
+        const size_t length = (size_t) data[pos + 2] << 8 | data[pos + 3];
+        // SOF0 to SOF15, except DHT, JPG and DAC
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (length < 7 || pos + 9 > size) {
+                return ERR_IMGLIB;
+            }
+            *height = (uint32_t) data[pos + 5] << 8 | data[pos + 6];
+            *width = (uint32_t) data[pos + 7] << 8 | data[pos + 8];
+            // a height of 0 is defined later, by a DNL marker
+            return *height != 0 && *width != 0 ? ERR_NONE : ERR_IMGLIB;
+        }
+        if (length < 2) {
+            return ERR_IMGLIB;
+        }
+        pos += 2 + length;
     }
+    return ERR_IMGLIB;
+}
+
+int check_jpeg(const char* image_buffer, size_t image_size)
+{
+    const unsigned char* data = (const unsigned char*) image_buffer;
+    // SOI marker, followed by the first marker
+    return image_buffer != NULL && image_size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF
+           ? ERR_NONE : ERR_IMGLIB;
 }
 
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size)
 {
+    if (height == NULL || width == NULL || image_buffer == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (check_jpeg(image_buffer, image_size) != ERR_NONE) {
+        return ERR_IMGLIB;
+    }
+
+    // usual case: found in the headers, nothing is decoded
+    if (read_sof(height, width, (const unsigned char*) image_buffer, image_size) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
     // if vips err: err_imglib otherwise err_none
     VipsImage *im_input;
 
-    // Convert the buffer to a Vips Image and resize it
+    // Convert the buffer to a Vips Image (only its header is read)
     int isOk = vips_jpegload_buffer((void *) image_buffer, image_size, &im_input, NULL); //CAST on purpose
     if (isOk != 0) {
         return ERR_IMGLIB;
     }
 
-    g_object_unref(im_input);
-
     // Here we cast because there is no reason that the height and width are negative
     *width = (uint32_t) vips_image_get_width(im_input);
     *height = (uint32_t) vips_image_get_height(im_input);
+    g_object_unref(im_input);
     return ERR_NONE;
-}
\ No newline at end of file
+}
@@ -18,7 +18,17 @@
 #include <stdlib.h>
 
 /**
- * Resizes the given image to the given resolution and store it in the given file
+ * @brief Resized versions of an image generated together, indexed by
+ *        resolution code (RES_THUMB, RES_SMALL); NULL when not generated.
+ */
+struct resized_set {
+    void* buffer[RES_ORIG];
+    size_t size[RES_ORIG];
+};
+
+/**
+ * Resizes the given image to the given resolution and store it in the given file,
+ * along with every other missing resolution (the original is decoded once)
  *
  * @param res The given resolution
  * @param im_file The given imgst_file
@@ -27,9 +37,54 @@
  */
 int lazily_resize(int res, const struct imgst_file* im_file, size_t index);
 
+/**
+ * Reads the original of an image through the given descriptor, decodes it once
+ * and encodes every missing resolution (size 0 in meta). It does not use the
+ * imgst_file, hence can run on another thread than the one owning it (the
+ * original must be on disk).
+ *
+ * @param fd descriptor of the imgStore file
+ * @param meta metadata of the image
+ * @param res_resized maximum width and height of each resized resolution, as in the header
+ * @param set where to store the new (allocated) images, to be released with resized_free
+ * @return The error associated to the error code in error.h
+ */
+int resize_original(int fd, const struct img_metadata* meta, const uint16_t* res_resized, struct resized_set* set);
+
+/**
+ * Releases the images of a resized_set
+ *
+ * @param set the set
+ */
+void resized_free(struct resized_set* set);
+
+/**
+ * Appends the resized images still missing at index to the given file, and
+ * records them with a single metadata update
+ *
+ * @param im_file The given imgst_file
+ * @param index The index of the image in the file
+ * @param set the resized images
+ * @return The error associated to the error code in error.h
+ */
+int store_resized(const struct imgst_file* im_file, size_t index, const struct resized_set* set);
+
+/**
+ * Tells whether a buffer starts like a JPEG image (SOI marker); cheap enough
+ * to reject other content before anything is stored
+ *
+ * @param image_buffer buffer that contain (the beginning of) the image
+ * @param image_size size of the buffer
+ * @return ERR_NONE if it looks like a JPEG image, ERR_IMGLIB otherwise
+ */
+int check_jpeg(const char* image_buffer, size_t image_size);
+
 /**
  * Given an image buffer, set the value of width and height given by pointer of the image
  *
+ * The dimensions are read from the JPEG frame header without decoding the
+ * image; libvips is only used for files where it cannot be found.
+ *
  * @param height pointer where to store the height of image_buffer
  * @param width pointer where to store the width of image_buffer
  * @param image_buffer buffer that contain the image
@@ -11,6 +11,9 @@
  * because it should be stored as raw bytes appended at the end of the
  * imgStore file and addressed by offsets in the metadata structure.
  *
+ * A growable imgStore (IMGST_GROWABLE) starts the same way, but once full,
+ * its metadata table is extended by extents appended to the file, see do_grow.
+ *
  * @author Mia Primorac
  */
 
@@ -31,6 +34,7 @@
 #define MAX_IMGST_NAME  31  // max. size of a ImgStore name
 #define MAX_IMG_ID     127  // max. size of an image id
 #define MAX_MAX_FILES 100000  // version from week 7
+#define MAX_GROWN_FILES 50000000 // growable imgStores, see do_grow
 
 #define MAX_RES_TXT_LEN 9 //for thumbnail
 
@@ -38,6 +42,20 @@
 #define EMPTY 0
 #define NON_EMPTY 1
 
+/* Flags in unused_16 of imgst_metadata.
+ * Stores written before them have 0 there; a tool unaware of them leaves them
+ * set and only misses the background resize: the image is still resized on
+ * its first read. Other bits are reserved and must stay 0. */
+#define PENDING_RESIZE 1 // thumbnail and small images still to be generated in background
+
+/* Format revisions, in unused_32 of imgst_header */
+#define IMGST_FIXED    0 // max_files metadata right after the header
+#define IMGST_GROWABLE 1 // metadata table extended by extents, the newest one at unused_64 (0 if none)
+
+#define EXTENT_ALIGN (64 * 1024) // alignment of the extents, in the file and in the table (whole pages)
+#define EXTENT_MAGIC 0x544E455854534D49ull
+#define MAX_EXTENTS 64
+
 // imgStore library internal codes for different image resolutions.
 #define RES_THUMB 0
 #define RES_SMALL 1
@@ -76,13 +94,69 @@ struct img_metadata {
     uint32_t size[NB_RES];
     uint64_t offset[NB_RES];
     uint16_t is_valid;
-    uint16_t unused_16;
+    uint16_t unused_16;      // flags, see PENDING_RESIZE
+};
+
+/**
+ * @brief Descriptor of an extent of the metadata table of a growable imgStore,
+ *        stored in the EXTENT_ALIGN bytes right before the extent itself.
+ *        Seen as contiguous, the header and metadata table would be start bytes
+ *        long before the extent, which holds the next length bytes; the part of
+ *        the table before the oldest extent is at the beginning of the file.
+ */
+struct metadata_extent {
+    uint64_t magic;
+    uint64_t start;
+    uint64_t length;
+    uint64_t older;           // offset of the descriptor of the previous extent, 0 if none
+};
+
+// address range reserved for the header and metadata table of a growable imgStore
+#define GROWABLE_MAP_SIZE ((sizeof(struct imgst_header) + (size_t) MAX_GROWN_FILES * sizeof(struct img_metadata) \
+                            + EXTENT_ALIGN - 1) / EXTENT_ALIGN * EXTENT_ALIGN)
+
+struct img_index; // see img_index.h
+struct journal;   // see journal.h
+
+// how updates of an imgStore opened for writing are made durable (see journal.h)
+enum durability {
+    DURABILITY_NONE,
+    DURABILITY_BATCH,
+    DURABILITY_ALWAYS
+};
+
+/**
+ * @brief Read-only mapping of the whole imgStore file, used by image views.
+ *        Mappings are chained from the newest to the older ones that are
+ *        still borrowed by some view.
+ */
+struct data_map {
+    void* base;
+    size_t size;
+    uint32_t refs;            // number of views borrowing from this mapping
+    struct data_map* older;
 };
 
 struct imgst_file {
     FILE* file;
     struct imgst_header header;
     struct img_metadata* metadata; //[MAX_MAX_FILES];
+    struct img_index* lookup; // in-memory index on metadata, NULL if not built
+    void* map;                // mmap of the header and metadata, NULL if read in memory
+    size_t map_size;          // size of the mapping (the whole reserved range if growable)
+    int is_map_shared;        // mapping writes through to the file
+    void* view;               // private mapping updated until the commit, if journaled and mapped
+    struct data_map* data_map; // newest mapping of the data for image views, NULL if none
+    struct journal* journal;  // write-ahead journal of the updates, NULL if not journaled
+};
+
+/**
+ * @brief Borrowed view of the content of an image, see do_read_view.
+ */
+struct img_view {
+    const void* data;
+    uint32_t size;
+    struct data_map* map; // mapping the view borrows from
 };
 
 /**
@@ -102,12 +176,67 @@ void print_metadata (const struct img_metadata*  metadata);
 /**
  * @brief Open imgStore file, read the header and all the metadata.
  *
+ * The header and metadata region is memory-mapped when possible, so that
+ * opening does not read the whole metadata table: pages are loaded on demand.
+ * With a read-only open_mode, the mapping is private (changes are not written back).
+ * A growable imgStore is mapped in an address range reserved for its largest
+ * table, its extents one after the other, so that the metadata array is contiguous.
+ * A journal left by a process which did not close the file is replayed first;
+ * updates are not journaled (see do_open_durable).
+ *
  * @param imgst_filename Path to the imgStore file
  * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
  * @param imgst_file Structure for header, metadata and file pointer.
  */
 int do_open (const char* imgst_filename, const char* open_mode, struct imgst_file* imgst_file);
 
+/**
+ * @brief Same as do_open, with the updates journaled according to the given
+ *        durability when the file is opened for writing (see journal.h).
+ *        A file opened for writing is locked until do_close: opening it for
+ *        writing once more, from any process, fails with ERR_IO.
+ *
+ * @param imgst_filename Path to the imgStore file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param durability How updates are made durable.
+ * @param imgst_file Structure for header, metadata and file pointer.
+ */
+int do_open_durable(const char* imgst_filename, const char* open_mode, enum durability durability,
+                    struct imgst_file* imgst_file);
+
+/**
+ * @brief Writes the in-memory header to the imgStore file
+ *        (a plain copy when the file is memory-mapped); when journaled, only
+ *        logs it, the file being written once the record is committed.
+ *
+ * @param imgst_file Structure for header, metadata and file pointer.
+ * @return Some error code. 0 if no error.
+ */
+int write_header(const struct imgst_file* imgst_file);
+
+/**
+ * @brief Writes one in-memory metadata to the imgStore file
+ *        (nothing to do when the file is memory-mapped); when journaled, only
+ *        logs it, the file being written once the record is committed.
+ *
+ * @param imgst_file Structure for header, metadata and file pointer.
+ * @param index Index of the metadata to be written.
+ * @return Some error code. 0 if no error.
+ */
+int write_metadata(const struct imgst_file* imgst_file, size_t index);
+
+/**
+ * @brief Writes consecutive in-memory metadata to the imgStore file at once
+ *        (nothing to do when the file is memory-mapped); when journaled, only
+ *        logs them, the file being written once the record is committed.
+ *
+ * @param imgst_file Structure for header, metadata and file pointer.
+ * @param first Index of the first metadata to be written.
+ * @param count Number of metadata to be written.
+ * @return Some error code. 0 if no error.
+ */
+int write_metadata_range(const struct imgst_file* imgst_file, size_t first, size_t count);
+
 /**
  * @brief Do some clean-up for imgStore file handling.
  *
@@ -134,6 +263,61 @@ enum do_list_mode {
 
 char* do_list(const struct imgst_file* file, enum do_list_mode mode);
 
+// longest piece of JSON written at once by do_list_json_next (an escaped img_id)
+#define MAX_LIST_PIECE_STRLEN (6 * MAX_IMG_ID + 32)
+
+/**
+ * @brief Listing in JSON ({ "Images": [ ... ], "next": position }) written piece by
+ *        piece straight from the metadata array, without building it in memory.
+ *        "next" is only there when the listing stopped at its limit: it is the
+ *        cursor of the following page.
+ */
+struct list_stream {
+    uint64_t position;    // next position to be looked at, over several files
+    uint32_t remaining;   // number of images still to be listed
+    uint32_t nb_listed;
+    int state;            // part of the JSON text being written
+};
+
+/**
+ * @brief Starts a listing in JSON.
+ *
+ * @param stream The listing to be initialized.
+ * @param cursor First position to be looked at (a slot of the metadata array
+ *        for a single file).
+ * @param limit Maximum number of images listed (0 for all of them).
+ */
+void do_list_json_start(struct list_stream* stream, uint64_t cursor, uint32_t limit);
+
+/**
+ * @brief Writes the next pieces of a listing in JSON. The metadata array is
+ *        read as it is at each call: images inserted or deleted meanwhile in
+ *        slots not reached yet are listed or not accordingly.
+ *
+ * @param file In memory structure with header and metadata.
+ * @param stream The listing, as started by do_list_json_start.
+ * @param buffer Where to write, not NUL-terminated.
+ * @param size Size of buffer, at least MAX_LIST_PIECE_STRLEN.
+ * @return The number of chars written, 0 once the listing is complete.
+ */
+size_t do_list_json_next(const struct imgst_file* file, struct list_stream* stream, char* buffer, size_t size);
+
+/**
+ * @brief Same as do_list_json_next, over the metadata arrays of several imgStores
+ *        (the shards of a store) taken in turn: position p of the listing is
+ *        slot p / nb_files of file p % nb_files, so that a cursor stays valid
+ *        when one of the tables grows.
+ *
+ * @param files In memory structures with header and metadata.
+ * @param nb_files Number of files.
+ * @param stream The listing, as started by do_list_json_start.
+ * @param buffer Where to write, not NUL-terminated.
+ * @param size Size of buffer, at least MAX_LIST_PIECE_STRLEN.
+ * @return The number of chars written, 0 once the listing is complete.
+ */
+size_t do_list_json_next_all(const struct imgst_file* files, uint32_t nb_files, struct list_stream* stream,
+                             char* buffer, size_t size);
+
 /**
  * @brief Creates the imgStore called imgst_filename. Writes the header and the
  *        preallocated empty metadata array to imgStore file.
@@ -180,6 +364,42 @@ int resolution_atoi(const char* str);
  */
 int do_read(const char* img_id, int res_code, char** image_buffer, uint32_t* image_size, const struct imgst_file* im_file);
 
+/**
+ * @brief Locates the content of an image in the imgStore file (for the caller
+ *        to transfer it directly from the file), creating the resolution if needed.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param offset Location of the offset of the content in the file
+ * @param image_size Location of the image size variable
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_extent(const char* img_id, int res_code, uint64_t* offset, uint32_t* image_size, const struct imgst_file* im_file);
+
+/**
+ * @brief Reads the content of an image from a imgStore without copying it:
+ *        the view points into a read-only mapping of the file.
+ *
+ * The view stays valid, even if the file grows meanwhile, until it is
+ * given back with release_view (and at the latest until do_close).
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param view Location of the view to be filled
+ * @param imgst_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_view(const char* img_id, int res_code, struct img_view* view, struct imgst_file* im_file);
+
+/**
+ * @brief Gives back a view obtained with do_read_view.
+ *
+ * @param view The view to be released (emptied).
+ * @param imgst_file The main in-memory data structure
+ */
+void release_view(struct img_view* view, struct imgst_file* im_file);
+
 /**
  * @brief Insert image in the imgStore file
  *
@@ -191,15 +411,67 @@ int do_read(const char* img_id, int res_code, char** image_buffer, uint32_t* ima
  */
 int do_insert(const char* img_buffer, size_t im_size, const char* img_id, struct imgst_file* im_file);
 
+/**
+ * @brief Insert image in the imgStore file, without writing the header nor its
+ *        metadata: the caller writes them, e.g. once for many images.
+ *
+ * @param buffer Pointer to the raw image content
+ * @param size Image size
+ * @param img_id Image ID
+ * @param imgst_file the struct where we are going to add the image
+ * @param index Where to store the index of the metadata of the new image
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_deferred(const char* img_buffer, size_t im_size, const char* img_id, struct imgst_file* im_file, uint32_t* index);
+
+// do_insert_fd reads the resolution from the first RESOLUTION_PROBE_SIZE bytes of
+// the image (where the frame header is, past the usual metadata), and copies the
+// content INSERT_COPY_SIZE bytes at a time
+#define RESOLUTION_PROBE_SIZE (256 * 1024)
+#define INSERT_COPY_SIZE (64 * 1024)
+
+/**
+ * @brief Insert image whose content is held by another file (e.g. uploaded in
+ *        chunks). The content is copied to the imgStore file once, only if the
+ *        same content is not already stored; the header and metadata are written.
+ *
+ * @param img_id Image ID
+ * @param img_fd File descriptor of the content, from its first byte
+ * @param size Image size
+ * @param SHA SHA-256 of the content
+ * @param imgst_file the struct where we are going to add the image
+ * @param index Where to store the index of the metadata of the new image
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_fd(const char* img_id, int img_fd, uint32_t size, const unsigned char* SHA,
+                 struct imgst_file* im_file, uint32_t* index);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
+ * The stored bytes of every version are copied as they are (no decoding nor
+ * resizing), and contents shared by several images remain shared.
+ * The table of a growable imgStore is shrunk to its valid images.
+ *
  * @param imgst_path The path to the imgStore file
  * @param imgst_tmp_bkp_path The path to the a (to be created) temporary imgStore backup file
  * @return Some error code. 0 if no error.
  */
 int do_gbcollect(const char* orig_filename, const char* tmp_filename);
 
+/**
+ * @brief Extends the metadata table of a growable imgStore, mapped for writing,
+ *        by a new extent appended to the file: max_files is at least doubled,
+ *        up to MAX_GROWN_FILES. The metadata array stays where it is in memory
+ *        (do_open reserves room for the largest table), so pointers to it
+ *        remain valid.
+ *
+ * @param imgst_file The imgStore to be extended.
+ * @return ERR_FULL_IMGSTORE if it cannot grow (fixed format, read in memory,
+ *         or already at MAX_GROWN_FILES), some other error code on failure.
+ */
+int do_grow(struct imgst_file* imgst_file);
+
 /**
  * @brief Generate a composite name of a readed file given an argument a resolution
  *
@@ -10,11 +10,21 @@
 #include "util.h" // for atoint32
 #include "imgStore.h"
 #include "image_content.h"
+#include "img_index.h"
+#include "journal.h"
+#include "resize_queue.h"
+#include "shard.h"
+#include "work_pool.h"
+#include <errno.h> // for errno, ERANGE
+#include <inttypes.h> // for PRIu32
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h> // for scandir
+#include <sys/stat.h> // for stat, mkdir
+#include <unistd.h> // for pread
 #include <vips/vips.h>
 
-#define CMD_NBR 7
+#define CMD_NBR 9
 #define MAX_FILE_ARG_REQ 1
 #define RES_ARG_REQ 2
 
@@ -23,6 +33,14 @@
 #define MAX_THUMB_X 128
 #define MAX_THUMB_Y 128
 
+// images inserted between two writes of the header and metadata by insert-batch
+#define BATCH_COMMIT_SIZE 4096
+#define MAX_MANIFEST_LINE 4096
+
+// threads writing the images read by export, and images read ahead of them
+#define EXPORT_WORKERS 4
+#define EXPORT_READ_AHEAD 16
+
 typedef int (*command)(int argc, char* argv[]);
 
 struct command_mapping {
@@ -30,6 +48,9 @@ struct command_mapping {
     command cmd;
 };
 
+// durability of the updates of the commands writing to the store, from DURABILITY_ENV
+static enum durability s_durability = DURABILITY_NONE;
+
 /********************************************************************//**
  * Opens imgStore file and calls do_list command.
  ********************************************************************** */
@@ -40,14 +61,19 @@ do_list_cmd (int argc, char* argv[])
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
-    struct imgst_file myfile;
-    memset(&myfile, 0, sizeof(myfile));
-    int err_open = do_open(argv[1], "rb", &myfile);
+    struct shard_set set;
+    int err_open = shard_load(argv[1], &set);
+    if (err_open == ERR_NONE) {
+        err_open = shard_open(&set, "rb", DURABILITY_NONE);
+    }
 
-    if(err_open == ERR_NONE) {
-        do_list(&myfile, STDOUT);
-        do_close(&myfile);
+    for (uint32_t i = 0; err_open == ERR_NONE && i < set.nb_shards; ++i) {
+        if (set.is_sharded) {
+            printf("SHARD %" PRIu32 ": %s\n", i, set.filenames[i]);
+        }
+        do_list(&set.shards[i], STDOUT);
     }
+    shard_free(&set);
 
     return err_open;
 }
@@ -69,6 +95,8 @@ do_create_cmd (int argc, char* argv[])
     uint16_t thumb_res_y =  64;
     uint16_t small_res_x = 256;
     uint16_t small_res_y = 256;
+    uint32_t format = IMGST_FIXED;
+    uint32_t nb_shards = 0;
 
     for (int index = 2; index<argc; index++) {
         if(!strcmp(argv[index], "-max_files")) {
@@ -105,6 +133,17 @@ do_create_cmd (int argc, char* argv[])
             small_res_x = new_small_res_x;
             small_res_y = new_small_res_y;
             index += 2;
+        } else if (!strcmp(argv[index], "-growable")) {
+            format = IMGST_GROWABLE;
+        } else if (!strcmp(argv[index], "-shards")) {
+            if(argc <= index + 1) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            nb_shards = atouint32(argv[index + 1]);
+            if(nb_shards == 0 || nb_shards > MAX_SHARDS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            index += 1;
         } else {
             return ERR_INVALID_ARGUMENT;
         }
@@ -121,6 +160,21 @@ do_create_cmd (int argc, char* argv[])
     im_file.header.res_resized[1] = thumb_res_y;
     im_file.header.res_resized[2] = small_res_x;
     im_file.header.res_resized[3] = small_res_y;
+    im_file.header.unused_32 = format;
+
+    if (nb_shards > 0) {
+        // every shard gets the same header: the header of one of them is shown
+        int err = shard_create(argv[1], nb_shards, &im_file.header);
+        if (err == ERR_NONE) {
+            err = shard_open_id(argv[1], "", "rb", DURABILITY_NONE, &im_file);
+        }
+        if (err == ERR_NONE) {
+            printf("SHARDS: %" PRIu32 "\n", nb_shards);
+            print_header(&im_file.header);
+            do_close(&im_file);
+        }
+        return err;
+    }
 
     int is_error = do_create(argv[1], &im_file);
 
@@ -157,12 +211,25 @@ help (int argc, char* argv[])
     printf("          -small_res <X_RES> <Y_RES>: resolution for small images.\n");
     printf("                                  default value is 256x256\n");
     printf("                                  maximum value is %dx%d\n", MAX_SMALL_X, MAX_SMALL_Y);
+    printf("          -growable: extend the metadata table when full, instead of failing.\n");
+    printf("                                  up to %d files\n", MAX_GROWN_FILES);
+    printf("          -shards <NB_SHARDS>: spread images over NB_SHARDS imgStore files, by id.\n");
+    printf("                                  imgstore_filename is then their manifest, options apply to each\n");
+    printf("                                  maximum value is %d\n", MAX_SHARDS);
     printf("  read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n");
     printf("      read an image from the imgStore and save it to a file.\n");
     printf("      default resolution is \"original\".\n");
-    printf("  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.\n");
+    printf("  insert <imgstore_filename> <imgID> <filename> [-eager]: insert a new image in the imgStore.\n");
+    printf("      -eager: generate its thumbnail and small images right away.\n");
+    printf("  insert-batch <imgstore_filename> <manifest|directory>: insert many images in one session.\n");
+    printf("      the manifest has one \"<imgID> <filename>\" per line, images of a directory\n");
+    printf("      are named after their file name without extension.\n");
+    printf("  export <imgstore_filename> <output_directory> [-res <RES>]... [-ids <ids_file>]:\n");
+    printf("      save many images of the imgStore to files in one pass.\n");
+    printf("      default resolution is \"original\", all images unless listed in ids_file.\n");
     printf("  delete <imgstore_filename> <imgID>: delete image imgID from imgStore.\n");
-    printf("  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.\n");
+    printf("  gc <imgstore_filename> <tmp imgstore_filename> [-shard <SHARD>]: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.\n");
+    printf("      shards are collected concurrently (or only SHARD), each one on its own.\n");
     return ERR_NONE;
 }
 
@@ -182,7 +249,7 @@ do_delete_cmd (int argc, char* argv[])
         return ERR_INVALID_IMGID;
     } else {
         struct imgst_file myfile;
-        error = do_open(argv[1], "r+b", &myfile);
+        error = shard_open_id(argv[1], argv[2], "r+b", s_durability, &myfile);
         if (error != ERR_NONE) {
             return error;
         }
@@ -207,10 +274,18 @@ int do_insert_cmd(int argc, char* argv[])
         return ERR_INVALID_IMGID;
     }
 
+    int eager = 0;
+    if (argc > 4) {
+        if (argc > 5 || strcmp(argv[4], "-eager")) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        eager = 1;
+    }
+
     struct imgst_file myfile;
     memset(&myfile, 0, sizeof(myfile));
 
-    int err_open = do_open(argv[1], "r+b", &myfile);
+    int err_open = shard_open_id(argv[1], argv[2], "r+b", s_durability, &myfile);
     if (err_open != ERR_NONE) {
         return err_open;
     }
@@ -227,13 +302,262 @@ int do_insert_cmd(int argc, char* argv[])
 
 
     err_open = do_insert(img_buffer, size_of_buffer, argv[2], &myfile);
-    do_close(&myfile);
     free(img_buffer);
 
+    if (err_open == ERR_NONE && eager) {
+        // the image is committed: an interrupted generation is resumed by the server
+        uint32_t index = 0;
+        struct resize_queue queue;
+        err_open = index_find_id(&myfile, argv[2], &index);
+        if (err_open == ERR_NONE) {
+            err_open = resize_queue_start(&queue, &myfile);
+        }
+        if (err_open == ERR_NONE) {
+            err_open = resize_queue_add(&queue, index);
+            resize_queue_end(&queue);
+        }
+    }
+    do_close(&myfile);
+
     return err_open;
 
 }
 
+/**
+ * Pending part of an insert-batch in one shard: slots filled since the last commit
+ */
+struct batch {
+    struct imgst_file* file;
+    const struct shard_set* set;
+    uint32_t shard;   // only the images of this shard are inserted
+    const char* source; // manifest or directory
+    int is_dir;
+    uint32_t first;   // lowest metadata slot filled
+    uint32_t last;    // highest metadata slot filled
+    size_t nb_pending; // images inserted since the last commit
+    size_t nb_inserted;
+    int error;
+};
+
+/**
+ * Writes the header and the metadata slots filled since the last commit, at once
+ *
+ * @param batch the batch
+ * @return error code according error.h
+ */
+static int commit_batch(struct batch* batch)
+{
+    if (batch->nb_pending == 0) {
+        return ERR_NONE;
+    }
+    int err = write_metadata_range(batch->file, batch->first, (size_t) batch->last - batch->first + 1);
+    if (err == ERR_NONE) {
+        err = write_header(batch->file);
+    }
+    batch->nb_pending = 0;
+    return err;
+}
+
+/**
+ * Inserts one image of a batch; only errors that stop the batch are returned,
+ * the others are reported and the image skipped
+ *
+ * @param batch the batch
+ * @param img_id id of the image
+ * @param filename file of the image
+ * @return error code according error.h
+ */
+static int batch_insert(struct batch* batch, const char* img_id, char* filename)
+{
+    int err = strlen(img_id) > MAX_IMG_ID || strlen(img_id) == 0 ? ERR_INVALID_IMGID : ERR_NONE;
+    // the batch of every shard reads the whole source: an image is handled by one of them only
+    if (err == ERR_NONE ? shard_of(batch->set, img_id) != batch->shard : batch->shard != 0) {
+        return ERR_NONE;
+    }
+
+    char* img_buffer = NULL;
+    uint64_t size_of_buffer = 0;
+    if (err == ERR_NONE) {
+        err = read_disk_image(filename, "rb", &img_buffer, &size_of_buffer);
+    }
+
+    uint32_t index = 0;
+    if (err == ERR_NONE) {
+        err = do_insert_deferred(img_buffer, size_of_buffer, img_id, batch->file, &index);
+    }
+    free(img_buffer);
+
+    if (err == ERR_NONE) {
+        if (batch->nb_pending == 0 || index < batch->first) {
+            batch->first = index;
+        }
+        if (batch->nb_pending == 0 || index > batch->last) {
+            batch->last = index;
+        }
+        batch->nb_pending += 1;
+        batch->nb_inserted += 1;
+        if (batch->nb_pending >= BATCH_COMMIT_SIZE) {
+            return commit_batch(batch);
+        }
+        return ERR_NONE;
+    }
+
+    fprintf(stderr, "ERROR: %s (%s): %s\n", img_id, filename, ERR_MESSAGES[err]);
+    return err == ERR_FULL_IMGSTORE || err == ERR_OUT_OF_MEMORY ? err : ERR_NONE;
+}
+
+/**
+ * Inserts the images of a directory, in name order, named after their file name
+ *
+ * @param batch the batch
+ * @param dirname the directory
+ * @return error code according error.h
+ */
+static int batch_insert_dir(struct batch* batch, const char* dirname)
+{
+    struct dirent** entries = NULL;
+    const int nb_entries = scandir(dirname, &entries, NULL, alphasort);
+    if (nb_entries < 0) {
+        return ERR_IO;
+    }
+
+    int err = ERR_NONE;
+    for (int i = 0; i < nb_entries; ++i) {
+        const char* name = entries[i]->d_name;
+        char* filename = malloc(strlen(dirname) + strlen(name) + 2);
+        if (filename == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        }
+
+        struct stat st;
+        if (err == ERR_NONE && name[0] != '.') {
+            sprintf(filename, "%s/%s", dirname, name);
+            if (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+                char img_id[MAX_IMG_ID + 2] = "";
+                strncpy(img_id, name, MAX_IMG_ID + 1);
+                char* ext = strrchr(img_id, '.');
+                if (ext != NULL && ext != img_id) {
+                    *ext = '\0';
+                }
+                err = batch_insert(batch, img_id, filename);
+            }
+        }
+        free(filename);
+        free(entries[i]);
+    }
+    free(entries);
+    return err;
+}
+
+/**
+ * Inserts the images listed in a manifest, one "<imgID> <filename>" per line
+ *
+ * @param batch the batch
+ * @param manifest the manifest file
+ * @return error code according error.h
+ */
+static int batch_insert_manifest(struct batch* batch, const char* manifest)
+{
+    FILE* list = fopen(manifest, "r");
+    if (list == NULL) {
+        return ERR_IO;
+    }
+
+    int err = ERR_NONE;
+    char line[MAX_MANIFEST_LINE];
+    while (err == ERR_NONE && fgets(line, sizeof(line), list) != NULL) {
+        char* img_id = strtok(line, " \t\r\n");
+        char* filename = strtok(NULL, "\r\n");
+        if (img_id == NULL) {
+            continue; // empty line
+        }
+        if (filename == NULL) {
+            if (batch->shard == 0) {
+                fprintf(stderr, "ERROR: %s: %s\n", img_id, ERR_MESSAGES[ERR_NOT_ENOUGH_ARGUMENTS]);
+            }
+            continue;
+        }
+        while (*filename == ' ' || *filename == '\t') {
+            ++filename;
+        }
+        err = batch_insert(batch, img_id, filename);
+    }
+    fclose(list);
+    return err;
+}
+
+/**
+ * Worker side of insert-batch: inserts the images of one shard
+ *
+ * @param arg the batch
+ */
+static void run_batch(void* arg)
+{
+    struct batch* batch = arg;
+    const int err = batch->is_dir ? batch_insert_dir(batch, batch->source) : batch_insert_manifest(batch, batch->source);
+    // what was inserted before an error is kept
+    const int err_commit = commit_batch(batch);
+    batch->error = err != ERR_NONE ? err : err_commit;
+}
+
+/********************************************************************//**
+ * Inserts many images in one session, writing the header and metadata once
+ * per BATCH_COMMIT_SIZE images. The shards of a sharded imgStore are filled
+ * concurrently, one thread each.
+********************************************************************** */
+int do_insert_batch_cmd(int argc, char* argv[])
+{
+    if (argc < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct stat st;
+    if (stat(argv[2], &st) != 0) {
+        return ERR_IO;
+    }
+
+    struct shard_set set;
+    int err = shard_load(argv[1], &set);
+    if (err == ERR_NONE) {
+        err = shard_open(&set, "r+b", s_durability);
+    }
+    struct batch* batches = err == ERR_NONE ? calloc(set.nb_shards, sizeof(struct batch)) : NULL;
+    struct work_pool pool;
+    if (err == ERR_NONE && (batches == NULL || pool_init(&pool, set.nb_shards, 0) != ERR_NONE)) {
+        err = ERR_OUT_OF_MEMORY;
+    }
+    if (err != ERR_NONE) {
+        free(batches);
+        shard_free(&set);
+        return err;
+    }
+
+    for (uint32_t i = 0; i < set.nb_shards; ++i) {
+        batches[i].file = &set.shards[i];
+        batches[i].set = &set;
+        batches[i].shard = i;
+        batches[i].source = argv[2];
+        batches[i].is_dir = S_ISDIR(st.st_mode);
+        if (pool_submit(&pool, run_batch, NULL, &batches[i]) != ERR_NONE) {
+            batches[i].error = ERR_OUT_OF_MEMORY;
+        }
+    }
+    pool_end(&pool);
+
+    size_t nb_inserted = 0;
+    for (uint32_t i = 0; i < set.nb_shards; ++i) {
+        nb_inserted += batches[i].nb_inserted;
+        if (err == ERR_NONE) {
+            err = batches[i].error;
+        }
+    }
+    free(batches);
+    shard_free(&set);
+
+    printf("%zu image(s) inserted\n", nb_inserted);
+    return err;
+}
+
 /********************************************************************//**
  * Prepares, create buffer, calls do_read and store the jpg image command.
 ********************************************************************** */
@@ -263,7 +587,7 @@ int do_read_cmd(int argc, char* argv[])
     char* image_buffer = NULL;
 
 
-    int error = do_open(argv[1], "r+b", &myfile);
+    int error = shard_open_id(argv[1], argv[2], "r+b", s_durability, &myfile);
     if (error != ERR_NONE) {
         return error;
     }
@@ -295,12 +619,464 @@ int do_read_cmd(int argc, char* argv[])
     return error;
 }
 
+/**
+ * Image to be exported, at its place in the imgStore file
+ */
+struct export_item {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t index;
+    int res;
+};
+
+/**
+ * Image read by export, to be written to its file by a worker
+ */
+struct export_job {
+    char* path;
+    char* buffer;
+    uint32_t size;
+    int error;
+    size_t* nb_exported; // counter of the export, updated on completion
+};
+
+/**
+ * Image whose resolutions missing in the store are generated, and written, by a worker of export
+ */
+struct export_resize {
+    const struct imgst_file* file;
+    uint32_t index;
+    const int* res_wanted; // flag per resolution, set for exported ones
+    const char* outdir;
+    size_t nb_written;
+    int error;
+    size_t* nb_exported; // counter of the export, updated on completion
+};
+
+/**
+ * Orders export items by offset in the file
+ */
+static int export_item_cmp(const void* a, const void* b)
+{
+    const struct export_item* left = a;
+    const struct export_item* right = b;
+    return (left->offset > right->offset) - (left->offset < right->offset);
+}
+
+/**
+ * Builds the path of an exported image
+ *
+ * @param outdir output directory
+ * @param img_id id of the image
+ * @param res resolution of the image
+ * @return the path, to be freed by the caller, NULL if out of memory
+ */
+static char* export_path(const char* outdir, const char* img_id, int res)
+{
+    char fname[MAX_IMG_ID+RES_SUFFIX_LEN+DOT_JPG_SUFFIX_LEN+1];
+    name_gen(fname, img_id, res);
+
+    char* path = malloc(strlen(outdir) + strlen(fname) + 2);
+    if (path != NULL) {
+        sprintf(path, "%s/%s", outdir, fname);
+    }
+    return path;
+}
+
+/**
+ * Worker side of export: writes one image to its file
+ *
+ * @param arg the export_job
+ */
+static void run_export(void* arg)
+{
+    struct export_job* job = arg;
+    job->error = write_disk_image(job->path, "wb", job->size, &job->buffer);
+}
+
+/**
+ * Main thread side of export: reports and releases one written image
+ *
+ * @param arg the export_job
+ */
+static void complete_export(void* arg)
+{
+    struct export_job* job = arg;
+    if (job->error != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s: %s\n", job->path, ERR_MESSAGES[job->error]);
+    } else {
+        *job->nb_exported += 1;
+    }
+    free(job->path);
+    free(job->buffer);
+    free(job);
+}
+
+/**
+ * Marks the images listed in a file, one id per line, that belong to a shard
+ *
+ * @param file the imgStore
+ * @param set the shards of the store
+ * @param shard index of the shard of file
+ * @param ids_file file listing the ids
+ * @param selected one flag per metadata slot, set for listed images
+ * @param nb_selected output number of images selected
+ * @return error code according error.h
+ */
+static int select_ids(const struct imgst_file* file, const struct shard_set* set, uint32_t shard,
+                      const char* ids_file, uint8_t* selected, uint32_t* nb_selected)
+{
+    FILE* list = fopen(ids_file, "r");
+    if (list == NULL) {
+        return ERR_IO;
+    }
+
+    char line[MAX_MANIFEST_LINE];
+    while (fgets(line, sizeof(line), list) != NULL) {
+        const char* img_id = strtok(line, " \t\r\n");
+        uint32_t index = 0;
+        if (img_id == NULL || shard_of(set, img_id) != shard) {
+            continue;
+        }
+        if (index_find_id(file, img_id, &index) == ERR_NONE) {
+            *nb_selected += !selected[index];
+            selected[index] = 1;
+        } else {
+            fprintf(stderr, "ERROR: %s: %s\n", img_id, ERR_MESSAGES[ERR_FILE_NOT_FOUND]);
+        }
+    }
+    fclose(list);
+    return ERR_NONE;
+}
+
+/**
+ * Hands an image over to the writers of export; the buffer is theirs afterwards
+ *
+ * @param writers the pool of writers
+ * @param outdir output directory
+ * @param meta metadata of the image
+ * @param res resolution of the image
+ * @param buffer content of the image
+ * @param size size of the content
+ * @param nb_exported counter of the export
+ */
+static void submit_export(struct work_pool* writers, const char* outdir, const struct img_metadata* meta, int res,
+                          char* buffer, uint32_t size, size_t* nb_exported)
+{
+    struct export_job* job = calloc(1, sizeof(struct export_job));
+    char* path = export_path(outdir, meta->img_id, res);
+    int err = job == NULL || path == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    if (err == ERR_NONE) {
+        job->path = path;
+        job->buffer = buffer;
+        job->size = size;
+        job->nb_exported = nb_exported;
+        // waits for a writer when EXPORT_READ_AHEAD images are already read
+        err = pool_submit(writers, run_export, complete_export, job);
+    }
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s: %s\n", meta->img_id, ERR_MESSAGES[err]);
+        free(job);
+        free(path);
+        free(buffer);
+    }
+}
+
+/**
+ * Reads the planned images in file order and hands them over to the writers
+ *
+ * @param writers the pool of writers
+ * @param file the imgStore
+ * @param items images to be exported, sorted by offset
+ * @param nb_items number of images
+ * @param outdir output directory
+ * @param nb_exported counter of the export
+ */
+static void export_items(struct work_pool* writers, const struct imgst_file* file, const struct export_item* items,
+                         size_t nb_items, const char* outdir, size_t* nb_exported)
+{
+    const int fd = fileno(file->file);
+    for (size_t i = 0; i < nb_items; ++i) {
+        const struct img_metadata* meta = &file->metadata[items[i].index];
+        char* buffer = malloc((size_t) items[i].size + 1);
+        int err = buffer == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+
+        size_t nb_read = 0;
+        while (err == ERR_NONE && nb_read < items[i].size) {
+            const ssize_t chunk = pread(fd, buffer + nb_read, items[i].size - nb_read, (off_t) (items[i].offset + nb_read));
+            if (chunk <= 0) {
+                err = ERR_IO;
+            } else {
+                nb_read += (size_t) chunk;
+            }
+        }
+
+        if (err == ERR_NONE) {
+            submit_export(writers, outdir, meta, items[i].res, buffer, items[i].size, nb_exported);
+        } else {
+            fprintf(stderr, "ERROR: %s: %s\n", meta->img_id, ERR_MESSAGES[err]);
+            free(buffer);
+        }
+    }
+}
+
+/**
+ * Worker side of export: generates the resolutions of an image missing in the
+ * store, in memory only, and writes them to their files
+ *
+ * @param arg the export_resize
+ */
+static void run_resize(void* arg)
+{
+    struct export_resize* job = arg;
+    const struct img_metadata* meta = &job->file->metadata[job->index];
+    struct resized_set resized;
+    job->error = resize_original(fileno(job->file->file), meta, job->file->header.res_resized, &resized);
+    if (job->error != ERR_NONE) {
+        return;
+    }
+    for (int res = 0; res < RES_ORIG && job->error == ERR_NONE; ++res) {
+        if (resized.buffer[res] == NULL || !job->res_wanted[res]) {
+            continue;
+        }
+        char* path = export_path(job->outdir, meta->img_id, res);
+        char* buffer = resized.buffer[res];
+        job->error = path == NULL ? ERR_OUT_OF_MEMORY : write_disk_image(path, "wb", (uint32_t) resized.size[res], &buffer);
+        if (job->error == ERR_NONE) {
+            job->nb_written += 1;
+        }
+        free(path);
+    }
+    resized_free(&resized);
+}
+
+/**
+ * Main thread side of export: reports and releases one resized image
+ *
+ * @param arg the export_resize
+ */
+static void complete_resize(void* arg)
+{
+    struct export_resize* job = arg;
+    if (job->error != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s: %s\n", job->file->metadata[job->index].img_id, ERR_MESSAGES[job->error]);
+    }
+    *job->nb_exported += job->nb_written;
+    free(job);
+}
+
+/**
+ * Hands an image whose wanted resolutions are missing in the store over to the
+ * workers of export, as insert-batch does with its shards
+ *
+ * @param writers the pool of writers
+ * @param file the imgStore
+ * @param index index of the image
+ * @param res_wanted flag per resolution, set for exported ones
+ * @param outdir output directory
+ * @param nb_exported counter of the export
+ */
+static void submit_resize(struct work_pool* writers, const struct imgst_file* file, uint32_t index,
+                          const int* res_wanted, const char* outdir, size_t* nb_exported)
+{
+    struct export_resize* job = calloc(1, sizeof(struct export_resize));
+    int err = job == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    if (err == ERR_NONE) {
+        job->file = file;
+        job->index = index;
+        job->res_wanted = res_wanted;
+        job->outdir = outdir;
+        job->nb_exported = nb_exported;
+        err = pool_submit(writers, run_resize, complete_resize, job);
+    }
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s: %s\n", file->metadata[index].img_id, ERR_MESSAGES[err]);
+        free(job);
+    }
+}
+
+/**
+ * Exports the selected images of one shard
+ *
+ * @param set the shards of the store
+ * @param shard index of the shard
+ * @param res_wanted flag per resolution, set for exported ones
+ * @param ids_file file listing the ids, NULL for all images
+ * @param outdir output directory
+ * @param nb_exported incremented by the number of images exported
+ * @return error code according error.h
+ */
+static int export_shard(const struct shard_set* set, uint32_t shard, const int* res_wanted, const char* ids_file,
+                        const char* outdir, size_t* nb_exported)
+{
+    struct imgst_file myfile;
+    memset(&myfile, 0, sizeof(myfile));
+    // rb: export never writes to the store, missing resolutions are only generated in memory
+    int err = do_open(set->filenames[shard], "rb", &myfile);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    const uint32_t max_files = myfile.header.max_files;
+    uint8_t* selected = calloc(max_files, sizeof(uint8_t));
+    if (selected == NULL) {
+        do_close(&myfile);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    uint32_t nb_selected = 0;
+    if (ids_file != NULL) {
+        err = select_ids(&myfile, set, shard, ids_file, selected, &nb_selected);
+    } else {
+        for (uint32_t i = 0; i < max_files; ++i) {
+            selected[i] = myfile.metadata[i].is_valid == NON_EMPTY;
+            nb_selected += selected[i];
+        }
+    }
+
+    // at most one item per wanted resolution of the selected images
+    size_t nb_res_wanted = 0;
+    for (int res = 0; res < NB_RES; ++res) {
+        nb_res_wanted += res_wanted[res] != 0;
+    }
+    struct export_item* items = NULL;
+    struct work_pool writers;
+    if (err == ERR_NONE && nb_selected > 0) {
+        items = calloc((size_t) nb_selected * nb_res_wanted, sizeof(struct export_item));
+        err = items == NULL ? ERR_OUT_OF_MEMORY : pool_init(&writers, EXPORT_WORKERS, EXPORT_READ_AHEAD);
+    }
+    if (err != ERR_NONE || nb_selected == 0) {
+        free(selected);
+        free(items);
+        do_close(&myfile);
+        return err;
+    }
+
+    size_t nb_items = 0;
+    for (uint32_t i = 0; i < max_files && err == ERR_NONE; ++i) {
+        int is_missing = 0;
+        for (int res = 0; res < NB_RES && selected[i]; ++res) {
+            if (!res_wanted[res]) {
+                continue;
+            }
+            if (myfile.metadata[i].size[res] == 0) {
+                is_missing = 1;
+                continue;
+            }
+            items[nb_items].offset = myfile.metadata[i].offset[res];
+            items[nb_items].size = myfile.metadata[i].size[res];
+            items[nb_items].index = i;
+            items[nb_items].res = res;
+            nb_items += 1;
+        }
+        if (is_missing) {
+            submit_resize(&writers, &myfile, i, res_wanted, outdir, nb_exported);
+        }
+    }
+
+    if (err == ERR_NONE) {
+        qsort(items, nb_items, sizeof(struct export_item), export_item_cmp);
+        export_items(&writers, &myfile, items, nb_items, outdir, nb_exported);
+    }
+
+    pool_end(&writers);
+    free(selected);
+    free(items);
+    do_close(&myfile);
+    return err;
+}
+
+/********************************************************************//**
+ * Saves many images to files in one pass: images are read in the order of
+ * the file (shard after shard) and written by several threads.
+********************************************************************** */
+int do_export_cmd(int argc, char* argv[])
+{
+    if (argc < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    int res_wanted[NB_RES] = {0};
+    int has_res = 0;
+    const char* ids_file = NULL;
+    for (int index = 3; index < argc; index++) {
+        if (!strcmp(argv[index], "-res")) {
+            if (argc <= index + 1) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            const int res_code = resolution_atoi(argv[index + 1]);
+            if (res_code == -1) {
+                return ERR_RESOLUTIONS;
+            }
+            res_wanted[res_code] = 1;
+            has_res = 1;
+            index += 1;
+        } else if (!strcmp(argv[index], "-ids")) {
+            if (argc <= index + 1) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            ids_file = argv[index + 1];
+            index += 1;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    if (!has_res) {
+        res_wanted[RES_ORIG] = 1;
+    }
+
+    struct stat st;
+    if (stat(argv[2], &st) != 0) {
+        if (mkdir(argv[2], 0755) != 0) {
+            return ERR_INVALID_FILENAME;
+        }
+    } else if (!S_ISDIR(st.st_mode)) {
+        return ERR_INVALID_FILENAME;
+    }
+
+    struct shard_set set;
+    int err = shard_load(argv[1], &set);
+    size_t nb_exported = 0;
+    for (uint32_t i = 0; err == ERR_NONE && i < set.nb_shards; ++i) {
+        err = export_shard(&set, i, res_wanted, ids_file, argv[2], &nb_exported);
+    }
+    shard_free(&set);
+
+    if (err == ERR_NONE) {
+        printf("%zu image(s) exported\n", nb_exported);
+    }
+    return err;
+}
+
 int do_gc_cmd(int argc, char* argv[])
 {
     if (argc < 3) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
-    return do_gbcollect(argv[1], argv[2]);
+
+    struct shard_set set;
+    int err = shard_load(argv[1], &set);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    uint32_t shard = set.nb_shards; // all of them
+    if (argc > 3) {
+        if (strcmp(argv[3], "-shard")) {
+            err = ERR_INVALID_ARGUMENT;
+        } else if (argc < 5) {
+            err = ERR_NOT_ENOUGH_ARGUMENTS;
+        } else {
+            shard = atouint32(argv[4]);
+            if (errno == ERANGE || shard >= set.nb_shards) {
+                err = ERR_INVALID_ARGUMENT;
+            }
+        }
+    }
+    if (err == ERR_NONE) {
+        err = shard_gbcollect(&set, argv[2], shard);
+    }
+    shard_free(&set);
+    return err;
 }
 
 /********************************************************************//**
@@ -316,13 +1092,20 @@ int main (int argc, char* argv[])
         {"help", help},
         {"delete", do_delete_cmd},
         {"insert", do_insert_cmd},
+        {"insert-batch", do_insert_batch_cmd},
         {"read", do_read_cmd},
+        {"export", do_export_cmd},
         {"gc", do_gc_cmd}
     };
 
     if (argc < 2) {
         ret = ERR_NOT_ENOUGH_ARGUMENTS;
     } else {
+        // ERR_INVALID_ARGUMENT for an unknown durability
+        ret = durability_getenv(&s_durability);
+    }
+
+    if (ret == ERR_NONE) {
         if (VIPS_INIT(argv[0])) {
             vips_error_exit("unable to start VIPS");
             return ERR_IMGLIB;
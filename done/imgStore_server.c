@@ -6,8 +6,24 @@
 
 #include <signal.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <openssl/evp.h>
 #include "mongoose.h"
 #include "imgStore.h"
+#include "img_index.h"
+#include "img_cache.h"
+#include "list_cache.h"
+#include "image_content.h"
+#include "journal.h"
+#include "work_pool.h"
+#include "resize_queue.h"
+#include "shard.h"
+#include "byte_range.h"
 #include <vips/vips.h>
 #include "util.h"
 #include "string.h"
@@ -16,13 +32,44 @@
 #define MAX_IMG_NAME_STRLEN 200
 #define MAX_IMG_OFFSET_STRLEN 40
 
-#define PREFIX_STRLEN_TEMP 6
+// seconds an unfinished upload is kept without receiving a chunk
+#define UPLOAD_TIMEOUT 60
 
 #define HTTP_OK_CODE 200
+#define HTTP_PARTIAL_CODE 206
 #define HTTP_REDIRECT_CODE 302
+#define HTTP_NOT_MODIFIED_CODE 304
+#define HTTP_RANGE_ERROR_CODE 416
 #define HTTP_ERROR_CODE 500
 
+// longest Range header considered ("bytes=" and a single range of two 64 bits numbers)
+#define MAX_RANGE_STRLEN 64
+
 #define POLL_TIME 1000
+#define MAX_SENDFILE_CHUNK (1 << 20)
+
+// listings are written in chunks of LIST_CHUNK_SIZE bytes, as long as less than
+// LIST_BACKLOG bytes wait to be sent to the connection
+#define LIST_CHUNK_SIZE (16 * 1024)
+#define LIST_BACKLOG (64 * 1024)
+// longest value of the cursor or limit of a listing (a 64 bits position)
+#define MAX_LIST_PARAM_STRLEN 20
+
+// workers resizing images off the polling thread, unless given on the command line
+#define DEFAULT_NB_WORKERS 4
+
+// hot images (mostly thumbnails) are served from memory
+#define IMG_CACHE_SIZE (64 * 1024 * 1024)
+#define IMG_CACHE_MAX_ENTRY (1024 * 1024)
+
+// the content of an image never changes, but its id may be given to another one
+// (deleted, then inserted again): caches keep it a day, then revalidate its ETag
+#define IMAGE_CACHE_CONTROL "Cache-Control: public, max-age=86400\r\n"
+// the list changes with every insertion or deletion: always revalidated;
+// the same list may be sent compressed or not
+#define LIST_CACHE_CONTROL "Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n"
+// quoted SHA-256 in hexadecimal, '-' and resolution code
+#define MAX_ETAG_STRLEN (2 * SHA256_DIGEST_LENGTH + 16)
 
 // Handle interrupts, like Ctrl-C
 static int s_signo;
@@ -35,6 +82,104 @@ static void signal_handler(int signo)
 static const char *s_listening_address = "http://localhost:8000";
 static const char *s_web_directory = ".";
 
+/**
+ * Body of a reply still to be sent to a connection, once everything before it
+ * is out: an image, sent from the imgStore file to the socket with sendfile(2)
+ * (the way static_cb streams files in libmongoose), or a listing, written from
+ * the metadata arrays as the connection drains
+ */
+struct reply_body {
+    int is_listing;
+    int fd;                         // imgStore file descriptor, for an image
+    off_t offset;                   // next byte of the image to be sent
+    size_t remaining;               // number of bytes of the image still to be sent
+    const struct shard_set* store;  // shards listed, for a listing
+    struct list_stream stream;
+    struct reply_body* next;
+};
+
+/**
+ * Client connection: the bodies still to be sent, in the order of the requests.
+ * While one is pending, a resolution is being computed for the current request,
+ * or its update waits for the commit of the journal, libmongoose holds the next
+ * requests back (is_resp).
+ */
+struct client {
+    struct shard_set* store;
+    struct mg_connection* nc;
+    struct reply_body* first;       // body being sent
+    struct reply_body* last;
+    int is_resizing;                // a resize job will answer the current request
+    int is_committing;              // the update of the current request is not committed yet
+    uint32_t shard;                 // shard updated, while committing
+    struct client* next_committing; // next client waiting for a commit
+};
+
+/**
+ * Connection answered with an image, the ETag of the image, and the part of
+ * the image asked for by a Range header (if any)
+ */
+struct image_reply {
+    struct mg_connection* nc;
+    char etag[MAX_ETAG_STRLEN];
+    int is_partial;
+    uint32_t start;              // first byte sent, if partial
+    uint32_t length;             // number of bytes sent, if partial
+};
+
+/**
+ * Missing resolution of an image, computed by a worker for a waiting connection.
+ * The worker only sees the copy of the metadata taken when the job was submitted;
+ * the imgst_file is only touched on completion, back on the polling thread.
+ */
+struct resize_job {
+    struct mg_mgr* mgr;
+    unsigned long conn_id;       // connection to be answered, if still open
+    struct imgst_file* file;
+    char img_id[MAX_IMG_ID + 1];
+    int res;
+    size_t index;                // index of the metadata of the image in file
+    struct img_metadata meta;    // metadata of the image when submitted
+    uint16_t res_resized[2 * (NB_RES - 1)];
+    int fd;
+    struct resized_set set;      // missing resolutions, set by the worker
+    int error;
+};
+
+/**
+ * Image being uploaded in chunks: its content is staged in a temporary file of
+ * its own as it comes, and copied to the imgStore file once complete
+ */
+struct upload {
+    char name[MAX_IMG_NAME_STRLEN]; // name given by the client, as in the requests
+    uint32_t shard;                 // shard of the image, whose file the content goes to
+    struct imgst_file* file;
+    FILE* content;                  // content received so far, deleted when closed
+    uint64_t received;              // number of bytes received so far
+    EVP_MD_CTX* sha;                // SHA-256 of the content received so far
+    time_t last_chunk;              // when the last chunk was received
+    struct upload* next;
+};
+
+static struct upload* s_uploads = NULL;
+
+static struct work_pool s_workers;
+
+// thumbnail and small images of images inserted with eager=1, one queue per shard
+static struct resize_queue* s_eager;
+
+static struct img_cache s_cache;
+
+// complete listing, as long as no image is inserted nor deleted
+static struct list_cache s_list_cache;
+
+// clients answered once the journal of their shard is committed (group commit)
+static struct client* s_committing = NULL;
+
+// when the store was opened: versions only order the lists of one opening,
+// e.g. a garbage collection renumbers them
+static time_t s_opened;
+
 // ======================================================================
 /**
  * @brief Handles server events (eg HTTP requests).
@@ -53,18 +198,538 @@ static void mg_error_msg(struct mg_connection *nc, int error)
 }
 
 /**
- * Event handler for do_list
+ * Tells whether the client already holds the content with the given ETag
+ *
+ * @param hm the http_message that contains http information
+ * @param etag the (quoted) ETag of the content
+ * @return 1 if If-None-Match lists it (or is "*"), 0 otherwise
+ */
+static int is_not_modified(struct mg_http_message *hm, const char* etag)
+{
+    const struct mg_str* if_none_match = mg_http_get_header(hm, "If-None-Match");
+    if (if_none_match == NULL) {
+        return 0;
+    }
+    const struct mg_str tags = mg_strstrip(*if_none_match);
+    // a weak comparison, as required for If-None-Match: W/"x" matches "x"
+    return !mg_vcmp(&tags, "*") || mg_strstr(tags, mg_str(etag)) != NULL;
+}
+
+/**
+ * Replies that the content held by the client is still the current one
+ *
+ * @param nc a libmongoose connection
+ * @param etag the (quoted) ETag of the content
+ * @param cache_control the Cache-Control header line of the content
+ */
+static void reply_not_modified(struct mg_connection *nc, const char* etag, const char* cache_control)
+{
+    mg_printf(nc, "HTTP/1.1 %d Not Modified\r\nETag: %s\r\n%s\r\n", HTTP_NOT_MODIFIED_CODE, etag, cache_control);
+}
+
+/**
+ * Writes the next chunks of a listing, while little is waiting to be sent
+ *
+ * @param nc a libmongoose connection
+ * @param body the listing
+ * @return 1 once the whole listing is written, 0 otherwise
+ */
+static int write_listing(struct mg_connection *nc, struct reply_body* body)
+{
+    char buffer[LIST_CHUNK_SIZE];
+    while (nc->send.len < LIST_BACKLOG) {
+        const size_t length = do_list_json_next_all(body->store->shards, body->store->nb_shards, &body->stream,
+                                                    buffer, sizeof(buffer));
+        mg_http_write_chunk(nc, buffer, length); // the empty chunk ends the reply
+        if (length == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends what the socket accepts of an image, once the headers (and any earlier
+ * reply) left through mongoose
+ *
+ * @param nc a libmongoose connection
+ * @param body the image
+ * @return 1 once the whole image is sent, 0 otherwise
+ */
+static int write_image(struct mg_connection *nc, struct reply_body* body)
+{
+    if (nc->send.len != 0) {
+        return 0;
+    }
+    while (body->remaining > 0) {
+        const size_t chunk = body->remaining < MAX_SENDFILE_CHUNK ? body->remaining : MAX_SENDFILE_CHUNK;
+        const ssize_t nb_sent = sendfile((int) (long) nc->fd, body->fd, &body->offset, chunk);
+        if (nb_sent > 0) {
+            body->remaining -= (size_t) nb_sent;
+        } else {
+            if (nb_sent == 0 || (errno != EAGAIN && errno != EINTR)) {
+                nc->is_closing = 1;
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Sends the pending bodies of a connection, in order, as far as the socket
+ * allows, and tells libmongoose whether the connection still waits for
+ * writability and holds its next requests back
+ *
+ * @param nc a libmongoose connection
+ */
+static void progress_replies(struct mg_connection *nc)
+{
+    struct client* client = nc->fn_data;
+    while (client->first != NULL && !nc->is_closing) {
+        struct reply_body* body = client->first;
+        if (!(body->is_listing ? write_listing(nc, body) : write_image(nc, body))) {
+            break;
+        }
+        client->first = body->next;
+        free(body);
+    }
+    if (client->first == NULL) {
+        client->last = NULL;
+    }
+    // an image is sent past the send buffer: only it needs to be told of writability
+    nc->is_streaming = client->first != NULL && !client->first->is_listing;
+    nc->is_resp = client->first != NULL || client->is_resizing || client->is_committing;
+}
+
+/**
+ * Queues the body of a reply whose headers were just written, and sends what
+ * can already be sent of it
+ *
+ * @param nc a libmongoose connection
+ * @param body the body
+ */
+static void queue_body(struct mg_connection *nc, struct reply_body* body)
+{
+    struct client* client = nc->fn_data;
+    if (client->last == NULL) {
+        client->first = body;
+    } else {
+        client->last->next = body;
+    }
+    client->last = body;
+    progress_replies(nc);
+}
+
+/**
+ * Answers a successful update: at once if it is already durable, otherwise once
+ * the journal of its shard is committed, after the next poll (batch durability)
+ *
+ * @param nc a libmongoose connection
+ * @param store the shards of the imgStore
+ * @param shard the shard updated
+ */
+static void reply_updated(struct mg_connection *nc, const struct shard_set* store, uint32_t shard)
+{
+    const struct journal* journal = store->shards[shard].journal;
+    if (journal == NULL || journal->nb_uncommitted == 0) {
+        mg_http_reply(nc, HTTP_REDIRECT_CODE, "Location: /index.html\r\n", "");
+        return;
+    }
+    // the next requests wait for the reply to this one
+    struct client* client = nc->fn_data;
+    client->is_committing = 1;
+    client->shard = shard;
+    client->next_committing = s_committing;
+    s_committing = client;
+    nc->is_resp = 1;
+}
+
+/**
+ * Answers the updates waiting for the commit of the journal of a shard
+ *
+ * @param shard the shard committed
+ * @param err result of the commit
+ */
+static void reply_committed(uint32_t shard, int err)
+{
+    struct client** link = &s_committing;
+    while (*link != NULL) {
+        struct client* client = *link;
+        if (client->shard != shard) {
+            link = &client->next_committing;
+            continue;
+        }
+        *link = client->next_committing;
+        client->is_committing = 0;
+        if (err == ERR_NONE) {
+            mg_http_reply(client->nc, HTTP_REDIRECT_CODE, "Location: /index.html\r\n", "");
+        } else {
+            mg_error_msg(client->nc, err);
+        }
+        progress_replies(client->nc); // the next requests can be handled
+    }
+}
+
+/**
+ * Releases a client connection, with the bodies it did not get
+ *
+ * @param client the client
+ */
+static void free_client(struct client* client)
+{
+    if (client->is_committing) {
+        struct client** link = &s_committing;
+        while (*link != client) {
+            link = &(*link)->next_committing;
+        }
+        *link = client->next_committing;
+    }
+    while (client->first != NULL) {
+        struct reply_body* body = client->first;
+        client->first = body->next;
+        free(body);
+    }
+    free(client);
+}
+
+/**
+ * Reads an optional number of the query of a listing
+ *
+ * @param hm the http_message that contains http information
+ * @param name name of the variable
+ * @param value output value, 0 if not given
+ * @return same error code as in error.c
+ */
+static int get_list_param(struct mg_http_message *hm, const char* name, uint64_t* value)
+{
+    char str[MAX_LIST_PARAM_STRLEN + 1];
+    *value = 0;
+    const int length = mg_http_get_var(&hm->query, name, str, sizeof(str));
+    if (length == -1 || length == -4) {
+        return ERR_NONE; // no query, or not in it
+    }
+    if (length <= 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *value = atouint64(str);
+    return errno == ERANGE ? ERR_INVALID_ARGUMENT : ERR_NONE;
+}
+
+/**
+ * Replies with a page of the list, written straight from the metadata arrays
+ * as a chunked reply
+ *
+ * @param nc a libmongoose connection
+ * @param store the shards of the imgStore
+ * @param etag the ETag of the list
+ * @param cursor first position looked at
+ * @param limit maximum number of images listed (0 for all)
+ */
+static void stream_listing(struct mg_connection *nc, const struct shard_set* store, const char* etag, uint64_t cursor, uint32_t limit)
+{
+    struct reply_body* listing = calloc(1, sizeof(struct reply_body));
+    if (listing == NULL) {
+        mg_error_msg(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\nETag: %s\r\n"
+              LIST_CACHE_CONTROL "\r\n", HTTP_OK_CODE, etag);
+
+    listing->is_listing = 1;
+    listing->store = store;
+    do_list_json_start(&listing->stream, cursor, limit);
+    queue_body(nc, listing); // the first entries go out right away
+}
+
+/**
+ * Event handler for do_list: the complete list is served from s_list_cache
+ * (compressed if the client accepts gzip); a page, from the position given as
+ * cursor and of at most limit images, is streamed from the metadata arrays.
+ * The version of the store is the validator of the list.
+ *
+ * @param nc a libmongoose connection
+ * @param hm the http_message that contains http information
+ * @param store the shards of the imgStore
+ */
+static void handle_list_call(struct mg_connection *nc, struct mg_http_message *hm, const struct shard_set* store)
+{
+    uint64_t cursor = 0;
+    uint64_t limit = 0;
+    int error = get_list_param(hm, "cursor", &cursor);
+    if (error == ERR_NONE) {
+        error = get_list_param(hm, "limit", &limit);
+    }
+    if (error == ERR_NONE && limit > UINT32_MAX) {
+        error = ERR_INVALID_ARGUMENT;
+    }
+    if (error != ERR_NONE) {
+        mg_error_msg(nc, error);
+        return;
+    }
+
+    // the compressed list is another representation: it has its own (strong) ETag
+    char etag[MAX_ETAG_STRLEN];
+    char gzip_etag[MAX_ETAG_STRLEN];
+    const uint32_t version = shard_version(store);
+    snprintf(etag, sizeof(etag), "\"%lx-%" PRIu32 "\"", (unsigned long) s_opened, version);
+    snprintf(gzip_etag, sizeof(gzip_etag), "\"%lx-%" PRIu32 "-gzip\"", (unsigned long) s_opened, version);
+    if (is_not_modified(hm, etag)) {
+        reply_not_modified(nc, etag, LIST_CACHE_CONTROL);
+        return;
+    }
+    if (is_not_modified(hm, gzip_etag)) {
+        reply_not_modified(nc, gzip_etag, LIST_CACHE_CONTROL);
+        return;
+    }
+
+    if (cursor != 0 || limit != 0 || list_cache_refresh(&s_list_cache, store) != ERR_NONE) {
+        stream_listing(nc, store, etag, cursor, (uint32_t) limit);
+        return;
+    }
+
+    const struct mg_str* accept_encoding = mg_http_get_header(hm, "Accept-Encoding");
+    if (s_list_cache.gzip != NULL && accept_encoding != NULL && mg_strstr(*accept_encoding, mg_str("gzip")) != NULL) {
+        mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Type: application/json\r\nContent-Encoding: gzip\r\nContent-Length: %zu\r\n"
+                  "ETag: %s\r\n" LIST_CACHE_CONTROL "\r\n", HTTP_OK_CODE, s_list_cache.gzip_size, gzip_etag);
+        mg_send(nc, s_list_cache.gzip, s_list_cache.gzip_size);
+    } else {
+        mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+                  "ETag: %s\r\n" LIST_CACHE_CONTROL "\r\n", HTTP_OK_CODE, s_list_cache.json_size, etag);
+        mg_send(nc, s_list_cache.json, s_list_cache.json_size);
+    }
+}
+
+/**
+ * Computes the ETag of an image: its content is identified by its SHA and resolution
+ *
+ * @param etag output ETag, of MAX_ETAG_STRLEN chars
+ * @param SHA SHA-256 of the original content of the image
+ * @param res resolution code
+ */
+static void image_etag(char* etag, const unsigned char* SHA, int res)
+{
+    char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        sprintf(&sha_string[2 * i], "%02x", SHA[i]);
+    }
+    snprintf(etag, MAX_ETAG_STRLEN, "\"%s-%d\"", sha_string, res);
+}
+
+/**
+ * Writes the status line and headers of an image reply
+ *
+ * @param reply the connection, the ETag of the image and the requested part
+ * @param image_size size of the image
+ */
+static void send_image_headers(const struct image_reply* reply, size_t image_size)
+{
+    if (reply->is_partial) {
+        mg_printf(reply->nc, "HTTP/1.1 %d Partial Content\r\nContent-Type: image/jpeg\r\nContent-Length: %" PRIu32
+                  "\r\nContent-Range: bytes %" PRIu32 "-%" PRIu32 "/%zu\r\nETag: %s\r\n" IMAGE_CACHE_CONTROL "\r\n",
+                  HTTP_PARTIAL_CODE, reply->length, reply->start, reply->start + reply->length - 1, image_size, reply->etag);
+    } else {
+        mg_printf(reply->nc, "HTTP/1.1 %d OK\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\nAccept-Ranges: bytes\r\n"
+                  "ETag: %s\r\n" IMAGE_CACHE_CONTROL "\r\n", HTTP_OK_CODE, image_size, reply->etag);
+    }
+}
+
+/**
+ * Reads the Range header of an image request: a single range of bytes is
+ * served as a partial reply; anything else (no Range, several ranges, invalid
+ * syntax, or an If-Range no longer matching) gets the whole image
+ *
+ * @param hm the http_message that contains http information
+ * @param reply the image reply, whose range is set
+ * @param image_size size of the image
+ * @return 0 if satisfiable (or ignored), -1 if no byte of the range is in the image
+ */
+static int parse_range(struct mg_http_message *hm, struct image_reply* reply, uint32_t image_size)
+{
+    reply->is_partial = 0;
+    const struct mg_str* range = mg_http_get_header(hm, "Range");
+    if (range == NULL || range->len >= MAX_RANGE_STRLEN) {
+        return 0;
+    }
+    // If-Range only holds our ETag if the client got it from us: a date means "changed"
+    const struct mg_str* if_range = mg_http_get_header(hm, "If-Range");
+    if (if_range != NULL && mg_vcmp(if_range, reply->etag)) {
+        return 0;
+    }
+
+    char spec[MAX_RANGE_STRLEN];
+    memcpy(spec, range->ptr, range->len);
+    spec[range->len] = '\0';
+    const int is_partial = byte_range_parse(spec, image_size, &reply->start, &reply->length);
+    if (is_partial < 0) {
+        return -1;
+    }
+    reply->is_partial = is_partial;
+    return 0;
+}
+
+/**
+ * Replies with the image (or its requested part) at the given place of the file:
+ * the headers go through mongoose, the content from the file to the socket,
+ * once the headers are out
+ *
+ * @param reply the connection, the ETag of the image and the requested part
+ * @param file the imgst_file holding the image
+ * @param offset offset of the image in file
+ * @param image_size size of the image
+ */
+static void send_image(const struct image_reply* reply, const struct imgst_file* file, uint64_t offset, uint32_t image_size)
+{
+    struct reply_body* transfer = calloc(1, sizeof(struct reply_body));
+    if (transfer == NULL) {
+        mg_error_msg(reply->nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+
+    send_image_headers(reply, image_size);
+
+    transfer->fd = fileno(file->file);
+    transfer->offset = (off_t) (reply->is_partial ? offset + reply->start : offset);
+    transfer->remaining = reply->is_partial ? reply->length : image_size;
+    queue_body(reply->nc, transfer);
+}
+
+/**
+ * Replies with an image (or its requested part) held in memory
+ *
+ * @param arg the image_reply
+ * @param data the image
+ * @param size size of the image
+ */
+static void send_image_bytes(void* arg, const void* data, size_t size)
+{
+    const struct image_reply* reply = arg;
+    send_image_headers(reply, size);
+    if (reply->is_partial) {
+        mg_send(reply->nc, (const char*) data + reply->start, reply->length);
+    } else {
+        mg_send(reply->nc, data, size);
+    }
+}
+
+/**
+ * Replies with an image seen through a mapping of the file (no copy but the one
+ * kept in the cache), when small enough to be cached; larger ones are sent from
+ * the file to the socket directly
+ *
+ * @param reply the connection, the ETag of the image and the requested part
+ * @param file the imgst_file holding the image
+ * @param meta metadata of the image
+ * @param res resolution to be sent
+ */
+static void send_and_cache(struct image_reply* reply, struct imgst_file* file, const struct img_metadata* meta, int res)
+{
+    const uint32_t size = meta->size[res];
+    struct img_view view;
+    if (size > s_cache.max_entry || do_read_view(meta->img_id, res, &view, file) != ERR_NONE) {
+        send_image(reply, file, meta->offset[res], size);
+        return;
+    }
+    cache_put(&s_cache, meta->SHA, res, view.data, view.size);
+    send_image_bytes(reply, view.data, view.size);
+    release_view(&view, file);
+}
+
+/**
+ * Worker side of a resize job: decodes the original and encodes every missing resolution
+ *
+ * @param arg the resize_job
+ */
+static void run_resize(void* arg)
+{
+    struct resize_job* job = arg;
+    job->error = resize_original(job->fd, &job->meta, job->res_resized, &job->set);
+}
+
+/**
+ * Polling thread side of a resize job: stores the new resolutions (unless the image
+ * changed meanwhile) and answers the connection, if it is still open.
+ * Only the decoding and encoding run on the workers: appending the new images
+ * and updating the metadata stay on the polling thread, which owns the FILE
+ * and the metadata of the store (a few tens of kB, written through stdio).
+ *
+ * @param arg the resize_job
+ */
+static void complete_resize(void* arg)
+{
+    struct resize_job* job = arg;
+    const struct img_metadata* meta = &job->file->metadata[job->index];
+
+    int error = job->error;
+    if (error == ERR_NONE && (meta->is_valid != NON_EMPTY || strcmp(meta->img_id, job->img_id)
+                              || meta->offset[RES_ORIG] != job->meta.offset[RES_ORIG])) {
+        error = ERR_FILE_NOT_FOUND; // deleted while being resized
+    }
+    // another request for the same image may have been completed first: its resolutions are kept
+    if (error == ERR_NONE) {
+        error = store_resized(job->file, job->index, &job->set);
+    }
+    resized_free(&job->set);
+
+    struct mg_connection* nc = job->mgr->conns;
+    while (nc != NULL && nc->id != job->conn_id) {
+        nc = nc->next;
+    }
+    if (nc != NULL && !nc->is_closing) {
+        ((struct client*) nc->fn_data)->is_resizing = 0;
+        if (error != ERR_NONE) {
+            mg_error_msg(nc, error);
+        } else {
+            struct image_reply reply = {.nc = nc};
+            image_etag(reply.etag, meta->SHA, job->res);
+            send_and_cache(&reply, job->file, meta, job->res);
+        }
+        progress_replies(nc); // the next requests can be handled
+    }
+    free(job);
+}
+
+/**
+ * Hands the computation of a missing resolution over to the workers;
+ * the connection is answered once it is done
  *
  * @param nc a libmongoose connection
  * @param file an imgst_file that we are going to use
+ * @param img_id id of the image
+ * @param res_code resolution to be computed
+ * @param index index of the metadata of the image in file
+ * @return same error code as in error.c
  */
-static void handle_list_call(struct mg_connection *nc, const struct imgst_file* file)
+static int submit_resize(struct mg_connection *nc, struct imgst_file* file, const char* img_id, int res_code, uint32_t index)
 {
-    char* do_list_reply = do_list(file, JSON);
-    mg_http_reply(nc, HTTP_OK_CODE, "Content-Type: application/json\r\n", "%s", do_list_reply);
-    if(do_list_reply != NULL) {
-        free(do_list_reply);
+    // the workers read the original through the descriptor, not through stdio
+    if (fflush(file->file) != 0) {
+        return ERR_IO;
+    }
+
+    struct resize_job* job = calloc(1, sizeof(struct resize_job));
+    if (job == NULL) {
+        return ERR_OUT_OF_MEMORY;
     }
+    job->mgr = nc->mgr;
+    job->conn_id = nc->id;
+    job->file = file;
+    strncpy(job->img_id, img_id, MAX_IMG_ID);
+    job->res = res_code;
+    job->index = index;
+    job->meta = file->metadata[index];
+    memcpy(job->res_resized, file->header.res_resized, sizeof(job->res_resized));
+    job->fd = fileno(file->file);
+
+    int error = pool_submit(&s_workers, run_resize, complete_resize, job);
+    if (error != ERR_NONE) {
+        free(job);
+        return error;
+    }
+    // the next requests wait for the reply to this one
+    ((struct client*) nc->fn_data)->is_resizing = 1;
+    nc->is_resp = 1;
+    return ERR_NONE;
 }
 
 /**
@@ -72,9 +737,9 @@ static void handle_list_call(struct mg_connection *nc, const struct imgst_file*
  *
  * @param nc a libmongoose connection
  * @param hm the http_message that contains http information
- * @param file an imgst_file that we are going to use
+ * @param store the shards of the imgStore
  */
-static void handle_read_call(struct mg_connection *nc, struct mg_http_message *hm, const struct imgst_file* file)
+static void handle_read_call(struct mg_connection *nc, struct mg_http_message *hm, struct shard_set* store)
 {
     char* img_id = malloc(MAX_IMG_ID+1);
     char* res = malloc(MAX_RES_TXT_LEN+1);
@@ -98,24 +763,53 @@ static void handle_read_call(struct mg_connection *nc, struct mg_http_message *h
         return;
     }
 
-    char* image_buffer = NULL;
-    uint32_t image_size = 0;
-
-    int error = do_read(img_id, res_code, &image_buffer, &image_size, file);
-    if(error != ERR_NONE) {
+    struct imgst_file* file = &store->shards[shard_of(store, img_id)];
+    uint32_t index = 0;
+    int error = index_find_id(file, img_id, &index);
+    struct image_reply reply = {.nc = nc};
+    if (error == ERR_NONE) {
+        // known from the SHA alone, even before the resolution is computed
+        image_etag(reply.etag, file->metadata[index].SHA, res_code);
+        if (is_not_modified(hm, reply.etag)) {
+            free(img_id);
+            free(res);
+            reply_not_modified(nc, reply.etag, IMAGE_CACHE_CONTROL);
+            return;
+        }
+    }
+    if (error == ERR_NONE && file->metadata[index].size[res_code] == 0) {
+        // not computed yet: decoding and resizing would stall every other connection
+        error = submit_resize(nc, file, img_id, res_code, index);
         free(img_id);
         free(res);
-        mg_error_msg(nc, error);
+        if (error != ERR_NONE) {
+            mg_error_msg(nc, error);
+        }
         return;
     }
 
-    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Type: image/jpeg\r\nContent-Length: %" PRIu32 "\r\n\r\n", HTTP_OK_CODE, image_size);
-
-    mg_send(nc, (void*) image_buffer, image_size);
-
     free(img_id);
     free(res);
-    free(image_buffer);
+    if(error != ERR_NONE) {
+        mg_error_msg(nc, error);
+        return;
+    }
+
+    const struct img_metadata* meta = &file->metadata[index];
+    if (parse_range(hm, &reply, meta->size[res_code]) != 0) {
+        mg_printf(nc, "HTTP/1.1 %d Range Not Satisfiable\r\nContent-Range: bytes */%" PRIu32 "\r\nContent-Length: 0\r\n\r\n",
+                  HTTP_RANGE_ERROR_CODE, meta->size[res_code]);
+        return;
+    }
+    if (cache_get(&s_cache, meta->SHA, res_code, send_image_bytes, &reply) == ERR_NONE) {
+        return; // without touching the file
+    }
+    // images are read through the descriptor: stdio must not hold part of them
+    if (fflush(file->file) != 0) {
+        mg_error_msg(nc, ERR_IO);
+        return;
+    }
+    send_and_cache(&reply, file, meta, res_code);
 }
 
 /**
@@ -123,9 +817,9 @@ static void handle_read_call(struct mg_connection *nc, struct mg_http_message *h
  *
  * @param nc a libmongoose connection
  * @param hm the http_message that contains http information
- * @param file an imgst_file that we are going to use
+ * @param store the shards of the imgStore
  */
-static void handle_delete_call(struct mg_connection *nc, struct mg_http_message *hm, struct imgst_file* file)
+static void handle_delete_call(struct mg_connection *nc, struct mg_http_message *hm, struct shard_set* store)
 {
     char* img_id = malloc(MAX_IMG_ID+1);
     if(img_id == NULL) {
@@ -142,11 +836,24 @@ static void handle_delete_call(struct mg_connection *nc, struct mg_http_message
         return;
     }
 
+    // the cached versions of its content are dropped with it
+    const uint32_t shard = shard_of(store, img_id);
+    struct imgst_file* file = &store->shards[shard];
+    uint32_t index = 0;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    const int is_found = index_find_id(file, img_id, &index) == ERR_NONE;
+    if (is_found) {
+        memcpy(SHA, file->metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    }
+
     int err = do_delete(img_id, file);
     free(img_id);
+    if (err == ERR_NONE && is_found) {
+        cache_remove(&s_cache, SHA);
+    }
 
     if(err == ERR_NONE) {
-        mg_http_reply(nc, HTTP_REDIRECT_CODE, "Location: /index.html\r\n", "");
+        reply_updated(nc, store, shard);
     } else {
         mg_error_msg(nc, err);
     }
@@ -154,72 +861,281 @@ static void handle_delete_call(struct mg_connection *nc, struct mg_http_message
 }
 
 /**
- * Event handler for do_insert
+ * Looks for the upload in progress with the given name
  *
- * @param nc a libmongoose connection
- * @param hm the http_message that contains http information
- * @param file an imgst_file that we are going to use
+ * @param name name of the uploaded image
+ * @return the upload, NULL if none
  */
-static void handle_insert_call(struct mg_connection *nc, struct mg_http_message *hm, struct imgst_file* file)
+static struct upload* find_upload(const char* name)
 {
-    if (hm->body.len != 0) {
-        mg_http_upload(nc, hm, "/tmp");
-    } else {
-        char offset[MAX_IMG_OFFSET_STRLEN] = "";
-        char img_id[MAX_IMG_NAME_STRLEN] = "";
-        mg_http_get_var(&hm->query, "offset", offset, sizeof(offset));
-        mg_http_get_var(&hm->query, "name", img_id, sizeof(img_id));
+    struct upload* upload = s_uploads;
+    while (upload != NULL && strcmp(upload->name, name)) {
+        upload = upload->next;
+    }
+    return upload;
+}
+
+/**
+ * Removes an upload from the list of uploads in progress, with what it received
+ *
+ * @param upload the upload to be forgotten
+ */
+static void forget_upload(struct upload* upload)
+{
+    struct upload** link = &s_uploads;
+    while (*link != NULL && *link != upload) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = upload->next;
+    }
+    if (upload->content != NULL) {
+        fclose(upload->content);
+    }
+    EVP_MD_CTX_free(upload->sha);
+    free(upload);
+}
+
+/**
+ * Drops the uploads that got no chunk for UPLOAD_TIMEOUT seconds: their
+ * client is most likely gone
+ *
+ * @param now current time
+ */
+static void expire_uploads(time_t now)
+{
+    struct upload* upload = s_uploads;
+    while (upload != NULL) {
+        struct upload* next = upload->next;
+        if (now - upload->last_chunk > UPLOAD_TIMEOUT) {
+            forget_upload(upload);
+        }
+        upload = next;
+    }
+}
+
+/**
+ * Appends a chunk of an upload to its temporary file
+ *
+ * @param upload the upload
+ * @param chunk the chunk
+ * @return same error code as in error.c
+ */
+static int append_chunk(struct upload* upload, const struct mg_str* chunk)
+{
+    if (upload->received + chunk->len > UINT32_MAX) {
+        return ERR_INVALID_ARGUMENT; // sizes of images are 32 bits
+    }
+    if (fwrite(chunk->ptr, chunk->len, 1, upload->content) != 1
+        || EVP_DigestUpdate(upload->sha, chunk->ptr, chunk->len) != 1) {
+        return ERR_IO;
+    }
+    upload->received += chunk->len;
+    upload->last_chunk = time(NULL);
+    return ERR_NONE;
+}
 
-        uint32_t size_of_buffer = atouint32(offset);
+/**
+ * Finds the shard of an uploaded image: its id is its name without extension
+ *
+ * @param store the shards of the imgStore
+ * @param name name of the uploaded image
+ * @return index of the shard
+ */
+static uint32_t upload_shard(const struct shard_set* store, const char* name)
+{
+    char img_id[MAX_IMG_NAME_STRLEN] = "";
+    strncpy(img_id, name, MAX_IMG_NAME_STRLEN - 1);
+    char* ext = strrchr(img_id, '.');
+    if (ext != NULL) {
+        *ext = '\0';
+    }
+    return shard_of(store, img_id);
+}
 
-        char* fImName = malloc(PREFIX_STRLEN_TEMP+strlen(img_id)+1);
-        strncpy(fImName,"/tmp/",PREFIX_STRLEN_TEMP);
-        strcat(fImName, img_id);
+/**
+ * Handles a chunk of an upload: it goes to the temporary file of the upload
+ *
+ * @param nc a libmongoose connection
+ * @param hm the http_message that contains http information
+ * @param store the shards of the imgStore
+ */
+static void handle_upload_chunk(struct mg_connection *nc, struct mg_http_message *hm, struct shard_set* store)
+{
+    char offset[MAX_IMG_OFFSET_STRLEN] = "";
+    char name[MAX_IMG_NAME_STRLEN] = "";
+    mg_http_get_var(&hm->query, "offset", offset, sizeof(offset));
+    mg_http_get_var(&hm->query, "name", name, sizeof(name));
+    if (name[0] == '\0') {
+        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
 
-        FILE* fileIm = fopen(fImName, "rb");
-        if (fileIm==NULL) {
-            free(fImName);
-            mg_error_msg(nc, ERR_FILE_NOT_FOUND);
+    struct upload* upload = find_upload(name);
+    const uint64_t chunk_offset = strtoull(offset, NULL, 10);
+    if (chunk_offset == 0) {
+        // (re)starting an upload
+        if (upload != NULL) {
+            forget_upload(upload);
+        }
+        // anything but a JPEG image is rejected before a byte is staged
+        if (check_jpeg(hm->body.ptr, hm->body.len) != ERR_NONE) {
+            mg_error_msg(nc, ERR_IMGLIB);
             return;
         }
-
-        //want to have the pointer on the last .??? that is used as an extension for a file.
-        char* ptr = strrchr(img_id, '.');
-        if(ptr != NULL) {
-            *ptr = '\0';
+        upload = calloc(1, sizeof(struct upload));
+        if (upload == NULL || (upload->sha = EVP_MD_CTX_new()) == NULL
+            || EVP_DigestInit_ex(upload->sha, EVP_sha256(), NULL) != 1) {
+            if (upload != NULL) {
+                EVP_MD_CTX_free(upload->sha);
+                free(upload);
+            }
+            mg_error_msg(nc, ERR_OUT_OF_MEMORY);
+            return;
         }
-
-        if(strlen(img_id)>=MAX_IMG_ID) {
-            free(fImName);
-            mg_error_msg(nc, ERR_INVALID_IMGID);
+        upload->content = tmpfile();
+        if (upload->content == NULL) {
+            EVP_MD_CTX_free(upload->sha);
+            free(upload);
+            mg_error_msg(nc, ERR_IO);
             return;
         }
+        strncpy(upload->name, name, MAX_IMG_NAME_STRLEN - 1);
+        upload->shard = upload_shard(store, name);
+        upload->file = &store->shards[upload->shard];
+        upload->next = s_uploads;
+        s_uploads = upload;
+    } else if (upload == NULL || chunk_offset != upload->received) {
+        if (upload != NULL) {
+            forget_upload(upload);
+        }
+        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
 
-        char* img_buffer = malloc(size_of_buffer+1);
+    int err = append_chunk(upload, &hm->body);
+    if (err != ERR_NONE) {
+        forget_upload(upload);
+        mg_error_msg(nc, err);
+        return;
+    }
+    mg_http_reply(nc, HTTP_OK_CODE, "", "");
+}
 
-        fread(img_buffer, size_of_buffer, 1, fileIm);
-        fclose(fileIm);
+/**
+ * Event handler for do_insert: chunks of the image are staged as they come, the
+ * image is inserted in the file of its shard on the last (empty) request
+ *
+ * @param nc a libmongoose connection
+ * @param hm the http_message that contains http information
+ * @param store the shards of the imgStore
+ */
+static void handle_insert_call(struct mg_connection *nc, struct mg_http_message *hm, struct shard_set* store)
+{
+    if (hm->body.len != 0) {
+        handle_upload_chunk(nc, hm, store);
+        return;
+    }
 
-        int err = do_insert(img_buffer, size_of_buffer, img_id, file);
+    char offset[MAX_IMG_OFFSET_STRLEN] = "";
+    char img_id[MAX_IMG_NAME_STRLEN] = "";
+    mg_http_get_var(&hm->query, "offset", offset, sizeof(offset));
+    mg_http_get_var(&hm->query, "name", img_id, sizeof(img_id));
 
-        if(img_buffer != NULL) {
-            free(img_buffer);
-            img_buffer = NULL;
-        }
+    struct upload* upload = find_upload(img_id);
+    if (upload == NULL) {
+        mg_error_msg(nc, ERR_FILE_NOT_FOUND);
+        return;
+    }
 
-        if(fImName != NULL) {
-            free(fImName);
-            fImName = NULL;
-        }
+    //want to have the pointer on the last .??? that is used as an extension for a file.
+    char* ptr = strrchr(img_id, '.');
+    if(ptr != NULL) {
+        *ptr = '\0';
+    }
+
+    if(strlen(img_id)>=MAX_IMG_ID) {
+        forget_upload(upload);
+        mg_error_msg(nc, ERR_INVALID_IMGID);
+        return;
+    }
+    if (atouint32(offset) != upload->received) {
+        forget_upload(upload);
+        mg_error_msg(nc, ERR_IO);
+        return;
+    }
 
+    const uint32_t shard = upload->shard;
+    struct imgst_file* file = upload->file;
 
-        if(err == ERR_NONE) {
-            mg_http_reply(nc, HTTP_REDIRECT_CODE, "Location: /index.html\r\n", "");
-        } else {
-            mg_error_msg(nc, err);
-        }
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t index = 0;
+    int err = EVP_DigestFinal_ex(upload->sha, SHA, NULL) == 1 && fflush(upload->content) == 0 ? ERR_NONE : ERR_IO;
+    if (err == ERR_NONE) {
+        // copied to the imgStore file only now, in one piece, unless already stored
+        err = do_insert_fd(img_id, fileno(upload->content), (uint32_t) upload->received, SHA, file, &index);
+    }
+    forget_upload(upload);
+
+    char eager[2] = "";
+    mg_http_get_var(&hm->query, "eager", eager, sizeof(eager));
+    if (err == ERR_NONE && !strcmp(eager, "1")) {
+        err = resize_queue_add(&s_eager[shard], index);
     }
 
+    if(err == ERR_NONE) {
+        reply_updated(nc, store, shard);
+    } else {
+        mg_error_msg(nc, err);
+    }
+}
+
+/**
+ * Event handler of the socket the workers write to when a job is finished:
+ * it only has to wake up the polling, jobs are completed after each poll
+ *
+ * @param nc the wakeup connection
+ * @param ev an event number, defined in mongoose.h
+ * @param ev_data pointer to the event-specific data
+ * @param fn_data unused
+ */
+static void wakeup_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data)
+{
+    (void) ev_data;
+    (void) fn_data;
+    if (ev == MG_EV_READ) {
+        nc->recv.len = 0;
+    }
+}
+
+/**
+ * Opens the sockets through which the workers wake up the polling thread
+ * (a loopback UDP pair: libmongoose waits for one end like for its own
+ * connections) and gives the other end to the workers
+ *
+ * @param mgr the libmongoose manager
+ * @param nb_shards number of shards, each with its resize queue
+ * @return same error code as in error.c
+ */
+static int open_wakeup(struct mg_mgr* mgr, uint32_t nb_shards)
+{
+    int fd = -1;
+    int watched = -1;
+    if (!mg_socketpair(&fd, &watched)) {
+        return ERR_IO;
+    }
+    if (mg_wrapfd(mgr, watched, wakeup_handler, NULL) == NULL) {
+        close(fd);
+        close(watched);
+        return ERR_IO;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    s_workers.notify_fd = fd;
+    for (uint32_t i = 0; i < nb_shards; ++i) {
+        s_eager[i].pool.notify_fd = fd;
+    }
+    return ERR_NONE;
 }
 
 /**
@@ -237,16 +1153,42 @@ static void event_handler(struct mg_connection *nc,
                          )
 {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    // the listening connection keeps the store, each client connection its own client
+    struct client* client = nc->is_accepted ? fn_data : NULL;
     switch (ev) {
+    case MG_EV_ACCEPT:
+        client = calloc(1, sizeof(struct client));
+        if (client == NULL) {
+            nc->is_closing = 1;
+        } else {
+            client->store = fn_data;
+            client->nc = nc;
+        }
+        nc->fn_data = client;
+        break;
+    case MG_EV_WRITE:
+        if (client != NULL) {
+            progress_replies(nc);
+        }
+        break;
+    case MG_EV_CLOSE:
+        if (client != NULL) {
+            free_client(client);
+            nc->fn_data = NULL;
+        }
+        break;
     case MG_EV_HTTP_MSG:
+        if (client == NULL) {
+            break;
+        }
         if (mg_http_match_uri(hm, "/imgStore/list")) {
-            handle_list_call(nc, fn_data);
+            handle_list_call(nc, hm, client->store);
         } else if (mg_http_match_uri(hm, "/imgStore/read")) {
-            handle_read_call(nc, hm, fn_data);
+            handle_read_call(nc, hm, client->store);
         } else if (mg_http_match_uri(hm, "/imgStore/delete")) {
-            handle_delete_call(nc, hm, fn_data);
+            handle_delete_call(nc, hm, client->store);
         } else if (mg_http_match_uri(hm, "/imgStore/insert") && !mg_vcasecmp(&(hm->method),"POST")) {
-            handle_insert_call(nc, hm, fn_data);
+            handle_insert_call(nc, hm, client->store);
         } else {
             struct mg_http_serve_opts opts = {.root_dir = s_web_directory};
             mg_http_serve_dir(nc, ev_data, &opts);
@@ -260,11 +1202,17 @@ static void event_handler(struct mg_connection *nc,
  *********************************************************************/
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
+    if (argc != 2 && argc != 3) {
         fprintf(stderr, "%s", ERR_MESSAGES[ERR_NOT_ENOUGH_ARGUMENTS]);
         return 1;
     }
 
+    const uint16_t nb_workers = argc == 3 ? atouint16(argv[2]) : DEFAULT_NB_WORKERS;
+    if (nb_workers == 0) {
+        fprintf(stderr, "%s", ERR_MESSAGES[ERR_INVALID_ARGUMENT]);
+        return 1;
+    }
+
     if (VIPS_INIT(argv[0])) {
         vips_error_exit("unable to start VIPS");
         fprintf(stderr, "%s", ERR_MESSAGES[ERR_IMGLIB]);
@@ -272,14 +1220,28 @@ int main(int argc, char *argv[])
     }
 
 
-    //image_filename = argv[1];
-    struct imgst_file myfile;
-    memset(&myfile, 0, sizeof(myfile));
-    int err_open = do_open(argv[1], "r+b", &myfile);
+    // a plain imgStore file is a store of one shard
+    struct shard_set store;
+    enum durability durability = DURABILITY_NONE;
+    int err_open = durability_getenv(&durability);
+    if (err_open == ERR_NONE) {
+        err_open = shard_load(argv[1], &store);
+    }
+    if (err_open == ERR_NONE) {
+        err_open = shard_open(&store, "r+b", durability);
+    }
     if(err_open != ERR_NONE) {
         fprintf(stderr, "%s", ERR_MESSAGES[ERR_IO]);
         return 1;
     }
+    s_opened = time(NULL);
+
+    // one descriptor per keep-alive connection: allow as many as the system lets us
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
 
     //create signal
     signal(SIGINT, signal_handler);
@@ -288,20 +1250,72 @@ int main(int argc, char *argv[])
     /* Create server */
     struct mg_mgr mgr;
     mg_mgr_init(&mgr);
-    if (mg_http_listen(&mgr, s_listening_address, event_handler, &myfile) == NULL) {
+    if (mg_http_listen(&mgr, s_listening_address, event_handler, &store) == NULL) {
         fprintf(stderr, "Error starting server on address %s\n", s_listening_address);
         return 1;
     }
 
+    if (cache_init(&s_cache, IMG_CACHE_SIZE, IMG_CACHE_MAX_ENTRY) != ERR_NONE) {
+        fprintf(stderr, "%s", ERR_MESSAGES[ERR_OUT_OF_MEMORY]);
+        return 1;
+    }
+    list_cache_init(&s_list_cache);
+
+    s_eager = calloc(store.nb_shards, sizeof(struct resize_queue));
+    int err_start = s_eager == NULL ? ERR_OUT_OF_MEMORY : pool_init(&s_workers, nb_workers, 0);
+    for (uint32_t i = 0; err_start == ERR_NONE && i < store.nb_shards; ++i) {
+        err_start = resize_queue_start(&s_eager[i], &store.shards[i]);
+    }
+    if (err_start != ERR_NONE || open_wakeup(&mgr, store.nb_shards) != ERR_NONE) {
+        fprintf(stderr, "Error starting the resizing workers\n");
+        return 1;
+    }
+    // images inserted with eager=1 and not resized before the last stop
+    for (uint32_t i = 0; i < store.nb_shards; ++i) {
+        resize_queue_resume(&s_eager[i]);
+    }
+
     printf("Starting imgStore server on %s\n", s_listening_address);
-    print_header(&(myfile.header));
+    for (uint32_t i = 0; i < store.nb_shards; ++i) {
+        if (store.is_sharded) {
+            printf("SHARD %" PRIu32 ": %s\n", i, store.filenames[i]);
+        }
+        print_header(&store.shards[i].header);
+    }
 
     /* Poll */
-    while (s_signo == 0) mg_mgr_poll(&mgr, POLL_TIME);
+    while (s_signo == 0) {
+        // pending bodies are sent on writability: nothing to poll for
+        mg_mgr_poll(&mgr, POLL_TIME);
+        pool_complete(&s_workers);
+        expire_uploads(time(NULL));
+        for (uint32_t i = 0; i < store.nb_shards; ++i) {
+            resize_queue_complete(&s_eager[i]);
+            // group commit: one sync for every update made by this loop (batch durability),
+            // whose replies were held until now
+            reply_committed(i, journal_commit(&store.shards[i]));
+        }
+    }
     /* Cleanup */
+    pool_end(&s_workers);
+    for (uint32_t i = 0; i < store.nb_shards; ++i) {
+        resize_queue_end(&s_eager[i]);
+    }
+    free(s_eager);
+    while (s_uploads != NULL) {
+        forget_upload(s_uploads);
+    }
+    close(s_workers.notify_fd);
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    cache_stats(&s_cache, &hits, &misses);
+    printf("Image cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+    cache_free(&s_cache);
+    printf("List cache: %" PRIu64 " hits, %" PRIu64 " misses\n", s_list_cache.hits, s_list_cache.misses);
+    list_cache_free(&s_list_cache);
     vips_shutdown();
     mg_mgr_free(&mgr);
-    do_close(&myfile);
+    shard_free(&store);
 
     return ERR_NONE;
 }
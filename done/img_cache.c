@@ -0,0 +1,262 @@
+/**
+ * @file img_cache.c
+ * @brief imgStore library: sharded LRU cache of image contents implementation.
+ */
+
+#include "img_cache.h"
+#include <stdlib.h> // for calloc, malloc, free
+#include <string.h> // for memcpy, memcmp
+
+struct cache_entry {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int res;
+    size_t size;
+    struct cache_entry* chain;   // next entry of the same bucket
+    struct cache_entry* newer;   // LRU list
+    struct cache_entry* older;
+    unsigned char data[];
+};
+
+/**
+ * Hashes a key; the SHA is already uniformly distributed
+ *
+ * @param SHA SHA-256 of the content
+ * @param res resolution code
+ * @return the hash
+ */
+static uint64_t key_hash(const unsigned char* SHA, int res)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash ^ ((uint64_t) res * 0x9E3779B97F4A7C15ull);
+}
+
+/**
+ * Finds the shard of a key
+ *
+ * @param cache the cache
+ * @param hash hash of the key
+ * @return the shard
+ */
+static struct cache_shard* shard_of(struct img_cache* cache, uint64_t hash)
+{
+    return &cache->shards[hash % IMG_CACHE_SHARDS];
+}
+
+/**
+ * Finds the bucket of a key in its shard
+ *
+ * @param shard the shard
+ * @param hash hash of the key
+ * @return the head of the hash chain
+ */
+static struct cache_entry** bucket_of(struct cache_shard* shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / IMG_CACHE_SHARDS) & (IMG_CACHE_BUCKETS - 1)];
+}
+
+/**
+ * Unlinks an entry from the LRU list of its shard
+ *
+ * @param shard the shard locked by the caller
+ * @param entry the entry
+ */
+static void lru_unlink(struct cache_shard* shard, struct cache_entry* entry)
+{
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+/**
+ * Links an entry as the most recently used of its shard
+ *
+ * @param shard the shard locked by the caller
+ * @param entry the entry
+ */
+static void lru_push(struct cache_shard* shard, struct cache_entry* entry)
+{
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest != NULL) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
+
+/**
+ * Removes an entry from its shard and releases it
+ *
+ * @param shard the shard locked by the caller
+ * @param link link to the entry in its hash chain
+ */
+static void drop_entry(struct cache_shard* shard, struct cache_entry** link)
+{
+    struct cache_entry* entry = *link;
+    *link = entry->chain;
+    lru_unlink(shard, entry);
+    shard->used -= entry->size;
+    free(entry);
+}
+
+/**
+ * Finds the link to an entry in its hash chain
+ *
+ * @param shard the shard locked by the caller
+ * @param hash hash of the key
+ * @param SHA SHA-256 of the content
+ * @param res resolution code
+ * @return the link, pointing to NULL if not found
+ */
+static struct cache_entry** find_link(struct cache_shard* shard, uint64_t hash, const unsigned char* SHA, int res)
+{
+    struct cache_entry** link = bucket_of(shard, hash);
+    while (*link != NULL && ((*link)->res != res || memcmp((*link)->SHA, SHA, SHA256_DIGEST_LENGTH))) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+int cache_init(struct img_cache* cache, size_t capacity, size_t max_entry)
+{
+    if (cache == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(cache, 0, sizeof(struct img_cache));
+    const size_t shard_capacity = capacity / IMG_CACHE_SHARDS;
+    cache->max_entry = max_entry < shard_capacity ? max_entry : shard_capacity;
+    for (size_t i = 0; i < IMG_CACHE_SHARDS; ++i) {
+        struct cache_shard* shard = &cache->shards[i];
+        shard->capacity = shard_capacity;
+        shard->buckets = calloc(IMG_CACHE_BUCKETS, sizeof(struct cache_entry*));
+        if (shard->buckets == NULL) {
+            cache_free(cache);
+            return ERR_OUT_OF_MEMORY;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return ERR_NONE;
+}
+
+int cache_get(struct img_cache* cache, const unsigned char* SHA, int res, cache_reader reader, void* arg)
+{
+    if (cache == NULL || SHA == NULL || reader == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const uint64_t hash = key_hash(SHA, res);
+    struct cache_shard* shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry* entry = *find_link(shard, hash, SHA, res);
+    if (entry == NULL) {
+        shard->misses += 1;
+        pthread_mutex_unlock(&shard->lock);
+        return ERR_FILE_NOT_FOUND;
+    }
+    shard->hits += 1;
+    lru_unlink(shard, entry);
+    lru_push(shard, entry);
+    reader(arg, entry->data, entry->size);
+    pthread_mutex_unlock(&shard->lock);
+    return ERR_NONE;
+}
+
+int cache_put(struct img_cache* cache, const unsigned char* SHA, int res, const void* data, size_t size)
+{
+    if (cache == NULL || SHA == NULL || data == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (size > cache->max_entry) {
+        return ERR_NONE;
+    }
+
+    struct cache_entry* entry = malloc(sizeof(struct cache_entry) + size);
+    if (entry == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(entry->SHA, SHA, SHA256_DIGEST_LENGTH);
+    entry->res = res;
+    entry->size = size;
+    memcpy(entry->data, data, size);
+
+    const uint64_t hash = key_hash(SHA, res);
+    struct cache_shard* shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry** link = find_link(shard, hash, SHA, res);
+    if (*link != NULL) {
+        drop_entry(shard, link); // replaced by the new copy
+    }
+    while (shard->used + size > shard->capacity && shard->oldest != NULL) {
+        const struct cache_entry* oldest = shard->oldest;
+        drop_entry(shard, find_link(shard, key_hash(oldest->SHA, oldest->res), oldest->SHA, oldest->res));
+    }
+    entry->chain = *bucket_of(shard, hash);
+    *bucket_of(shard, hash) = entry;
+    lru_push(shard, entry);
+    shard->used += size;
+    pthread_mutex_unlock(&shard->lock);
+    return ERR_NONE;
+}
+
+void cache_remove(struct img_cache* cache, const unsigned char* SHA)
+{
+    if (cache == NULL || SHA == NULL) {
+        return;
+    }
+
+    for (int res = 0; res < NB_RES; ++res) {
+        const uint64_t hash = key_hash(SHA, res);
+        struct cache_shard* shard = shard_of(cache, hash);
+        pthread_mutex_lock(&shard->lock);
+        struct cache_entry** link = find_link(shard, hash, SHA, res);
+        if (*link != NULL) {
+            drop_entry(shard, link);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_stats(struct img_cache* cache, uint64_t* hits, uint64_t* misses)
+{
+    *hits = *misses = 0;
+    for (size_t i = 0; cache != NULL && i < IMG_CACHE_SHARDS; ++i) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        *hits += cache->shards[i].hits;
+        *misses += cache->shards[i].misses;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+void cache_free(struct img_cache* cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < IMG_CACHE_SHARDS; ++i) {
+        struct cache_shard* shard = &cache->shards[i];
+        if (shard->buckets == NULL) {
+            continue;
+        }
+        while (shard->oldest != NULL) {
+            struct cache_entry* entry = shard->oldest;
+            shard->oldest = entry->newer;
+            free(entry);
+        }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->newest = NULL;
+        shard->used = 0;
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
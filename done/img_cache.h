@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file img_cache.h
+ * @brief Memory-bounded cache of image contents, keyed by (SHA, resolution).
+ *
+ * Keying by content rather than by img_id makes images sharing the same
+ * content (deduplicated) share their cache entries too, and makes an entry
+ * impossible to be stale: a given (SHA, resolution) always has the same bytes.
+ * Entries are still dropped when an image is deleted, to give the memory back.
+ *
+ * The cache is split in IMG_CACHE_SHARDS shards, each with its own lock,
+ * hash chains and LRU list, so that threads hitting different images do not
+ * contend; the memory bound is split evenly between the shards.
+ */
+
+#include "imgStore.h"
+#include <pthread.h>
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#define IMG_CACHE_SHARDS 16
+#define IMG_CACHE_BUCKETS 1024 // hash buckets per shard, power of two
+
+struct cache_entry;
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry** buckets;  // hash chains
+    struct cache_entry* newest;    // LRU list, most recently used first
+    struct cache_entry* oldest;
+    size_t used;                   // bytes of image content held
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct img_cache {
+    struct cache_shard shards[IMG_CACHE_SHARDS];
+    size_t max_entry;              // larger contents are not cached
+};
+
+/**
+ * Function given the content of a cached image, called with its shard locked
+ */
+typedef void (*cache_reader)(void* arg, const void* data, size_t size);
+
+/**
+ * Initializes an empty cache
+ *
+ * @param cache the cache to be initialized
+ * @param capacity maximum number of bytes of image content held
+ * @param max_entry maximum size of a cached image
+ * @return same error code as in error.c
+ */
+int cache_init(struct img_cache* cache, size_t capacity, size_t max_entry);
+
+/**
+ * Looks for a cached image, and gives its content to reader if found
+ *
+ * @param cache the cache
+ * @param SHA SHA-256 of the original content of the image
+ * @param res resolution code
+ * @param reader function given the content
+ * @param arg argument of reader
+ * @return ERR_NONE if found, ERR_FILE_NOT_FOUND otherwise
+ */
+int cache_get(struct img_cache* cache, const unsigned char* SHA, int res, cache_reader reader, void* arg);
+
+/**
+ * Adds (a copy of) an image to the cache, evicting the least recently used ones if needed
+ *
+ * @param cache the cache
+ * @param SHA SHA-256 of the original content of the image
+ * @param res resolution code
+ * @param data the content
+ * @param size size of the content
+ * @return same error code as in error.c (ERR_NONE if too large to be cached)
+ */
+int cache_put(struct img_cache* cache, const unsigned char* SHA, int res, const void* data, size_t size);
+
+/**
+ * Drops every resolution of a content from the cache
+ *
+ * @param cache the cache
+ * @param SHA SHA-256 of the original content
+ */
+void cache_remove(struct img_cache* cache, const unsigned char* SHA);
+
+/**
+ * Sums the hits and misses of all shards
+ *
+ * @param cache the cache
+ * @param hits output number of lookups found
+ * @param misses output number of lookups not found
+ */
+void cache_stats(struct img_cache* cache, uint64_t* hits, uint64_t* misses);
+
+/**
+ * Releases every entry of the cache
+ *
+ * @param cache the cache to be released
+ */
+void cache_free(struct img_cache* cache);
@@ -0,0 +1,363 @@
+/**
+ * @file img_index.c
+ * @brief imgStore library: in-memory img_id, content (SHA) and free slots index implementation.
+ */
+
+#include "img_index.h"
+#include "imgStore.h"
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for strcmp, memcmp, memcpy
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+#define BITS_PER_WORD 64
+
+/**
+ * FNV-1a hash of an image id
+ *
+ * @param img_id the id to be hashed
+ * @return hash value
+ */
+static uint32_t hash_id(const char* img_id)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Hash of a SHA-256 digest: its first bytes are already uniformly distributed
+ *
+ * @param SHA the digest to be hashed
+ * @return hash value
+ */
+static uint32_t hash_sha(const unsigned char* SHA)
+{
+    uint32_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+/**
+ * Home bucket of the metadata at the given index in one of the tables
+ *
+ * @param im_file indexed file
+ * @param table id_table or sha_table of the index
+ * @param index index of the metadata in file
+ * @return bucket
+ */
+static uint32_t home_bucket(const struct imgst_file* im_file, const uint32_t* table, uint32_t index)
+{
+    const uint32_t mask = im_file->lookup->capacity - 1;
+    if (table == im_file->lookup->id_table) {
+        return hash_id(im_file->metadata[index].img_id) & mask;
+    }
+    return hash_sha(im_file->metadata[index].SHA) & mask;
+}
+
+/**
+ * Inserts a slot in the id table, unless its id is already there
+ *
+ * @param im_file file whose index is updated
+ * @param index index of the metadata in file
+ */
+static void id_table_insert(const struct imgst_file* im_file, uint32_t index)
+{
+    struct img_index* lookup = im_file->lookup;
+    const uint32_t mask = lookup->capacity - 1;
+    uint32_t bucket = home_bucket(im_file, lookup->id_table, index);
+
+    while (lookup->id_table[bucket] != 0) {
+        const uint32_t other = lookup->id_table[bucket] - 1;
+        if (other == index || !strcmp(im_file->metadata[other].img_id, im_file->metadata[index].img_id)) {
+            return;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    lookup->id_table[bucket] = index + 1;
+}
+
+/**
+ * Inserts a slot in the SHA table; several slots may share the same content
+ *
+ * @param im_file file whose index is updated
+ * @param index index of the metadata in file
+ */
+static void sha_table_insert(const struct imgst_file* im_file, uint32_t index)
+{
+    struct img_index* lookup = im_file->lookup;
+    const uint32_t mask = lookup->capacity - 1;
+    uint32_t bucket = home_bucket(im_file, lookup->sha_table, index);
+
+    while (lookup->sha_table[bucket] != 0) {
+        if (lookup->sha_table[bucket] == index + 1) {
+            return;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    lookup->sha_table[bucket] = index + 1;
+}
+
+/**
+ * Removes a slot from one of the tables
+ *
+ * @param im_file file whose index is updated
+ * @param table id_table or sha_table of the index
+ * @param index index of the metadata in file
+ */
+static void table_remove(const struct imgst_file* im_file, uint32_t* table, uint32_t index)
+{
+    const uint32_t mask = im_file->lookup->capacity - 1;
+    uint32_t bucket = home_bucket(im_file, table, index);
+
+    while (table[bucket] != index + 1) {
+        if (table[bucket] == 0) {
+            return; // not indexed
+        }
+        bucket = (bucket + 1) & mask;
+    }
+
+    // backward-shift deletion: pull back the following entries of the cluster
+    // that would no longer be reachable through their home bucket
+    uint32_t hole = bucket;
+    uint32_t next = (hole + 1) & mask;
+    while (table[next] != 0) {
+        const uint32_t home = home_bucket(im_file, table, table[next] - 1);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table[hole] = table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table[hole] = 0;
+}
+
+/**
+ * Marks a slot as free or used in the free slots bitmap
+ *
+ * @param lookup index to be updated
+ * @param index index of the metadata in file
+ * @param is_free new state of the slot
+ */
+static void set_free(struct img_index* lookup, uint32_t index, int is_free)
+{
+    const uint32_t word = index / BITS_PER_WORD;
+    const uint64_t bit = (uint64_t) 1 << (index % BITS_PER_WORD);
+    const int was_free = (lookup->free_map[word] & bit) != 0;
+
+    if (is_free && !was_free) {
+        lookup->free_map[word] |= bit;
+        lookup->nb_free += 1;
+        if (word < lookup->free_hint) {
+            lookup->free_hint = word;
+        }
+    } else if (!is_free && was_free) {
+        lookup->free_map[word] &= ~bit;
+        lookup->nb_free -= 1;
+    }
+}
+
+/**
+ * Fills the tables of an attached index from the metadata, on first use
+ *
+ * @param im_file indexed file (only its index is modified)
+ * @return the usable index, or NULL if there is none (then callers scan the metadata)
+ */
+static struct img_index* ready(const struct imgst_file* im_file)
+{
+    struct img_index* lookup = im_file->lookup;
+    if (lookup == NULL || lookup->is_built) {
+        return lookup;
+    }
+
+    // at least twice as many buckets as slots, so that probing sequences stay short
+    lookup->capacity = 1;
+    while (lookup->capacity < 2 * (uint64_t) im_file->header.max_files) {
+        lookup->capacity <<= 1;
+    }
+
+    lookup->id_table = calloc(lookup->capacity, sizeof(uint32_t));
+    lookup->sha_table = calloc(lookup->capacity, sizeof(uint32_t));
+    lookup->free_map = calloc(im_file->header.max_files / BITS_PER_WORD + 1, sizeof(uint64_t));
+    if (lookup->id_table == NULL || lookup->sha_table == NULL || lookup->free_map == NULL) {
+        free(lookup->id_table);
+        free(lookup->sha_table);
+        free(lookup->free_map);
+        memset(lookup, 0, sizeof(struct img_index));
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+        if (im_file->metadata[i].is_valid == NON_EMPTY) {
+            id_table_insert(im_file, i);
+            sha_table_insert(im_file, i);
+        } else {
+            set_free(lookup, i, 1);
+        }
+    }
+    lookup->free_hint = 0;
+    lookup->is_built = 1;
+    return lookup;
+}
+
+int index_attach(struct imgst_file* im_file)
+{
+    if (im_file == NULL || im_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    index_free(im_file);
+
+    // filled on first use: opening a store does not walk its metadata
+    im_file->lookup = calloc(1, sizeof(struct img_index));
+    if (im_file->lookup == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    return ERR_NONE;
+}
+
+void index_free(struct imgst_file* im_file)
+{
+    if (im_file != NULL && im_file->lookup != NULL) {
+        free(im_file->lookup->id_table);
+        free(im_file->lookup->sha_table);
+        free(im_file->lookup->free_map);
+        free(im_file->lookup);
+        im_file->lookup = NULL;
+    }
+}
+
+int index_find_id(const struct imgst_file* im_file, const char* img_id, uint32_t* index)
+{
+    if (im_file == NULL || img_id == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct img_index* lookup = ready(im_file);
+    if (lookup == NULL) {
+        for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+            if (im_file->metadata[i].is_valid == NON_EMPTY && !strcmp(im_file->metadata[i].img_id, img_id)) {
+                *index = i;
+                return ERR_NONE;
+            }
+        }
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    const uint32_t mask = lookup->capacity - 1;
+    uint32_t bucket = hash_id(img_id) & mask;
+
+    while (lookup->id_table[bucket] != 0) {
+        const uint32_t candidate = lookup->id_table[bucket] - 1;
+        if (im_file->metadata[candidate].is_valid == NON_EMPTY
+            && !strcmp(im_file->metadata[candidate].img_id, img_id)) {
+            *index = candidate;
+            return ERR_NONE;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+int index_find_sha(const struct imgst_file* im_file, const unsigned char* SHA, uint32_t except, uint32_t* index)
+{
+    if (im_file == NULL || SHA == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct img_index* lookup = ready(im_file);
+    if (lookup == NULL) {
+        for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+            if (i != except && im_file->metadata[i].is_valid == NON_EMPTY
+                && !memcmp(im_file->metadata[i].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+                *index = i;
+                return ERR_NONE;
+            }
+        }
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    const uint32_t mask = lookup->capacity - 1;
+    uint32_t bucket = hash_sha(SHA) & mask;
+
+    while (lookup->sha_table[bucket] != 0) {
+        const uint32_t candidate = lookup->sha_table[bucket] - 1;
+        if (candidate != except && im_file->metadata[candidate].is_valid == NON_EMPTY
+            && !memcmp(im_file->metadata[candidate].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+            *index = candidate;
+            return ERR_NONE;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+int index_first_free(struct imgst_file* im_file, uint32_t* index)
+{
+    if (im_file == NULL || index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct img_index* lookup = ready(im_file);
+    if (lookup == NULL) {
+        for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+            if (im_file->metadata[i].is_valid == EMPTY) {
+                *index = i;
+                return ERR_NONE;
+            }
+        }
+        return ERR_FULL_IMGSTORE;
+    }
+
+    const uint32_t nb_words = im_file->header.max_files / BITS_PER_WORD + 1;
+    if (lookup->nb_free > 0) {
+        for (uint32_t word = lookup->free_hint; word < nb_words; ++word) {
+            if (lookup->free_map[word] != 0) {
+                // full words before this one will not be looked at again until a slot is freed there
+                lookup->free_hint = word;
+                *index = word * BITS_PER_WORD + (uint32_t) __builtin_ctzll(lookup->free_map[word]);
+                return ERR_NONE;
+            }
+        }
+    }
+    return ERR_FULL_IMGSTORE;
+}
+
+uint32_t index_free_count(const struct imgst_file* im_file)
+{
+    if (im_file == NULL) {
+        return 0;
+    }
+    const struct img_index* lookup = ready(im_file);
+    if (lookup != NULL) {
+        return lookup->nb_free;
+    }
+    uint32_t nb_free = 0;
+    for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+        if (im_file->metadata[i].is_valid == EMPTY) {
+            nb_free += 1;
+        }
+    }
+    return nb_free;
+}
+
+void index_add(struct imgst_file* im_file, uint32_t index)
+{
+    if (im_file != NULL && index < im_file->header.max_files && ready(im_file) != NULL) {
+        id_table_insert(im_file, index);
+        sha_table_insert(im_file, index);
+        set_free(im_file->lookup, index, 0);
+    }
+}
+
+void index_remove(struct imgst_file* im_file, uint32_t index)
+{
+    if (im_file != NULL && index < im_file->header.max_files && ready(im_file) != NULL) {
+        table_remove(im_file, im_file->lookup->id_table, index);
+        table_remove(im_file, im_file->lookup->sha_table, index);
+        set_free(im_file->lookup, index, 1);
+    }
+}
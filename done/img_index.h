@@ -0,0 +1,102 @@
+#pragma once
+
+/**
+ * @file img_index.h
+ * @brief In-memory lookup tables over the metadata array of an imgst_file.
+ *
+ * The index is made of two open-addressing hash tables (linear probing), one
+ * keyed by img_id and one keyed by SHA (content), several slots possibly
+ * sharing the same SHA. Each bucket stores the metadata slot index + 1, 0
+ * meaning an empty bucket.
+ * A bitmap of the free slots (bit set = slot free) completes them, so that
+ * finding a slot for a new image is a word-level scan from a hint.
+ * It is only a cache of what is on disk, never written to the imgStore file:
+ * do_open only attaches an empty index, whose tables are filled from the
+ * metadata on first use, so that opening a store stays cheap; every later
+ * change of the metadata goes through index_add and index_remove.
+ *
+ * All lookup functions fall back to a linear scan of the metadata when no index
+ * has been built (e.g. for an imgst_file filled by hand).
+ */
+
+#include "imgStore.h"
+#include <stdint.h> // for uint32_t
+
+struct img_index {
+    uint32_t* id_table;  // buckets on img_id, slot index + 1 (0 = empty)
+    uint32_t* sha_table; // buckets on SHA, slot index + 1 (0 = empty)
+    uint32_t capacity;   // number of buckets of each table, power of two
+    uint64_t* free_map;  // one bit per metadata slot, set when the slot is free
+    uint32_t free_hint;  // no free slot before this word of free_map
+    uint32_t nb_free;    // number of free slots
+    int is_built;        // tables filled from the metadata
+};
+
+/**
+ * Attaches an index to the given file, replacing any former one; it is filled from the metadata on first use
+ *
+ * @param im_file file to be indexed
+ * @return same error code as in error.c
+ */
+int index_attach(struct imgst_file* im_file);
+
+/**
+ * Releases the index of the given file (if any)
+ *
+ * @param im_file file whose index is released
+ */
+void index_free(struct imgst_file* im_file);
+
+/**
+ * Looks for the valid image with the given id
+ *
+ * @param im_file file to be searched
+ * @param img_id id of the image
+ * @param index output index of the metadata in file
+ * @return ERR_NONE if found, ERR_FILE_NOT_FOUND otherwise
+ */
+int index_find_id(const struct imgst_file* im_file, const char* img_id, uint32_t* index);
+
+/**
+ * Looks for a valid image, other than the one at index except, with the given content
+ *
+ * @param im_file file to be searched
+ * @param SHA SHA-256 of the content
+ * @param except index to be skipped (e.g. the image being inserted)
+ * @param index output index of the metadata in file
+ * @return ERR_NONE if found, ERR_FILE_NOT_FOUND otherwise
+ */
+int index_find_sha(const struct imgst_file* im_file, const unsigned char* SHA, uint32_t except, uint32_t* index);
+
+/**
+ * Finds the first free metadata slot
+ *
+ * @param im_file file to be searched (the scan hint of its index is moved forward)
+ * @param index output index of the free slot
+ * @return ERR_NONE if found, ERR_FULL_IMGSTORE otherwise
+ */
+int index_first_free(struct imgst_file* im_file, uint32_t* index);
+
+/**
+ * Number of free metadata slots, without scanning the metadata when indexed
+ *
+ * @param im_file file to be inspected
+ * @return number of free slots
+ */
+uint32_t index_free_count(const struct imgst_file* im_file);
+
+/**
+ * Registers the (now valid) metadata at the given index
+ *
+ * @param im_file file whose index is updated
+ * @param index index of the metadata in file
+ */
+void index_add(struct imgst_file* im_file, uint32_t index);
+
+/**
+ * Unregisters the metadata at the given index (to be called before invalidating it)
+ *
+ * @param im_file file whose index is updated
+ * @param index index of the metadata in file
+ */
+void index_remove(struct imgst_file* im_file, uint32_t index);
@@ -4,6 +4,8 @@
  */
 
 #include "imgStore.h"
+#include "img_index.h"
+#include "journal.h"
 #include <string.h> // for strncpy
 #include <stdlib.h> // for calloc
 
@@ -11,6 +13,15 @@ int do_create(const char* filename, struct imgst_file* DBFILE)
 {
     if (filename == NULL || DBFILE == NULL) return ERR_INVALID_ARGUMENT;
 
+    // nothing is attached yet: do_close is safe after any error below
+    DBFILE->file = NULL;
+    DBFILE->metadata = NULL;
+    DBFILE->lookup = NULL;
+    DBFILE->map = NULL;
+    DBFILE->view = NULL;
+    DBFILE->data_map = NULL;
+    DBFILE->journal = NULL;
+
     // Sets the DB header name
     strncpy(DBFILE->header.imgst_name, CAT_TXT,  MAX_IMGST_NAME);
     DBFILE->header.imgst_name[MAX_IMGST_NAME] = '\0';
@@ -18,12 +29,21 @@ int do_create(const char* filename, struct imgst_file* DBFILE)
     DBFILE->header.num_files = 0;
     DBFILE->header.imgst_version = 0;
 
+    // the header must stay out of the extents: a growable table fills at least EXTENT_ALIGN bytes
+    const uint32_t min_growable = (EXTENT_ALIGN - sizeof(struct imgst_header)) / sizeof(struct img_metadata) + 1;
+    if (DBFILE->header.unused_32 == IMGST_GROWABLE && DBFILE->header.max_files < min_growable) {
+        DBFILE->header.max_files = min_growable;
+    }
+
     DBFILE->metadata = calloc(DBFILE->header.max_files, sizeof(struct img_metadata));
 
     if(DBFILE->metadata == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
 
+    // a journal left by a former store of the same name must not be replayed on this one
+    journal_remove(filename);
+
     FILE *file;
     file = fopen(filename, "w+b");
     DBFILE->file = file;
@@ -41,6 +61,11 @@ int do_create(const char* filename, struct imgst_file* DBFILE)
         return ERR_IO;
     }
 
+    // the store is empty, but index it anyway so that subsequent inserts are indexed too
+    int err = index_attach(DBFILE);
+    if (err != ERR_NONE) {
+        return err;
+    }
 
     return ERR_NONE;
 }
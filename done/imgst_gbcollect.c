@@ -1,10 +1,348 @@
 /**
  * @file imgst_gbcollect.c
  * @brief imgStore library: garbadge collector implementation.
+ *
+ * The stored bytes of the valid images (original, thumbnail and small) are
+ * copied as they are, without decoding nor resizing them again; contents
+ * shared by several images (deduplicated) are copied only once and stay shared.
+ * The new layout is planned first, so that the contents can be copied by
+ * several threads at once, each to its final offset.
  */
 
 #include "imgStore.h"
-#include "image_content.h"
+#include "work_pool.h"
+#include <stdlib.h> // for calloc, malloc, realloc, free
+#include <string.h> // for memset
+#include <unistd.h> // for pread, pwrite, fdatasync
+
+#define GC_COPY_SIZE (1024 * 1024)     // bytes copied at once by a worker
+#define GC_JOB_SIZE (8 * 1024 * 1024)   // bytes copied by one job at most
+#define GC_WORKERS 4
+
+/**
+ * @brief Contents already planned: new offset of each old offset
+ *        (open addressing, linear probing, old offset 0 = empty bucket).
+ */
+struct moved_table {
+    uint64_t* old_offset;
+    uint64_t* new_offset;
+    size_t capacity; // power of two
+};
+
+/**
+ * @brief Bytes to be copied from the original file to the new one.
+ */
+struct gc_range {
+    uint64_t from;
+    uint64_t to;
+    uint64_t size;
+};
+
+/**
+ * @brief Planned layout of the new file: ranges of at most GC_JOB_SIZE bytes,
+ *        in the order of the new file.
+ */
+struct gc_plan {
+    struct gc_range* ranges;
+    size_t nb_ranges;
+    size_t capacity;
+    uint64_t end; // size of the new file
+};
+
+/**
+ * @brief Consecutive ranges copied by one worker.
+ */
+struct gc_job {
+    const struct gc_range* ranges;
+    size_t nb_ranges;
+    int in_fd;
+    int out_fd;
+    int error;
+    int* status; // error of the whole copy, updated on completion
+};
+
+/**
+ * Allocates a table able to hold the given number of contents
+ *
+ * @param table table to be initialized
+ * @param nb_max maximum number of contents
+ * @return same error code as in error.c
+ */
+static int moved_init(struct moved_table* table, size_t nb_max)
+{
+    table->capacity = 1;
+    while (table->capacity < 2 * nb_max) {
+        table->capacity <<= 1;
+    }
+    table->old_offset = calloc(table->capacity, sizeof(uint64_t));
+    table->new_offset = calloc(table->capacity, sizeof(uint64_t));
+    if (table->old_offset == NULL || table->new_offset == NULL) {
+        free(table->old_offset);
+        free(table->new_offset);
+        return ERR_OUT_OF_MEMORY;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * Finds the bucket of the given old offset
+ *
+ * @param table the table
+ * @param old_offset offset of the content in the original file (not 0)
+ * @return the bucket holding it, or the empty one where it belongs
+ */
+static size_t moved_bucket(const struct moved_table* table, uint64_t old_offset)
+{
+    size_t bucket = (size_t) ((old_offset * 0x9E3779B97F4A7C15ull) >> 32) & (table->capacity - 1);
+    while (table->old_offset[bucket] != 0 && table->old_offset[bucket] != old_offset) {
+        bucket = (bucket + 1) & (table->capacity - 1);
+    }
+    return bucket;
+}
+
+/**
+ * Counts the valid images of a file
+ *
+ * @param im_file the file
+ * @return number of valid slots
+ */
+static uint32_t count_valid(const struct imgst_file* im_file)
+{
+    uint32_t nb_valid = 0;
+    for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+        if (im_file->metadata[i].is_valid == NON_EMPTY) {
+            nb_valid += 1;
+        }
+    }
+    return nb_valid;
+}
+
+/**
+ * Appends a content to the planned layout, split in ranges of at most GC_JOB_SIZE bytes
+ *
+ * @param plan the plan
+ * @param from offset of the content in the original file
+ * @param size size of the content
+ * @return same error code as in error.c
+ */
+static int plan_append(struct gc_plan* plan, uint64_t from, uint64_t size)
+{
+    while (size > 0) {
+        if (plan->nb_ranges == plan->capacity) {
+            const size_t capacity = plan->capacity == 0 ? 64 : 2 * plan->capacity;
+            struct gc_range* ranges = realloc(plan->ranges, capacity * sizeof(struct gc_range));
+            if (ranges == NULL) {
+                return ERR_OUT_OF_MEMORY;
+            }
+            plan->ranges = ranges;
+            plan->capacity = capacity;
+        }
+        struct gc_range* range = &plan->ranges[plan->nb_ranges++];
+        range->from = from;
+        range->to = plan->end;
+        range->size = size < GC_JOB_SIZE ? size : GC_JOB_SIZE;
+        from += range->size;
+        plan->end += range->size;
+        size -= range->size;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * Plans the new layout: the valid images of orig_file packed in slot order,
+ * each original followed by its resized versions, shared contents only once.
+ * The metadata of tmp_file is filled with the new offsets.
+ *
+ * @param orig_file the file to be collected
+ * @param nb_valid number of valid images of orig_file
+ * @param tmp_file the new file, as created by do_create
+ * @param plan output plan, empty
+ * @return same error code as in error.c
+ */
+static int plan_layout(const struct imgst_file* orig_file, uint32_t nb_valid, struct imgst_file* tmp_file,
+                       struct gc_plan* plan)
+{
+    // at most one range per stored content, unless larger than GC_JOB_SIZE
+    plan->capacity = (size_t) nb_valid * NB_RES;
+    plan->ranges = calloc(plan->capacity, sizeof(struct gc_range));
+    if (plan->ranges == NULL && plan->capacity > 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    struct moved_table moved;
+    int err = moved_init(&moved, (size_t) nb_valid * NB_RES);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    plan->end = sizeof(struct imgst_header) + (uint64_t) tmp_file->header.max_files * sizeof(struct img_metadata);
+    uint32_t index_new = 0;
+    for (uint32_t i = 0; i < orig_file->header.max_files && err == ERR_NONE; i++) {
+        const struct img_metadata* img = &orig_file->metadata[i];
+        if (img->is_valid != NON_EMPTY) {
+            continue;
+        }
+
+        struct img_metadata* meta = &tmp_file->metadata[index_new];
+        *meta = *img;
+        // original first, then its resized versions (thumbnail, small)
+        for (int step = 0; step < NB_RES && err == ERR_NONE; ++step) {
+            const int res = (step + RES_ORIG) % NB_RES;
+            if (img->size[res] == 0) {
+                meta->offset[res] = 0;
+                continue;
+            }
+            const size_t bucket = moved_bucket(&moved, img->offset[res]);
+            if (moved.old_offset[bucket] == 0) {
+                moved.old_offset[bucket] = img->offset[res];
+                moved.new_offset[bucket] = plan->end;
+                err = plan_append(plan, img->offset[res], img->size[res]);
+            }
+            meta->offset[res] = moved.new_offset[bucket];
+        }
+        index_new += 1;
+    }
+
+    free(moved.old_offset);
+    free(moved.new_offset);
+
+    // as many versions as if the images had been inserted one by one
+    tmp_file->header.num_files = index_new;
+    tmp_file->header.imgst_version = index_new;
+    return err;
+}
+
+/**
+ * Worker side: copies the ranges of one job
+ *
+ * @param arg the gc_job
+ */
+static void run_copy(void* arg)
+{
+    struct gc_job* job = arg;
+    char* buffer = malloc(GC_COPY_SIZE);
+    if (buffer == NULL) {
+        job->error = ERR_OUT_OF_MEMORY;
+        return;
+    }
+
+    for (size_t i = 0; i < job->nb_ranges && job->error == ERR_NONE; ++i) {
+        uint64_t done = 0;
+        while (done < job->ranges[i].size) {
+            const uint64_t left = job->ranges[i].size - done;
+            const size_t chunk = left < GC_COPY_SIZE ? (size_t) left : GC_COPY_SIZE;
+            const ssize_t nb_read = pread(job->in_fd, buffer, chunk, (off_t) (job->ranges[i].from + done));
+            if (nb_read <= 0
+                || pwrite(job->out_fd, buffer, (size_t) nb_read, (off_t) (job->ranges[i].to + done)) != nb_read) {
+                job->error = ERR_IO;
+                break;
+            }
+            done += (uint64_t) nb_read;
+        }
+    }
+    free(buffer);
+}
+
+/**
+ * Main thread side: reports the result of one job
+ *
+ * @param arg the gc_job
+ */
+static void complete_copy(void* arg)
+{
+    struct gc_job* job = arg;
+    if (*job->status == ERR_NONE) {
+        *job->status = job->error;
+    }
+    free(job);
+}
+
+/**
+ * Copies the planned ranges with GC_WORKERS threads
+ *
+ * @param plan the plan
+ * @param in_fd the original file
+ * @param out_fd the new file
+ * @return same error code as in error.c
+ */
+static int copy_planned(const struct gc_plan* plan, int in_fd, int out_fd)
+{
+    struct work_pool workers;
+    int status = pool_init(&workers, GC_WORKERS, 2 * GC_WORKERS);
+    if (status != ERR_NONE) {
+        return status;
+    }
+
+    size_t first = 0;
+    while (first < plan->nb_ranges && status == ERR_NONE) {
+        // about GC_JOB_SIZE bytes per job
+        size_t last = first + 1;
+        uint64_t size = plan->ranges[first].size;
+        while (last < plan->nb_ranges && size + plan->ranges[last].size <= GC_JOB_SIZE) {
+            size += plan->ranges[last].size;
+            last += 1;
+        }
+
+        struct gc_job* job = calloc(1, sizeof(struct gc_job));
+        if (job == NULL) {
+            status = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        job->ranges = &plan->ranges[first];
+        job->nb_ranges = last - first;
+        job->in_fd = in_fd;
+        job->out_fd = out_fd;
+        job->status = &status;
+        const int err = pool_submit(&workers, run_copy, complete_copy, job);
+        if (err != ERR_NONE) {
+            free(job);
+            status = err;
+        }
+        first = last;
+    }
+
+    pool_end(&workers);
+    return status;
+}
+
+/**
+ * Copies the valid images of orig_file to the (empty) tmp_file: the layout is
+ * planned first, then the contents are copied concurrently, and the metadata
+ * table is written once at the end
+ *
+ * @param orig_file the file to be collected
+ * @param nb_valid number of valid images of orig_file
+ * @param tmp_file the new file, as created by do_create
+ * @return same error code as in error.c
+ */
+static int compact(const struct imgst_file* orig_file, uint32_t nb_valid, struct imgst_file* tmp_file)
+{
+    struct gc_plan plan;
+    memset(&plan, 0, sizeof(plan));
+    int err = plan_layout(orig_file, nb_valid, tmp_file, &plan);
+
+    // the workers write beside stdio: nothing may be left in its buffer
+    if (err == ERR_NONE && fflush(tmp_file->file) != 0) {
+        err = ERR_IO;
+    }
+    if (err == ERR_NONE) {
+        err = copy_planned(&plan, fileno(orig_file->file), fileno(tmp_file->file));
+    }
+    free(plan.ranges);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    err = write_header(tmp_file);
+    if (err == ERR_NONE && tmp_file->header.num_files > 0) {
+        // the slots after them were written empty by do_create
+        err = write_metadata_range(tmp_file, 0, tmp_file->header.num_files);
+    }
+    if (err == ERR_NONE && (fflush(tmp_file->file) != 0 || fdatasync(fileno(tmp_file->file)) != 0)) {
+        err = ERR_IO;
+    }
+    return err;
+}
 
 int do_gbcollect(const char* orig_filename, const char* tmp_filename)
 {
@@ -26,45 +364,27 @@ int do_gbcollect(const char* orig_filename, const char* tmp_filename)
     struct imgst_file tmp_file;
     memset(&tmp_file, 0, sizeof(tmp_file));
 
-    tmp_file.header.max_files = orig_file.header.max_files;
+    // a grown table is not split in extents any more, but it stays growable: it only
+    // needs the slots of the valid images, and grows again with the next insertions
+    const uint32_t nb_valid = count_valid(&orig_file);
+    const int is_growable = orig_file.header.unused_32 == IMGST_GROWABLE;
+    tmp_file.header.max_files = is_growable ? nb_valid : orig_file.header.max_files;
+    tmp_file.header.unused_32 = orig_file.header.unused_32;
     for(int i = 0; i <= NB_RES; ++i) {
         tmp_file.header.res_resized[i] = orig_file.header.res_resized[i];
     }
 
     err = do_create(tmp_filename, &tmp_file);
+    if (err == ERR_NONE) {
+        err = compact(&orig_file, nb_valid, &tmp_file);
+    }
+    do_close(&orig_file);
+    do_close(&tmp_file);
     if (err != ERR_NONE) {
+        remove(tmp_filename);
         return err;
     }
 
-    char* img_buf;
-    uint32_t img_size;
-    struct img_metadata img;
-    size_t index_new = 0;
-
-    for (uint32_t i = 0; i < orig_file.header.max_files; i++) {
-        img = orig_file.metadata[i];
-        if (img.is_valid == 1) {
-
-            err = do_read(img.img_id, RES_ORIG, &img_buf, &img_size, &orig_file);
-            if (err != ERR_NONE) {
-                return err;
-            }
-
-            err = do_insert(img_buf, img_size, img.img_id, &tmp_file);
-            if (err != ERR_NONE) {
-                return err;
-            }
-            for (int res = 0; res < NB_RES-1; res++) {
-                if (img.offset[res] != 0) {
-                    err = lazily_resize(res, &tmp_file, index_new);
-                    if (err != ERR_NONE) {
-                        return err;
-                    }
-                }
-            }
-            index_new += 1;
-        }
-    }
     err = remove(orig_filename);
     if (err != ERR_NONE) {
         return ERR_IO;
@@ -75,7 +395,5 @@ int do_gbcollect(const char* orig_filename, const char* tmp_filename)
         return ERR_IO;
     }
 
-    do_close(&orig_file);
-    do_close(&tmp_file);
     return ERR_NONE;
-}
\ No newline at end of file
+}
@@ -0,0 +1,126 @@
+/**
+ * @file imgst_grow.c
+ * @brief imgStore library: do_grow implementation.
+ *
+ * A new extent is appended to the file (after its descriptor) and mapped right
+ * after the current end of the metadata table, in the range reserved by
+ * do_open. The first extent also takes over the page holding the end of the
+ * original table: that part of the table is copied to the extent, which is
+ * where it lives from then on.
+ * The extent is synced before the header refers to it, so that a header on
+ * disk never refers to an extent which is not.
+ */
+
+#include "imgStore.h"
+#include "img_index.h"
+#include "journal.h"
+#include <string.h> // for memset, memcpy
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include <unistd.h> // for pread, pwrite, ftruncate, fdatasync
+
+/**
+ * Rounds up to a multiple of EXTENT_ALIGN
+ *
+ * @param value the value to be rounded
+ * @return the rounded value
+ */
+static uint64_t align_extent(uint64_t value)
+{
+    return (value + EXTENT_ALIGN - 1) / EXTENT_ALIGN * EXTENT_ALIGN;
+}
+
+int do_grow(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct imgst_header* header = &imgst_file->header;
+    if (header->unused_32 != IMGST_GROWABLE || header->max_files >= MAX_GROWN_FILES
+        || imgst_file->map == NULL || !imgst_file->is_map_shared) {
+        return ERR_FULL_IMGSTORE;
+    }
+
+    const int fd = fileno(imgst_file->file);
+    const uint64_t table_end = sizeof(struct imgst_header) + (uint64_t) header->max_files * sizeof(struct img_metadata);
+    // the new extent goes on with the newest one, or replaces the end of the original table
+    uint64_t start = table_end / EXTENT_ALIGN * EXTENT_ALIGN;
+    if (header->unused_64 != 0) {
+        struct metadata_extent newest;
+        if (pread(fd, &newest, sizeof(newest), (off_t) header->unused_64) != sizeof(newest)) {
+            return ERR_IO;
+        }
+        start = newest.start + newest.length;
+    }
+    if (start == 0) {
+        return ERR_FULL_IMGSTORE; // the header would move to the extent (see do_create)
+    }
+
+    uint64_t max_files = 2 * (uint64_t) header->max_files;
+    if (max_files > MAX_GROWN_FILES) {
+        max_files = MAX_GROWN_FILES;
+    }
+    const uint64_t end = align_extent(sizeof(struct imgst_header) + max_files * sizeof(struct img_metadata));
+    // the whole extent is usable
+    max_files = (end - sizeof(struct imgst_header)) / sizeof(struct img_metadata);
+    if (max_files > MAX_GROWN_FILES) {
+        max_files = MAX_GROWN_FILES;
+    }
+
+    // the end of the table is copied from the file: it must hold every update first
+    int err = journal_checkpoint(imgst_file);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    // appended after the data, including what stdio still holds
+    struct stat st;
+    if (fflush(imgst_file->file) != 0 || fstat(fd, &st) != 0) {
+        return ERR_IO;
+    }
+    const uint64_t descriptor = align_extent((uint64_t) st.st_size);
+    const uint64_t offset = descriptor + EXTENT_ALIGN;
+    struct metadata_extent extent;
+    memset(&extent, 0, sizeof(extent));
+    extent.magic = EXTENT_MAGIC;
+    extent.start = start;
+    extent.length = end - start;
+    extent.older = header->unused_64;
+
+    char* map = imgst_file->map;
+    if (ftruncate(fd, (off_t) (offset + extent.length)) != 0
+        || pwrite(fd, &extent, sizeof(extent), (off_t) descriptor) != sizeof(extent)
+        || (start < table_end
+            && pwrite(fd, map + start, table_end - start, (off_t) offset) != (ssize_t) (table_end - start))
+        || fdatasync(fd) != 0) {
+        return ERR_IO;
+    }
+    if (mmap(map + start, extent.length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t) offset) == MAP_FAILED) {
+        return ERR_IO;
+    }
+    if (imgst_file->view != NULL) {
+        // the end of the table in the view may hold updates not logged yet (deferred inserts): kept
+        char* view = imgst_file->view;
+        unsigned char pending[EXTENT_ALIGN];
+        const size_t nb_pending = start < table_end ? (size_t) (table_end - start) : 0;
+        memcpy(pending, view + start, nb_pending);
+        if (mmap(view + start, extent.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fd, (off_t) offset) == MAP_FAILED) {
+            return ERR_IO;
+        }
+        memcpy(view + start, pending, nb_pending);
+    }
+
+    header->max_files = (uint32_t) max_files;
+    header->unused_64 = descriptor;
+    err = write_header(imgst_file);
+    if (err == ERR_NONE) {
+        // a journal is replayed on the layout found in the file: the new one must be there
+        err = journal_checkpoint(imgst_file);
+    }
+    if (err != ERR_NONE) {
+        return err;
+    }
+    // the lookup tables and the bitmap of free slots are sized on max_files: built again on next use
+    return index_attach(imgst_file);
+}
@@ -6,41 +6,98 @@
 #include "imgStore.h"
 #include "image_content.h"
 #include "dedup.h"
+#include "img_index.h"
 #include <stdio.h>
+#include <stdlib.h> // for malloc, free
 #include <string.h> // for strlen()
+#include <unistd.h> // for pread
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH and SHA256()
 
 int do_insert(const char *img_buffer, size_t im_size, const char *img_id, struct imgst_file *im_file)
 {
-    if (im_file == NULL || img_buffer == NULL || img_id == NULL) {
-        return ERR_INVALID_ARGUMENT;
+    uint32_t index = 0;
+    int err = do_insert_deferred(img_buffer, im_size, img_id, im_file, &index);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    int err_write = write_header(im_file);
+    if (err_write != ERR_NONE) {
+        return err_write;
     }
-    if (im_file->header.num_files >= im_file->header.max_files) {
-        return ERR_FULL_IMGSTORE;
+    return write_metadata(im_file, index);
+}
+
+/**
+ * Appends the content of an image held by another file to the imgStore file
+ *
+ * @param img_fd file descriptor of the content
+ * @param im_size size of the image
+ * @param im_file the imgst_file, positioned at its end
+ * @return Some error code. 0 if no error.
+ */
+static int copy_content(int img_fd, size_t im_size, struct imgst_file *im_file)
+{
+    char buffer[INSERT_COPY_SIZE];
+    for (size_t copied = 0; copied < im_size;) {
+        const size_t len = im_size - copied < sizeof(buffer) ? im_size - copied : sizeof(buffer);
+        if (pread(img_fd, buffer, len, (off_t) copied) != (ssize_t) len
+            || fwrite(buffer, len, 1, im_file->file) != 1) {
+            return ERR_IO;
+        }
+        copied += len;
     }
+    return ERR_NONE;
+}
 
+/**
+ * Fills a free metadata slot for a new image, whose content is appended (unless
+ * the same content is already stored) either from img_buffer or, when img_fd is
+ * not -1, from that file; the header and metadata are not written
+ *
+ * @param img_buffer the content of the image, or only its first buffer_size bytes if img_fd is given
+ * @param buffer_size size of img_buffer, enough for the frame header
+ * @param img_fd file descriptor of the content, -1 if it is all in img_buffer
+ * @param im_size size of the image
+ * @param SHA SHA-256 of the content
+ * @param img_id id of the image
+ * @param im_file the imgst_file
+ * @param new_index where to store the index of the new metadata
+ * @return Some error code. 0 if no error.
+ */
+static int fill_slot(const char *img_buffer, size_t buffer_size, int img_fd, size_t im_size, const unsigned char* SHA,
+                     const char *img_id, struct imgst_file *im_file, uint32_t* new_index)
+{
     size_t nb_written = 0;
     uint32_t index = 0;
-    int has_found = 0;
-    uint32_t counter = 0;
-    while (counter < im_file->header.max_files) {
-        if (im_file->metadata[index].is_valid == 0) {
-            has_found = 1;
-        } else {
-            if (!strcmp(im_file->metadata[index].img_id, img_id)) {
-                return ERR_DUPLICATE_ID;
-            }
-            if (has_found == 0) {
-                index += 1;
-            }
+    if (index_find_id(im_file, img_id, &index) == ERR_NONE) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    if (index_free_count(im_file) == 0) {
+        // ERR_FULL_IMGSTORE unless growable
+        int err_grow = do_grow(im_file);
+        if (err_grow != ERR_NONE) {
+            return err_grow;
         }
-        counter += 1;
+    }
+
+    int err_slot = index_first_free(im_file, &index);
+    if (err_slot != ERR_NONE) {
+        return err_slot;
+    }
+
+    // probed from the headers: anything but a JPEG image is rejected before being stored
+    uint32_t height = 0;
+    uint32_t width = 0;
+    int err_reso = get_resolution(&height, &width, img_buffer, buffer_size);
+    if (err_reso != ERR_NONE) {
+        return err_reso;
     }
 
     memset(&im_file->metadata[index], 0, sizeof(struct img_metadata));
 
-    //Here we cast because we know that a char is > 0 so we can convert it to unsigned
-    SHA256((unsigned char*) img_buffer, im_size, im_file->metadata[index].SHA);
+    memcpy(im_file->metadata[index].SHA, SHA, SHA256_DIGEST_LENGTH);
 
     strncpy(im_file->metadata[index].img_id, img_id, MAX_IMG_ID);
     im_file->metadata[index].size[RES_ORIG] = (uint32_t)im_size;
@@ -59,38 +116,99 @@ int do_insert(const char *img_buffer, size_t im_size, const char *img_id, struct
         }
         im_file->metadata[index].offset[RES_ORIG] = (uint64_t)signed_new_offset;
 
-        nb_written = fwrite(img_buffer, im_size, 1, im_file->file);
-        if (nb_written != 1) {
-            return ERR_IO;
+        if (img_fd >= 0) {
+            int err_copy = copy_content(img_fd, im_size, im_file);
+            if (err_copy != ERR_NONE) {
+                return err_copy;
+            }
+        } else {
+            nb_written = fwrite(img_buffer, im_size, 1, im_file->file);
+            if (nb_written != 1) {
+                return ERR_IO;
+            }
         }
     }
 
-    uint32_t height = 0;
-    uint32_t width = 0;
-    int err_reso = get_resolution(&height, &width, img_buffer, im_size);
-    if (err_reso != ERR_NONE) {
-        return err_reso;
-    }
-
     im_file->metadata[index].res_orig[0] = width;
     im_file->metadata[index].res_orig[1] = height;
 
     im_file->metadata[index].is_valid = 1;
+    index_add(im_file, index);
     im_file->header.num_files = im_file->header.num_files + 1;
     im_file->header.imgst_version = im_file->header.imgst_version + 1;
 
-    fseek(im_file->file, 0, SEEK_SET);
-    nb_written = fwrite(&im_file->header, sizeof(struct imgst_header), 1, im_file->file);
-    if (nb_written != 1) {
-        return ERR_IO;
-    }
-    /*Here we cast from unsigned to signed, should not cause error because index>0 and img_header and img_metadata are a known size
-    that is small enough to not create problem by signing it */
-    fseek(im_file->file, (int32_t)(sizeof(struct imgst_header) + sizeof(struct img_metadata) * (index)), SEEK_SET);
-    nb_written = fwrite(&im_file->metadata[index], sizeof(struct img_metadata), 1, im_file->file);
-    if (nb_written != 1) {
-        return ERR_IO;
+    *new_index = index;
+    return ERR_NONE;
+}
+int do_insert_deferred(const char *img_buffer, size_t im_size, const char *img_id, struct imgst_file *im_file, uint32_t* new_index)
+{
+    if (im_file == NULL || img_buffer == NULL || img_id == NULL || new_index == NULL) {
+        return ERR_INVALID_ARGUMENT;
     }
 
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    //Here we cast because we know that a char is > 0 so we can convert it to unsigned
+    SHA256((const unsigned char*) img_buffer, im_size, SHA);
+    return fill_slot(img_buffer, im_size, -1, im_size, SHA, img_id, im_file, new_index);
+}
+
+/**
+ * Reads the first bytes of the content of an image
+ *
+ * @param img_fd file descriptor of the content
+ * @param size number of bytes to be read
+ * @param buffer where to store the bytes read, to be freed by the caller
+ * @return Some error code. 0 if no error.
+ */
+static int read_content(int img_fd, size_t size, char** buffer)
+{
+    *buffer = malloc(size);
+    if (*buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_read = 0;
+    while (nb_read < size) {
+        const ssize_t chunk = pread(img_fd, *buffer + nb_read, size - nb_read, (off_t) nb_read);
+        if (chunk <= 0) {
+            free(*buffer);
+            *buffer = NULL;
+            return ERR_IO;
+        }
+        nb_read += (size_t) chunk;
+    }
     return ERR_NONE;
-}
\ No newline at end of file
+}
+
+int do_insert_fd(const char *img_id, int img_fd, uint32_t im_size, const unsigned char* SHA,
+                 struct imgst_file *im_file, uint32_t* new_index)
+{
+    if (im_file == NULL || img_id == NULL || img_fd < 0 || SHA == NULL || new_index == NULL || im_size == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the resolution is probed from the first bytes only, where the frame header usually is
+    size_t probe_size = im_size < RESOLUTION_PROBE_SIZE ? im_size : RESOLUTION_PROBE_SIZE;
+    char* probe = NULL;
+    int err = read_content(img_fd, probe_size, &probe);
+    uint32_t height = 0;
+    uint32_t width = 0;
+    if (err == ERR_NONE && probe_size < im_size && get_resolution(&height, &width, probe, probe_size) != ERR_NONE) {
+        // past unusually large metadata: the whole image is looked at
+        free(probe);
+        probe_size = im_size;
+        err = read_content(img_fd, probe_size, &probe);
+    }
+    if (err == ERR_NONE) {
+        err = fill_slot(probe, probe_size, img_fd, im_size, SHA, img_id, im_file, new_index);
+    }
+    free(probe);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    int err_write = write_header(im_file);
+    if (err_write != ERR_NONE) {
+        return err_write;
+    }
+    return write_metadata(im_file, *new_index);
+}
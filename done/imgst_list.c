@@ -5,6 +5,14 @@
 
 #include "imgStore.h"
 #include <json-c/json.h>
+#include <inttypes.h> // for PRIu32
+#include <string.h> // for memcpy, strlen
+
+/* parts of a streamed listing */
+#define LIST_OPENING 0
+#define LIST_ENTRIES 1
+#define LIST_CLOSING 2
+#define LIST_DONE    3
 
 /**
  * Lists all metadata of an imgst_file in either stdout or json mode
@@ -102,5 +110,105 @@ do_list(const struct imgst_file* file, enum do_list_mode mode)
     }
 }
 
+void do_list_json_start(struct list_stream* stream, uint64_t cursor, uint32_t limit)
+{
+    if (stream == NULL) {
+        return;
+    }
+    stream->position = cursor;
+    stream->remaining = limit == 0 ? UINT32_MAX : limit;
+    stream->nb_listed = 0;
+    stream->state = LIST_OPENING;
+}
+
+/**
+ * Writes an image id as a JSON string
+ *
+ * @param img_id the image id
+ * @param buffer where to write, of at least MAX_LIST_PIECE_STRLEN chars
+ * @return number of chars written
+ */
+static size_t write_json_string(const char* img_id, char* buffer)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t length = 0;
+    buffer[length++] = '"';
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        const unsigned char c = (unsigned char) img_id[i];
+        if (c == '"' || c == '\\') {
+            buffer[length++] = '\\';
+            buffer[length++] = (char) c;
+        } else if (c < 0x20) {
+            memcpy(&buffer[length], "\\u00", 4);
+            buffer[length + 4] = hex[c >> 4];
+            buffer[length + 5] = hex[c & 0xf];
+            length += 6;
+        } else {
+            buffer[length++] = (char) c;
+        }
+    }
+    buffer[length++] = '"';
+    return length;
+}
 
+size_t do_list_json_next(const struct imgst_file* file, struct list_stream* stream, char* buffer, size_t size)
+{
+    return do_list_json_next_all(file, 1, stream, buffer, size);
+}
 
+size_t do_list_json_next_all(const struct imgst_file* files, uint32_t nb_files, struct list_stream* stream, char* buffer, size_t size)
+{
+    if (files == NULL || nb_files == 0 || stream == NULL || buffer == NULL || size < MAX_LIST_PIECE_STRLEN) {
+        return 0;
+    }
+
+    // position p is slot p / nb_files of file p % nb_files
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < nb_files; ++i) {
+        const uint64_t file_end = (uint64_t) files[i].header.max_files * nb_files + i;
+        if (file_end > end) {
+            end = file_end;
+        }
+    }
+
+    size_t length = 0;
+    // same layout as json-c: { "Images": [ "a", "b" ] }
+    if (stream->state == LIST_OPENING) {
+        const char opening[] = "{ \"Images\": [ ";
+        memcpy(buffer, opening, strlen(opening));
+        length += strlen(opening);
+        stream->state = LIST_ENTRIES;
+    }
+
+    while (stream->state == LIST_ENTRIES && size - length >= MAX_LIST_PIECE_STRLEN) {
+        if (stream->remaining == 0 || stream->position >= end) {
+            stream->state = LIST_CLOSING;
+            break;
+        }
+        const struct imgst_file* file = &files[stream->position % nb_files];
+        const uint64_t slot = stream->position / nb_files;
+        stream->position += 1;
+        if (slot >= file->header.max_files || file->metadata[slot].is_valid != NON_EMPTY) {
+            continue;
+        }
+        const struct img_metadata* meta = &file->metadata[slot];
+        if (stream->nb_listed > 0) {
+            buffer[length++] = ',';
+            buffer[length++] = ' ';
+        }
+        length += write_json_string(meta->img_id, &buffer[length]);
+        stream->nb_listed += 1;
+        stream->remaining -= 1;
+    }
+
+    if (stream->state == LIST_CLOSING && size - length >= MAX_LIST_PIECE_STRLEN) {
+        length += (size_t) snprintf(&buffer[length], size - length, "%s", stream->nb_listed > 0 ? " ]" : "]");
+        if (stream->remaining == 0 && stream->position < end) {
+            length += (size_t) snprintf(&buffer[length], size - length, ", \"next\": %" PRIu64, stream->position);
+        }
+        buffer[length++] = ' ';
+        buffer[length++] = '}';
+        stream->state = LIST_DONE;
+    }
+    return length;
+}
@@ -5,6 +5,11 @@
 
 #include "imgStore.h"
 #include "image_content.h"
+#include "img_index.h"
+#include <stdlib.h> // for malloc, calloc
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+
 
 /**
  * Checks in file for metadata with given id
@@ -17,51 +22,62 @@
  */
 int find_metadata_with_id(const char *img_id, const struct imgst_file *im_file, struct img_metadata *meta, size_t *index)
 {
-    uint32_t valid_counter = 0;
-    for (size_t i = 0; i < im_file->header.max_files; i++) {
-        if(im_file->metadata[i].is_valid == 1) {
-
-            valid_counter += 1;
-
-            if (!strcmp(im_file->metadata[i].img_id, img_id)) {
-                *meta = im_file->metadata[i];
-                *index = i;
-                return ERR_NONE;
-            }
-        }
-
-        //if small num_file and a large max_files it will reduce number of iteration
-        if(valid_counter > im_file->header.num_files) {
-            return ERR_FILE_NOT_FOUND;
-        }
-
+    uint32_t found = 0;
+    int err = index_find_id(im_file, img_id, &found);
+    if (err != ERR_NONE) {
+        return err;
     }
-    return ERR_FILE_NOT_FOUND;
+    *meta = im_file->metadata[found];
+    *index = found;
+    return ERR_NONE;
 }
 
-int do_read(const char *img_id, int res_code, char **image_buffer, uint32_t *image_size, const struct imgst_file *im_file)
+/**
+ * Finds the metadata of an image, resizing it first if the resolution does not exist yet
+ *
+ * @param img_id the ID of the image
+ * @param res_code the desired resolution
+ * @param im_file file to be searched
+ * @param meta output copy of the (up to date) metadata
+ * @return same error code as in error.c
+ */
+static int locate_image(const char *img_id, int res_code, const struct imgst_file *im_file, struct img_metadata *meta)
 {
+    if (img_id == NULL || im_file == NULL || res_code < 0 || res_code >= NB_RES) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-    // finding correct metadata
-    struct img_metadata meta;
     size_t index;
 
     if(im_file->header.num_files == 0) {
         return ERR_FILE_NOT_FOUND;
     }
 
-    int err = find_metadata_with_id(img_id, im_file, &meta, &index);
+    int err = find_metadata_with_id(img_id, im_file, meta, &index);
     if (err != ERR_NONE) {
         return err;
     }
 
     //check if image already exists
-    if (meta.offset[res_code] == 0 || meta.size[res_code] == 0) {
+    if (meta->offset[res_code] == 0 || meta->size[res_code] == 0) {
         err = lazily_resize(res_code, im_file, index);
         if (err != ERR_NONE) {
             return err;
         }
-        meta = im_file->metadata[index]; //if lazily_resize, meta has been changed, so take new one
+        *meta = im_file->metadata[index]; //if lazily_resize, meta has been changed, so take new one
+    }
+    return ERR_NONE;
+}
+
+int do_read(const char *img_id, int res_code, char **image_buffer, uint32_t *image_size, const struct imgst_file *im_file)
+{
+
+    // finding correct metadata
+    struct img_metadata meta;
+
+    int err = locate_image(img_id, res_code, im_file, &meta);
+    if (err != ERR_NONE) {
+        return err;
     }
 
     *image_size = meta.size[res_code];
@@ -73,15 +89,134 @@ int do_read(const char *img_id, int res_code, char **image_buffer, uint32_t *ima
 
     err = fseek(im_file->file, (int64_t)meta.offset[res_code], SEEK_SET);
     if (err == -1) {
-        free(image_buffer);
+        free(*image_buffer);
+        *image_buffer = NULL;
         return ERR_IO;
     }
 
     size_t nb_read = fread(*image_buffer, *image_size, 1, im_file->file);
     if (nb_read != 1) {
-        free(image_buffer);
+        free(*image_buffer);
+        *image_buffer = NULL;
         return ERR_IO;
     }
 
     return ERR_NONE;
-}
\ No newline at end of file
+}
+
+int do_read_extent(const char *img_id, int res_code, uint64_t *offset, uint32_t *image_size, const struct imgst_file *im_file)
+{
+    if (offset == NULL || image_size == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct img_metadata meta;
+    int err = locate_image(img_id, res_code, im_file, &meta);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    *offset = meta.offset[res_code];
+    *image_size = meta.size[res_code];
+    return ERR_NONE;
+}
+
+/**
+ * Maps the whole imgStore file as its newest data mapping.
+ * The previous newest mapping is released at once if no view borrows from it,
+ * otherwise when its last view is released.
+ *
+ * @param im_file the file to be mapped
+ * @return same error code as in error.c
+ */
+static int remap_data(struct imgst_file *im_file)
+{
+    // appended data may still be in the stdio buffer
+    if (fflush(im_file->file) != 0) {
+        return ERR_IO;
+    }
+
+    const int fd = fileno(im_file->file);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+        return ERR_IO;
+    }
+
+    struct data_map* newest = calloc(1, sizeof(struct data_map));
+    if (newest == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    newest->size = (size_t) st.st_size;
+    newest->base = mmap(NULL, newest->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (newest->base == MAP_FAILED) {
+        free(newest);
+        return ERR_IO;
+    }
+
+    struct data_map* previous = im_file->data_map;
+    if (previous != NULL && previous->refs == 0) {
+        newest->older = previous->older;
+        munmap(previous->base, previous->size);
+        free(previous);
+    } else {
+        newest->older = previous;
+    }
+    im_file->data_map = newest;
+    return ERR_NONE;
+}
+
+int do_read_view(const char *img_id, int res_code, struct img_view *view, struct imgst_file *im_file)
+{
+    if (view == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct img_metadata meta;
+    int err = locate_image(img_id, res_code, im_file, &meta);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    const uint64_t end = meta.offset[res_code] + meta.size[res_code];
+    if (im_file->data_map == NULL || im_file->data_map->size < end) {
+        err = remap_data(im_file);
+        if (err != ERR_NONE) {
+            return err;
+        }
+        if (im_file->data_map->size < end) {
+            return ERR_IO;
+        }
+    }
+
+    view->data = (const char*) im_file->data_map->base + meta.offset[res_code];
+    view->size = meta.size[res_code];
+    view->map = im_file->data_map;
+    view->map->refs += 1;
+    return ERR_NONE;
+}
+
+void release_view(struct img_view *view, struct imgst_file *im_file)
+{
+    if (view == NULL || view->map == NULL || im_file == NULL) {
+        return;
+    }
+
+    struct data_map* map = view->map;
+    map->refs -= 1;
+    view->map = NULL;
+    view->data = NULL;
+    view->size = 0;
+
+    // outdated mappings go away with their last view; the newest one is kept for next reads
+    if (map->refs == 0 && map != im_file->data_map) {
+        struct data_map* newer = im_file->data_map;
+        while (newer != NULL && newer->older != map) {
+            newer = newer->older;
+        }
+        if (newer != NULL) {
+            newer->older = map->older;
+        }
+        munmap(map->base, map->size);
+        free(map);
+    }
+}
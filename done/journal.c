@@ -0,0 +1,534 @@
+/**
+ * @file journal.c
+ * @brief imgStore library: write-ahead journal implementation.
+ */
+
+#include "journal.h"
+#include <errno.h> // for errno, ENOENT
+#include <fcntl.h> // for open
+#include <stdlib.h> // for getenv, malloc, free
+#include <string.h> // for strcmp, strlen, memcpy
+#include <sys/file.h> // for flock
+#include <sys/mman.h> // for msync
+#include <sys/stat.h> // for fstat
+#include <sys/uio.h> // for writev
+#include <unistd.h> // for fdatasync, ftruncate, pread, pwrite, close, unlink
+
+#define JOURNAL_MAGIC 0x4A545349u // "ISTJ"
+
+/**
+ * @brief On-disk record: followed by length bytes of data, then by the
+ *        checksum of the record and of its data.
+ */
+struct journal_record {
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t index;
+    uint32_t length;
+};
+
+/**
+ * FNV-1a hash, continued from hash
+ *
+ * @param hash hash of the previous bytes
+ * @param data bytes to be hashed
+ * @param length number of bytes
+ * @return the updated hash
+ */
+static uint32_t checksum(uint32_t hash, const void* data, size_t length)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#define CHECKSUM_INIT 2166136261u
+
+/**
+ * Allocates the name of the journal of the given imgStore file
+ *
+ * @param imgst_filename path to the imgStore file
+ * @return the name, to be freed, or NULL if out of memory
+ */
+static char* journal_path(const char* imgst_filename)
+{
+    const size_t len = strlen(imgst_filename);
+    char* path = malloc(len + sizeof(JOURNAL_SUFFIX));
+    if (path != NULL) {
+        memcpy(path, imgst_filename, len);
+        memcpy(path + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    }
+    return path;
+}
+
+int durability_atoi(const char* str)
+{
+    if (str == NULL) {
+        return -1;
+    }
+    if (!strcmp(str, "none")) {
+        return DURABILITY_NONE;
+    }
+    if (!strcmp(str, "batch")) {
+        return DURABILITY_BATCH;
+    }
+    if (!strcmp(str, "always")) {
+        return DURABILITY_ALWAYS;
+    }
+    return -1;
+}
+
+int durability_getenv(enum durability* durability)
+{
+    if (durability == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *durability = DURABILITY_NONE;
+    const char* env = getenv(DURABILITY_ENV);
+    if (env == NULL) {
+        return ERR_NONE;
+    }
+    const int mode = durability_atoi(env);
+    if (mode < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *durability = (enum durability) mode;
+    return ERR_NONE;
+}
+
+/**
+ * Writes the store back to disk: in-place updates as well as appended data
+ *
+ * @param imgst_file the file to be synced
+ * @return same error code as in error.c
+ */
+static int sync_store(const struct imgst_file* imgst_file)
+{
+    if (fflush(imgst_file->file) != 0) {
+        return ERR_IO;
+    }
+    // only the table: the rest of the range reserved for a growable one is not mapped to the file
+    const size_t table_size = sizeof(struct imgst_header)
+                              + (size_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+    if (imgst_file->map != NULL && imgst_file->is_map_shared
+        && msync(imgst_file->map, table_size, MS_SYNC) != 0) {
+        return ERR_IO;
+    }
+    return fdatasync(fileno(imgst_file->file)) == 0 ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Appends one record to the journal file, in a single write
+ *
+ * @param journal the journal
+ * @param kind kind of the record
+ * @param index index of the record
+ * @param data data of the record (may be NULL if length is 0)
+ * @param length size of data
+ * @return same error code as in error.c
+ */
+static int append_record(struct journal* journal, int kind, size_t index, const void* data, size_t length)
+{
+    struct journal_record record = {
+        .magic = JOURNAL_MAGIC,
+        .kind = (uint32_t) kind,
+        .index = (uint32_t) index,
+        .length = (uint32_t) length
+    };
+    uint32_t sum = checksum(checksum(CHECKSUM_INIT, &record, sizeof(record)), data, length);
+
+    struct iovec iov[3] = {
+        { .iov_base = &record, .iov_len = sizeof(record) },
+        { .iov_base = (void*) data, .iov_len = length },
+        { .iov_base = &sum, .iov_len = sizeof(sum) }
+    };
+    const size_t total = sizeof(record) + length + sizeof(sum);
+    if (writev(journal->fd, iov, 3) != (ssize_t) total) {
+        return ERR_IO;
+    }
+    journal->size += total;
+    return ERR_NONE;
+}
+
+/**
+ * Reads the records of the journal from the given offset to its end
+ *
+ * @param journal the journal
+ * @param from offset of the first record
+ * @param buffer output records, to be freed by the caller
+ * @return number of bytes read
+ */
+static size_t read_records(const struct journal* journal, uint64_t from, unsigned char** buffer)
+{
+    const size_t size = (size_t) (journal->size - from);
+    *buffer = malloc(size + 1);
+    if (*buffer == NULL) {
+        return 0;
+    }
+    size_t nb_read = 0;
+    while (nb_read < size) {
+        const ssize_t n = pread(journal->fd, *buffer + nb_read, size - nb_read, (off_t) (from + nb_read));
+        if (n <= 0) {
+            break;
+        }
+        nb_read += (size_t) n;
+    }
+    return nb_read;
+}
+
+/**
+ * Writes the committed records not written yet in place to the store, through
+ * its shared mapping if it is mapped: before that, the updates only are in the
+ * view (or in the metadata array read in memory)
+ *
+ * @param imgst_file the file whose records are written back
+ * @return same error code as in error.c
+ */
+static int write_back(const struct imgst_file* imgst_file)
+{
+    struct journal* journal = imgst_file->journal;
+    unsigned char* buffer = NULL;
+    const size_t size = read_records(journal, journal->applied, &buffer);
+    if (size != journal->size - journal->applied) {
+        free(buffer);
+        return buffer == NULL ? ERR_OUT_OF_MEMORY : ERR_IO;
+    }
+
+    const uint64_t table_end = sizeof(struct imgst_header)
+                               + (uint64_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+    int err = ERR_NONE;
+    size_t pos = 0;
+    while (err == ERR_NONE && size - pos >= sizeof(struct journal_record) + sizeof(uint32_t)) {
+        struct journal_record record;
+        memcpy(&record, buffer + pos, sizeof(record));
+        if (record.length > size - pos - sizeof(record) - sizeof(uint32_t)) {
+            break;
+        }
+        const unsigned char* data = buffer + pos + sizeof(record);
+        pos += sizeof(record) + record.length + sizeof(uint32_t);
+
+        const uint64_t offset = record.kind == JOURNAL_HEADER ? 0
+                                : sizeof(struct imgst_header) + (uint64_t) record.index * sizeof(struct img_metadata);
+        if (record.kind == JOURNAL_COMMIT || offset + record.length > table_end) {
+            continue;
+        }
+        if (imgst_file->map != NULL) {
+            memcpy((char*) imgst_file->map + offset, data, record.length);
+        } else if (pwrite(fileno(imgst_file->file), data, record.length, (off_t) offset) != (ssize_t) record.length) {
+            err = ERR_IO;
+        }
+    }
+    free(buffer);
+    if (err == ERR_NONE) {
+        journal->applied = journal->size;
+    }
+    return err;
+}
+
+/**
+ * Empties the journal once everything it holds is written back to the store
+ *
+ * @param imgst_file the file whose journal is emptied
+ * @return same error code as in error.c
+ */
+static int checkpoint(const struct imgst_file* imgst_file)
+{
+    struct journal* journal = imgst_file->journal;
+    int err = sync_store(imgst_file);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    if (ftruncate(journal->fd, 0) != 0) {
+        return ERR_IO;
+    }
+    journal->size = 0;
+    journal->applied = 0;
+    return ERR_NONE;
+}
+
+int journal_log(const struct imgst_file* imgst_file, int kind, size_t index, const void* data, size_t length)
+{
+    if (imgst_file == NULL || imgst_file->journal == NULL) {
+        return ERR_NONE;
+    }
+    struct journal* journal = imgst_file->journal;
+
+    // every record is committed, and was written in place
+    if (journal->nb_uncommitted == 0 && journal->size >= JOURNAL_CHECKPOINT_SIZE) {
+        int err = checkpoint(imgst_file);
+        if (err != ERR_NONE) {
+            return err;
+        }
+    }
+
+    int err = append_record(journal, kind, index, data, length);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    journal->nb_uncommitted += 1;
+
+    if (journal->mode == DURABILITY_ALWAYS || journal->nb_uncommitted >= JOURNAL_GROUP_SIZE) {
+        return journal_commit(imgst_file);
+    }
+    return ERR_NONE;
+}
+
+int journal_commit(const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->journal == NULL || imgst_file->journal->nb_uncommitted == 0) {
+        return ERR_NONE;
+    }
+    struct journal* journal = imgst_file->journal;
+
+    // the records must not be committed before the image data they refer to is on disk;
+    // the table in the store only holds records already committed
+    int err = sync_store(imgst_file);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    err = append_record(journal, JOURNAL_COMMIT, 0, NULL, 0);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    if (fdatasync(journal->fd) != 0) {
+        return ERR_IO;
+    }
+    journal->nb_uncommitted = 0;
+    // written back to disk by a later commit, or by the checkpoint
+    return write_back(imgst_file);
+}
+
+int journal_checkpoint(const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->journal == NULL) {
+        return ERR_NONE;
+    }
+    int err = journal_commit(imgst_file);
+    return err != ERR_NONE ? err : checkpoint(imgst_file);
+}
+
+/**
+ * Applies one committed record to the in-memory header and metadata
+ *
+ * @param imgst_file the file being recovered
+ * @param record the record
+ * @param data data of the record
+ */
+static void apply_record(struct imgst_file* imgst_file, const struct journal_record* record, const void* data)
+{
+    if (record->kind == JOURNAL_HEADER && record->length == sizeof(struct imgst_header)) {
+        // the layout of the metadata table is the one mapped (synced before any later record)
+        const struct imgst_header layout = imgst_file->header;
+        memcpy(&imgst_file->header, data, sizeof(struct imgst_header));
+        imgst_file->header.max_files = layout.max_files;
+        imgst_file->header.unused_32 = layout.unused_32;
+        imgst_file->header.unused_64 = layout.unused_64;
+    } else if (record->kind == JOURNAL_METADATA && record->length % sizeof(struct img_metadata) == 0) {
+        const size_t count = record->length / sizeof(struct img_metadata);
+        if (record->index <= imgst_file->header.max_files
+            && count <= imgst_file->header.max_files - record->index) {
+            memcpy(&imgst_file->metadata[record->index], data, record->length);
+        }
+    }
+}
+
+/**
+ * Drops what the updates which were not committed may have left inconsistent:
+ * images whose content is not entirely in the store, and the count of images
+ *
+ * @param imgst_file the file being recovered
+ * @return same error code as in error.c
+ */
+static int check_metadata(struct imgst_file* imgst_file)
+{
+    struct stat st;
+    if (fstat(fileno(imgst_file->file), &st) != 0) {
+        return ERR_IO;
+    }
+    const uint64_t store_size = (uint64_t) st.st_size;
+
+    uint32_t num_files = 0;
+    for (uint32_t i = 0; i < imgst_file->header.max_files; ++i) {
+        struct img_metadata* meta = &imgst_file->metadata[i];
+        if (meta->is_valid == EMPTY) {
+            continue;
+        }
+        if (meta->is_valid != NON_EMPTY || meta->size[RES_ORIG] == 0
+            || meta->offset[RES_ORIG] > store_size || meta->size[RES_ORIG] > store_size - meta->offset[RES_ORIG]) {
+            memset(meta, 0, sizeof(struct img_metadata));
+            continue;
+        }
+        for (int res = 0; res < RES_ORIG; ++res) {
+            if (meta->offset[res] > store_size || meta->size[res] > store_size - meta->offset[res]) {
+                // generated again on first read
+                meta->offset[res] = 0;
+                meta->size[res] = 0;
+            }
+        }
+        num_files += 1;
+    }
+    imgst_file->header.num_files = num_files;
+    return ERR_NONE;
+}
+
+/**
+ * Applies the committed records of the journal, up to the first damaged one
+ *
+ * @param imgst_file the file being recovered
+ * @param fd the journal file
+ * @return same error code as in error.c
+ */
+static int replay(struct imgst_file* imgst_file, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return ERR_IO;
+    }
+    const size_t size = (size_t) st.st_size;
+    unsigned char* buffer = malloc(size + 1);
+    if (buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_read = 0;
+    while (nb_read < size) {
+        const ssize_t n = pread(fd, buffer + nb_read, size - nb_read, (off_t) nb_read);
+        if (n <= 0) {
+            break;
+        }
+        nb_read += (size_t) n;
+    }
+
+    // first pass: end of the last commit record
+    size_t committed = 0;
+    size_t pos = 0;
+    while (nb_read - pos >= sizeof(struct journal_record) + sizeof(uint32_t)) {
+        struct journal_record record;
+        memcpy(&record, buffer + pos, sizeof(record));
+        if (record.magic != JOURNAL_MAGIC
+            || record.length > nb_read - pos - sizeof(record) - sizeof(uint32_t)) {
+            break;
+        }
+        uint32_t sum;
+        memcpy(&sum, buffer + pos + sizeof(record) + record.length, sizeof(sum));
+        if (sum != checksum(CHECKSUM_INIT, buffer + pos, sizeof(record) + record.length)) {
+            break; // torn write
+        }
+        pos += sizeof(record) + record.length + sizeof(sum);
+        if (record.kind == JOURNAL_COMMIT) {
+            committed = pos;
+        }
+    }
+
+    // second pass: apply them, in order
+    pos = 0;
+    while (pos < committed) {
+        struct journal_record record;
+        memcpy(&record, buffer + pos, sizeof(record));
+        apply_record(imgst_file, &record, buffer + pos + sizeof(record));
+        pos += sizeof(record) + record.length + sizeof(uint32_t);
+    }
+    free(buffer);
+
+    return check_metadata(imgst_file);
+}
+
+int journal_open(struct imgst_file* imgst_file, const char* imgst_filename, int is_writable,
+                 enum durability durability)
+{
+    if (imgst_file == NULL || imgst_filename == NULL
+        || (durability != DURABILITY_NONE && durability != DURABILITY_BATCH && durability != DURABILITY_ALWAYS)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    imgst_file->journal = NULL;
+    const enum durability mode = is_writable ? durability : DURABILITY_NONE;
+
+    // a single writer per store: another one would replay, and truncate, the journal of a live process
+    if (is_writable && flock(fileno(imgst_file->file), LOCK_EX | LOCK_NB) != 0) {
+        return ERR_IO;
+    }
+
+    char* path = journal_path(imgst_filename);
+    if (path == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int fd = open(path, is_writable ? O_RDWR | O_APPEND : O_RDONLY);
+    const int has_journal = fd >= 0;
+    if (!has_journal && errno == ENOENT && mode != DURABILITY_NONE) {
+        fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+    }
+    if (fd < 0) {
+        const int is_missing = errno == ENOENT;
+        free(path);
+        return is_missing ? ERR_NONE : ERR_IO;
+    }
+
+    int err = ERR_NONE;
+    if (has_journal) {
+        // the store was not closed properly
+        err = replay(imgst_file, fd);
+        if (err == ERR_NONE && is_writable) {
+            err = write_header(imgst_file);
+            if (err == ERR_NONE) {
+                err = write_metadata_range(imgst_file, 0, imgst_file->header.max_files);
+            }
+            if (err == ERR_NONE) {
+                err = sync_store(imgst_file);
+            }
+            if (err == ERR_NONE && ftruncate(fd, 0) != 0) {
+                err = ERR_IO;
+            }
+        }
+    }
+
+    if (err != ERR_NONE || mode == DURABILITY_NONE) {
+        close(fd);
+        if (err == ERR_NONE && has_journal && is_writable) {
+            unlink(path);
+        }
+        free(path);
+        return err;
+    }
+
+    struct journal* journal = calloc(1, sizeof(struct journal));
+    if (journal == NULL) {
+        close(fd);
+        free(path);
+        return ERR_OUT_OF_MEMORY;
+    }
+    journal->fd = fd;
+    journal->path = path;
+    journal->mode = mode;
+    imgst_file->journal = journal;
+    return ERR_NONE;
+}
+
+void journal_close(struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL || imgst_file->journal == NULL) {
+        return;
+    }
+    struct journal* journal = imgst_file->journal;
+
+    // the journal is only removed once the store is known to be complete
+    if (journal_commit(imgst_file) == ERR_NONE && checkpoint(imgst_file) == ERR_NONE) {
+        unlink(journal->path);
+    }
+    close(journal->fd);
+    free(journal->path);
+    free(journal);
+    imgst_file->journal = NULL;
+}
+
+void journal_remove(const char* imgst_filename)
+{
+    char* path = journal_path(imgst_filename);
+    if (path != NULL) {
+        unlink(path);
+        free(path);
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+/**
+ * @file journal.h
+ * @brief Write-ahead journal of the header and metadata updates of an imgst_file.
+ *
+ * The journal is a sidecar file (the imgStore file name followed by
+ * JOURNAL_SUFFIX) to which write_header and write_metadata_range append a copy
+ * of the header or metadata they are given. Updates are made in a private
+ * mapping of the table (the view of the imgst_file), so that nothing reaches
+ * the store before being committed. A commit makes the image data appended so
+ * far durable, then the records logged so far (a commit record, synced); only
+ * then are the records written in place, through the shared mapping. The
+ * records committed but maybe not written back are replayed on the next
+ * do_open if the store was not closed properly.
+ *
+ * The durability is given when the file is opened for writing (do_open_durable);
+ * applications take it from the DURABILITY_ENV environment variable:
+ *  - "none" (default): no journal, updates are written in place at once and
+ *    nothing is synced (as before);
+ *  - "batch": records are committed in groups, by one fdatasync of the store
+ *    and one of the journal, every JOURNAL_GROUP_SIZE records or on an
+ *    explicit journal_commit (e.g. once per server poll loop);
+ *  - "always": every record is committed by the write_header or
+ *    write_metadata_range logging it, before it returns.
+ *
+ * Updates not yet committed when the process dies are lost. The image data is
+ * synced before the records referring to it are committed; it is still checked
+ * on recovery, and images whose content is missing are dropped.
+ */
+
+#include "imgStore.h"
+#include <stddef.h> // for size_t
+
+#define JOURNAL_SUFFIX ".journal"
+#define DURABILITY_ENV "IMGSTORE_DURABILITY"
+
+#define JOURNAL_GROUP_SIZE 256                 // records committed at once at most, in batch mode
+#define JOURNAL_CHECKPOINT_SIZE (4 * 1024 * 1024) // journal size above which it is emptied
+
+/* kinds of records */
+#define JOURNAL_HEADER   1
+#define JOURNAL_METADATA 2
+#define JOURNAL_COMMIT   3
+
+struct journal {
+    int fd;                  // journal file, opened for appending
+    char* path;
+    enum durability mode;
+    size_t nb_uncommitted;   // records logged since the last commit
+    uint64_t size;           // current size of the journal file
+    uint64_t applied;        // end of the records written in place
+};
+
+/**
+ * Transforms a durability string ("none", "batch" or "always") to its value
+ *
+ * @param str the durability string
+ * @return the durability, or -1 if not a valid one
+ */
+int durability_atoi(const char* str);
+
+/**
+ * Reads the durability asked for in the DURABILITY_ENV environment variable
+ *
+ * @param durability output durability, DURABILITY_NONE if the variable is not set
+ * @return same error code as in error.c
+ */
+int durability_getenv(enum durability* durability);
+
+/**
+ * Replays the journal left by a process which did not close the store, then
+ * starts journaling if the file is writable and the durability asks for it.
+ * To be called by do_open_durable once the header and metadata are loaded,
+ * before the view is mapped. A writable file is locked until it is closed:
+ * ERR_IO if another writer holds the store.
+ *
+ * @param imgst_file the opened file (its journal member is set)
+ * @param imgst_filename path to the imgStore file
+ * @param is_writable the file was opened for writing
+ * @param durability how updates are made durable
+ * @return same error code as in error.c
+ */
+int journal_open(struct imgst_file* imgst_file, const char* imgst_filename, int is_writable,
+                 enum durability durability);
+
+/**
+ * Appends a record to the journal of the file (if any), committing it if needed
+ *
+ * @param imgst_file the file being updated
+ * @param kind JOURNAL_HEADER or JOURNAL_METADATA
+ * @param index index of the first metadata written (0 for the header)
+ * @param data what is written in place
+ * @param length size of data
+ * @return same error code as in error.c
+ */
+int journal_log(const struct imgst_file* imgst_file, int kind, size_t index, const void* data, size_t length);
+
+/**
+ * Makes the records logged so far (and the image data they refer to) durable,
+ * then writes them in place
+ *
+ * @param imgst_file the file whose journal is committed
+ * @return same error code as in error.c
+ */
+int journal_commit(const struct imgst_file* imgst_file);
+
+/**
+ * Commits, writes the store back to disk and empties the journal (if any):
+ * the store then holds every update, e.g. before its layout changes
+ *
+ * @param imgst_file the file whose journal is checkpointed
+ * @return same error code as in error.c
+ */
+int journal_checkpoint(const struct imgst_file* imgst_file);
+
+/**
+ * Commits, writes the store back to disk, and removes the journal of the file (if any)
+ *
+ * @param imgst_file the file whose journal is closed
+ */
+void journal_close(struct imgst_file* imgst_file);
+
+/**
+ * Removes the journal possibly left next to the given imgStore file, e.g. when it is recreated
+ *
+ * @param imgst_filename path to the imgStore file
+ */
+void journal_remove(const char* imgst_filename);
@@ -18,6 +18,14 @@
 
 #include "mongoose.h"
 
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+// To be called whenever the connection may start or stop having data to send
+static void mg_epoll_update(struct mg_connection *c);
+#else
+#define mg_epoll_update(c)
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/private.h"
 #endif
@@ -413,6 +421,22 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
   c->is_closing = 1;
 }
 
+// Held connections are also linked on their own list, so that mg_mgr_poll
+// finds the ones which can go on without looking at every connection
+void mg_hold(struct mg_connection *c, bool held) {
+  struct mg_connection **h = &c->mgr->held;
+  if (held == (bool) c->is_held) return;
+  c->is_held = held;
+  if (held) {
+    c->next_held = *h;
+    *h = c;
+  } else {
+    while (*h != c) h = &(*h)->next_held;
+    *h = c->next_held;
+    c->next_held = NULL;
+  }
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/http.c"
 #endif
@@ -452,6 +476,7 @@ void mg_http_bauth(struct mg_connection *c, const char *user,
     n = mg_base64_final(buf, n);
     c->send.len += 21 + n + 2;
     memcpy(&c->send.buf[c->send.len - 2], "\r\n", 2);
+    mg_epoll_update(c);
   } else {
     LOG(LL_ERROR, ("%lu %s cannot resize iobuf %d->%d ", c->id, c->label,
                    (int) c->send.size, (int) need));
@@ -711,6 +736,7 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
     if (c->send.len >= c->send.size) return;  // Rate limit
     n = fread(c->send.buf + c->send.len, 1, c->send.size - c->send.len, d->fp);
     if (n > 0) c->send.len += n;
+    mg_epoll_update(c);
     if (c->send.len < c->send.size) restore_http_cb(c);
   } else if (ev == MG_EV_CLOSE) {
     restore_http_cb(c);
@@ -1116,15 +1142,23 @@ bool mg_http_match_uri(const struct mg_http_message *hm, const char *glob) {
 
 static void http_cb(struct mg_connection *c, int ev, void *ev_data,
                     void *fn_data) {
-  if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
+  if (ev == MG_EV_READ || ev == MG_EV_CLOSE ||
+      (ev == MG_EV_POLL && c->is_held && !c->is_resp)) {
     struct mg_http_message hm;
+    mg_hold(c, false);
     for (;;) {
-      int n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+      int n;
+      if (c->is_resp) {
+        // Responses go out in the order of the requests
+        mg_hold(c, c->recv.len > 0);
+        break;
+      }
+      n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
       if (ev == MG_EV_CLOSE) {
         hm.message.len = c->recv.len;
         hm.body.len = hm.message.len - (hm.body.ptr - hm.message.ptr);
       }
-      if (n < 0 && ev == MG_EV_READ) {
+      if (n < 0 && ev != MG_EV_CLOSE) {
         LOG(LL_ERROR, ("%lu HTTP parse error", c->id));
         c->is_closing = 1;
         break;
@@ -2099,6 +2133,10 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   mg_mgr_poll(mgr, 0);
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_DeleteSocketSet(mgr->ss);
+#endif
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+  mgr->epoll_fd = -1;
 #endif
   LOG(LL_INFO, ("All connections closed"));
 }
@@ -2118,6 +2156,11 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   mgr->dnstimeout = 3000;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
+#if MG_ENABLE_EPOLL
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    LOG(LL_ERROR, ("epoll_create1: %d, using select()", errno));
+  }
+#endif
 }
 
 #ifdef MG_ENABLE_LINES
@@ -2528,6 +2571,30 @@ static int mg_sock_failed(void) {
       ;
 }
 
+#if MG_ENABLE_EPOLL
+// Registers a new socket, for readability only; writability is added on demand
+static void mg_epoll_add(struct mg_connection *c) {
+  struct epoll_event ev;
+  if (c->mgr->epoll_fd < 0 || FD(c) == INVALID_SOCKET) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, FD(c), &ev) != 0) {
+    LOG(LL_ERROR, ("%lu epoll_ctl: %d", c->id, MG_SOCK_ERRNO));
+  }
+  c->is_polled_out = 0;
+}
+
+static void mg_epoll_del(struct mg_connection *c) {
+  struct epoll_event ev;  // Ignored, but required by kernels before 2.6.9
+  if (c->mgr->epoll_fd < 0 || FD(c) == INVALID_SOCKET) return;
+  epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), &ev);
+}
+#else
+#define mg_epoll_add(c)
+#define mg_epoll_del(c)
+#endif
+
 static struct mg_connection *alloc_conn(struct mg_mgr *mgr, int is_client,
                                         SOCKET fd) {
   struct mg_connection *c = (struct mg_connection *) calloc(1, sizeof(*c));
@@ -2620,6 +2687,7 @@ int mg_send(struct mg_connection *c, const void *buf, size_t len) {
   int fail, n = c->is_udp
                     ? ll_write(c, buf, (SOCKET) len, &fail)
                     : (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+  mg_epoll_update(c);
   return n;
 }
 
@@ -2710,10 +2778,18 @@ static void read_conn(struct mg_connection *c,
 }
 
 static int write_conn(struct mg_connection *c) {
-  int fail, rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+  int fail, rc;
+  if (c->send.len == 0) {
+    // Writable for the handler, which writes past send
+    rc = 0;
+    if (c->is_streaming) mg_call(c, MG_EV_WRITE, &rc);
+    return rc;
+  }
+  rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
   if (rc > 0) {
     mg_iobuf_delete(&c->send, rc);
     if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
+    mg_epoll_update(c);
     mg_call(c, MG_EV_WRITE, &rc);
   } else if (fail) {
     c->is_closing = 1;
@@ -2728,9 +2804,11 @@ static void close_conn(struct mg_connection *c) {
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
   mg_call(c, MG_EV_CLOSE, NULL);
+  mg_hold(c, false);
   // while (c->callbacks != NULL) mg_fn_del(c, c->callbacks->fn);
   LOG(LL_DEBUG, ("%lu closed", c->id));
   if (FD(c) != INVALID_SOCKET) {
+    mg_epoll_del(c);
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
@@ -2785,6 +2863,7 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 
   mg_set_non_blocking_mode(FD(c));
+  mg_epoll_add(c);
   mg_call(c, MG_EV_RESOLVE, NULL);
   if (type == SOCK_STREAM) {
     union usa usa = tousa(&c->peer);
@@ -2801,6 +2880,7 @@ void mg_connect_resolved(struct mg_connection *c) {
       setsockopts(c);
     }
     if (rc < 0) c->is_connecting = 1;
+    mg_epoll_update(c);
   }
 }
 
@@ -2830,7 +2910,11 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   if (fd == INVALID_SOCKET) {
     LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
 #if !defined(_WIN32)
+#if MG_ENABLE_EPOLL
+  } else if (mgr->epoll_fd < 0 && fd >= FD_SETSIZE) {
+#else
   } else if (fd >= FD_SETSIZE) {
+#endif
     LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
 #endif
@@ -2852,6 +2936,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     LOG(LL_DEBUG, ("%lu accepted %s", c->id, buf));
     mg_set_non_blocking_mode(FD(c));
     setsockopts(c);
+    mg_epoll_add(c);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
@@ -2905,6 +2990,21 @@ bool mg_socketpair(int *s1, int *s2) {
 }
 #endif
 
+// Watches a descriptor opened by the caller (e.g. one end of mg_socketpair)
+// like any other connection: its handler gets MG_EV_READ when data arrives
+struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
+                                mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c = alloc_conn(mgr, 0, (SOCKET) fd);
+  if (c != NULL) {
+    mg_set_non_blocking_mode((SOCKET) fd);
+    mg_epoll_add(c);
+    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    c->fn = fn;
+    c->fn_data = fn_data;
+  }
+  return c;
+}
+
 struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
                                 mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
@@ -2919,6 +3019,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     c->is_listening = 1;
     c->is_udp = is_udp;
     setsockopts(c);
+    mg_epoll_add(c);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fn = fn;
     c->fn_data = fn_data;
@@ -2927,6 +3028,44 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+#if MG_ENABLE_EPOLL
+// Sockets stay registered for their whole life (level-triggered); only the
+// interest in writability changes, when there starts or stops being
+// something to send: no connection is looked at unless it has an event
+static void mg_epoll_update(struct mg_connection *c) {
+  bool want_out = c->is_connecting || c->is_streaming ||
+                  (c->send.len > 0 && c->is_tls_hs == 0);
+  struct epoll_event ev;
+  if (want_out == (bool) c->is_polled_out || c->mgr->epoll_fd < 0 ||
+      c->is_resolving || FD(c) == INVALID_SOCKET)
+    return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, FD(c), &ev) == 0) {
+    c->is_polled_out = want_out;
+  }
+}
+
+static void mg_epoll_iotest(struct mg_mgr *mgr, int ms) {
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  struct mg_connection *c;
+  int i, n;
+
+  if ((n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms)) < 0) {
+    LOG(LL_DEBUG, ("epoll_wait: %d %d", n, MG_SOCK_ERRNO));
+    n = 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    c = (struct mg_connection *) evs[i].data.ptr;
+    // Errors and hang-ups are reported by the next read or write
+    if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) c->is_readable = 1;
+    if (evs[i].events & EPOLLOUT) c->is_writable = 1;
+  }
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
 #if MG_ARCH == MG_ARCH_FREERTOS
   struct mg_connection *c;
@@ -2948,6 +3087,13 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
   SOCKET maxfd = 0;
   int rc;
 
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) {
+    mg_epoll_iotest(mgr, ms);
+    return;
+  }
+#endif
+
   FD_ZERO(&rset);
   FD_ZERO(&wset);
 
@@ -2958,7 +3104,8 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
     FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
+    if (c->is_connecting || c->is_streaming ||
+        (c->send.len > 0 && c->is_tls_hs == 0))
       FD_SET(FD(c), &wset);
   }
 
@@ -2991,12 +3138,17 @@ static void connect_conn(struct mg_connection *c) {
     if (c->is_tls_hs) mg_tls_handshake(c);
     mg_call(c, MG_EV_CONNECT, NULL);
   }
+  mg_epoll_update(c);
 }
 
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   unsigned long now;
 
+  // Requests held by a finished response are handled without waiting
+  for (c = mgr->held; c != NULL; c = c->next_held) {
+    if (!c->is_resp) ms = 0;
+  }
   mg_iotest(mgr, ms);
   now = mg_millis();
   mg_timer_poll(now);
@@ -3017,10 +3169,19 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_readable || c->is_writable) connect_conn(c);
     } else if (c->is_tls_hs) {
       if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+      mg_epoll_update(c);
     } else {
       if (c->is_readable) read_conn(c, ll_read);
       if (c->is_writable) write_conn(c);
+      // The handlers may have started or stopped streaming
+      mg_epoll_update(c);
     }
+#if MG_ENABLE_EPOLL
+    // Only the connections in the next events are readable or writable;
+    // TLS might have stuff buffered, so dig everything
+    c->is_readable = c->is_tls && c->is_readable ? 1 : 0;
+    c->is_writable = 0;
+#endif
 
     if (c->is_draining && c->send.len == 0) c->is_closing = 1;
     if (c->is_closing) close_conn(c);
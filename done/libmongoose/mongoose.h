@@ -326,8 +326,23 @@ typedef int socklen_t;
 #define MG_ENABLE_HTTP_DEBUG_ENDPOINT 0
 #endif
 
+// mg_socketpair(), with which the imgStore server wakes up its polling thread
 #ifndef MG_ENABLE_SOCKETPAIR
-#define MG_ENABLE_SOCKETPAIR 0
+#define MG_ENABLE_SOCKETPAIR 1
+#endif
+
+// Use epoll(7) instead of select(), with no FD_SETSIZE limit, where available
+#ifndef MG_ENABLE_EPOLL
+#if defined(__linux__) && MG_ARCH == MG_ARCH_UNIX
+#define MG_ENABLE_EPOLL 1
+#else
+#define MG_ENABLE_EPOLL 0
+#endif
+#endif
+
+// Maximum number of events fetched by one epoll_wait() call
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 1024
 #endif
 
 // Granularity of the send/recv IO buffer growth
@@ -555,6 +570,7 @@ void mg_fn_del(struct mg_connection *c, mg_event_handler_t fn);
 
 void mg_call(struct mg_connection *c, int ev, void *ev_data);
 void mg_error(struct mg_connection *c, const char *fmt, ...);
+void mg_hold(struct mg_connection *c, bool held);
 
 enum {
   MG_EV_ERROR,      // Error                        char *error_message
@@ -600,13 +616,18 @@ struct mg_mgr {
   struct mg_dns dns6;           // DNS for IPv6
   int dnstimeout;               // DNS resolve timeout in milliseconds
   unsigned long nextid;         // Next connection ID
+  struct mg_connection *held;   // Connections holding a request (is_held)
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
+#if MG_ENABLE_EPOLL
+  int epoll_fd;  // epoll instance, or -1 to fall back to select()
+#endif
 };
 
 struct mg_connection {
   struct mg_connection *next;  // Linkage in struct mg_mgr :: connections
+  struct mg_connection *next_held;  // Linkage in struct mg_mgr :: held
   struct mg_mgr *mgr;          // Our container
   struct mg_addr peer;         // Remote peer address
   void *fd;                    // Connected socket, or LWIP data
@@ -633,6 +654,10 @@ struct mg_connection {
   unsigned is_closing : 1;     // Close and free the connection immediately
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_polled_out : 1;  // Registered for writability (epoll)
+  unsigned is_resp : 1;        // Response in progress: next requests wait
+  unsigned is_held : 1;        // A request waits for the response in progress
+  unsigned is_streaming : 1;   // Handler writes past send, on MG_EV_WRITE
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
@@ -643,6 +668,8 @@ struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
                                  mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_wrapfd(struct mg_mgr *, int fd,
+                                mg_event_handler_t fn, void *fn_data);
 int mg_send(struct mg_connection *, const void *, size_t);
 int mg_printf(struct mg_connection *, const char *fmt, ...);
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
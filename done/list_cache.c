@@ -0,0 +1,135 @@
+/**
+ * @file list_cache.c
+ * @brief imgStore server: versioned cache of the serialized listing implementation.
+ */
+
+#include "list_cache.h"
+#include <stdlib.h> // for malloc, realloc, free
+#include <string.h> // for memset
+#include <zlib.h>
+
+#define LIST_BUILD_SIZE (16 * 1024) // first size of the buffer, doubled as needed
+
+void list_cache_init(struct list_cache* cache)
+{
+    if (cache != NULL) {
+        memset(cache, 0, sizeof(struct list_cache));
+    }
+}
+
+/**
+ * Writes the whole listing of a store in a buffer
+ *
+ * @param store the listed shards
+ * @param json output listing, to be freed by the caller
+ * @param json_size output size of the listing
+ * @return same error code as in error.c
+ */
+static int build_json(const struct shard_set* store, char** json, size_t* json_size)
+{
+    struct list_stream stream;
+    do_list_json_start(&stream, 0, 0);
+
+    size_t capacity = LIST_BUILD_SIZE;
+    size_t size = 0;
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t length = 0;
+    do {
+        if (capacity - size < MAX_LIST_PIECE_STRLEN) {
+            capacity *= 2;
+            char* larger = realloc(buffer, capacity);
+            if (larger == NULL) {
+                free(buffer);
+                return ERR_OUT_OF_MEMORY;
+            }
+            buffer = larger;
+        }
+        length = do_list_json_next_all(store->shards, store->nb_shards, &stream, buffer + size, capacity - size);
+        size += length;
+    } while (length > 0);
+
+    *json = buffer;
+    *json_size = size;
+    return ERR_NONE;
+}
+
+/**
+ * Compresses the listing in the gzip format
+ *
+ * @param cache the cache, whose json is set
+ * @return same error code as in error.c
+ */
+static int build_gzip(struct list_cache* cache)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 more window bits: gzip header and trailer instead of zlib ones
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const uLong bound = deflateBound(&zs, (uLong) cache->json_size);
+    cache->gzip = malloc(bound);
+    if (cache->gzip == NULL) {
+        deflateEnd(&zs);
+        return ERR_OUT_OF_MEMORY;
+    }
+    zs.next_in = (Bytef*) cache->json;
+    zs.avail_in = (uInt) cache->json_size;
+    zs.next_out = cache->gzip;
+    zs.avail_out = (uInt) bound;
+    const int ret = deflate(&zs, Z_FINISH);
+    cache->gzip_size = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(cache->gzip);
+        cache->gzip = NULL;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int list_cache_refresh(struct list_cache* cache, const struct shard_set* store)
+{
+    if (cache == NULL || store == NULL || store->shards == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const uint32_t version = shard_version(store);
+    if (cache->is_valid && cache->version == version) {
+        cache->hits += 1;
+        return ERR_NONE;
+    }
+
+    cache->misses += 1;
+    list_cache_free(cache);
+    int err = build_json(store, &cache->json, &cache->json_size);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    // the compressed form is optional: the listing is served as it is without it
+    if (cache->json_size >= LIST_GZIP_MIN_SIZE && build_gzip(cache) == ERR_NONE
+        && cache->gzip_size >= cache->json_size) {
+        free(cache->gzip);
+        cache->gzip = NULL;
+    }
+    cache->version = version;
+    cache->is_valid = 1;
+    return ERR_NONE;
+}
+
+void list_cache_free(struct list_cache* cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    free(cache->json);
+    free(cache->gzip);
+    cache->json = NULL;
+    cache->gzip = NULL;
+    cache->json_size = 0;
+    cache->gzip_size = 0;
+    cache->is_valid = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+/**
+ * @file list_cache.h
+ * @brief Last complete listing of a (sharded) imgStore, serialized in JSON and gzip.
+ *
+ * The listing only changes when an image is inserted or deleted, which both
+ * bump the imgst_version of its shard: the cached listing is served as it is
+ * as long as the version of the store is the one it was built at, and built
+ * again otherwise.
+ */
+
+#include "imgStore.h"
+#include "shard.h"
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+// listings shorter than this are not worth compressing
+#define LIST_GZIP_MIN_SIZE 256
+
+struct list_cache {
+    int is_valid;
+    uint32_t version;          // shard_version the listing was built at
+    char* json;                // same text as do_list_json_next writes
+    size_t json_size;
+    unsigned char* gzip;       // gzip form of json, NULL if not smaller
+    size_t gzip_size;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/**
+ * Initializes an empty cache
+ *
+ * @param cache the cache to be initialized
+ */
+void list_cache_init(struct list_cache* cache);
+
+/**
+ * Makes the cached listing the current one of the store, building it again
+ * (with its gzip form) if the version of the store changed
+ *
+ * @param cache the cache
+ * @param store the listed shards, opened
+ * @return same error code as in error.c
+ */
+int list_cache_refresh(struct list_cache* cache, const struct shard_set* store);
+
+/**
+ * Releases the cached listing
+ *
+ * @param cache the cache to be released
+ */
+void list_cache_free(struct list_cache* cache);
@@ -0,0 +1,224 @@
+/**
+ * @file resize_queue.c
+ * @brief imgStore library: background generation of resized images implementation.
+ */
+
+#include "resize_queue.h"
+#include "image_content.h"
+#include <stdlib.h> // for calloc, realloc, free
+#include <string.h> // for memcmp, memset
+
+struct eager_job {
+    struct resize_queue* queue;
+    size_t index;
+    struct img_metadata meta;           // metadata of the image when queued
+    uint16_t res_resized[2 * (NB_RES - 1)];
+    int fd;
+    struct resized_set set;             // generated versions
+    int error;
+};
+
+/**
+ * Worker side: generates the missing versions from the original, decoded once
+ *
+ * @param arg the eager_job
+ */
+static void run_eager(void* arg)
+{
+    struct eager_job* job = arg;
+    job->error = resize_original(job->fd, &job->meta, job->res_resized, &job->set);
+}
+
+/**
+ * Owner side: stores the generated versions, unless the image changed meanwhile,
+ * and clears the flag of the image
+ *
+ * @param arg the eager_job
+ */
+static void complete_eager(void* arg)
+{
+    struct eager_job* job = arg;
+    struct imgst_file* im_file = job->queue->file;
+    struct img_metadata* meta = &im_file->metadata[job->index];
+
+    job->queue->is_queued[job->index] = 0;
+
+    if (meta->is_valid == NON_EMPTY && meta->offset[RES_ORIG] == job->meta.offset[RES_ORIG]
+        && !memcmp(meta->SHA, job->meta.SHA, SHA256_DIGEST_LENGTH)) {
+        // a read may have generated some of them first: those are skipped
+        if (job->error == ERR_NONE) {
+            store_resized(im_file, job->index, &job->set);
+        }
+        // on failure, the versions will be generated on first read, as without this queue
+        meta->unused_16 &= (uint16_t) ~PENDING_RESIZE;
+        write_metadata(im_file, job->index);
+    }
+
+    resized_free(&job->set);
+    free(job);
+}
+
+/**
+ * Hands the image at index over to the worker
+ *
+ * @param queue the queue
+ * @param index index of the metadata of the image in file
+ * @return same error code as in error.c
+ */
+static int submit(struct resize_queue* queue, size_t index)
+{
+    struct imgst_file* im_file = queue->file;
+
+    // the worker reads the original through the descriptor, not through stdio
+    if (fflush(im_file->file) != 0) {
+        return ERR_IO;
+    }
+
+    struct eager_job* job = calloc(1, sizeof(struct eager_job));
+    if (job == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    job->queue = queue;
+    job->index = index;
+    job->meta = im_file->metadata[index];
+    memcpy(job->res_resized, im_file->header.res_resized, sizeof(job->res_resized));
+    job->fd = fileno(im_file->file);
+
+    int err = pool_submit(&queue->pool, run_eager, complete_eager, job);
+    if (err != ERR_NONE) {
+        free(job);
+        return err;
+    }
+    queue->is_queued[index] = 1;
+    return ERR_NONE;
+}
+
+/**
+ * Sizes is_queued after the metadata table, which grows with growable stores
+ *
+ * @param queue the queue
+ * @return same error code as in error.c
+ */
+static int fit_slots(struct resize_queue* queue)
+{
+    const uint32_t nb_slots = queue->file->header.max_files;
+    if (nb_slots <= queue->nb_slots) {
+        return ERR_NONE;
+    }
+    uint8_t* is_queued = realloc(queue->is_queued, nb_slots);
+    if (is_queued == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memset(is_queued + queue->nb_slots, 0, nb_slots - queue->nb_slots);
+    queue->is_queued = is_queued;
+    queue->nb_slots = nb_slots;
+    return ERR_NONE;
+}
+
+int resize_queue_start(struct resize_queue* queue, struct imgst_file* im_file)
+{
+    if (queue == NULL || im_file == NULL || im_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    queue->file = im_file;
+    queue->has_overflow = 0;
+    queue->nb_slots = im_file->header.max_files;
+    queue->is_queued = calloc(queue->nb_slots, sizeof(uint8_t));
+    if (queue->is_queued == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int err = pool_init(&queue->pool, 1, RESIZE_QUEUE_LENGTH);
+    if (err != ERR_NONE) {
+        free(queue->is_queued);
+        queue->is_queued = NULL;
+    }
+    return err;
+}
+
+int resize_queue_add(struct resize_queue* queue, size_t index)
+{
+    if (queue == NULL || index >= queue->file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int err = fit_slots(queue);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    struct img_metadata* meta = &queue->file->metadata[index];
+    if (meta->is_valid != NON_EMPTY) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    if (meta->size[RES_THUMB] != 0 && meta->size[RES_SMALL] != 0) {
+        return ERR_NONE; // e.g. same content as an image already resized
+    }
+
+    // flagged on disk first, so that the work is not lost if interrupted
+    meta->unused_16 |= PENDING_RESIZE;
+    err = write_metadata(queue->file, index);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    if (queue->is_queued[index]) {
+        return ERR_NONE;
+    }
+    if (!pool_has_room(&queue->pool)) {
+        queue->has_overflow = 1;
+        return ERR_NONE;
+    }
+    return submit(queue, index);
+}
+
+int resize_queue_resume(struct resize_queue* queue)
+{
+    if (queue == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct imgst_file* im_file = queue->file;
+    int err = fit_slots(queue);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    queue->has_overflow = 0;
+    for (uint32_t i = 0; i < im_file->header.max_files; ++i) {
+        if (im_file->metadata[i].is_valid == NON_EMPTY && (im_file->metadata[i].unused_16 & PENDING_RESIZE)
+            && !queue->is_queued[i]) {
+            if (!pool_has_room(&queue->pool)) {
+                queue->has_overflow = 1;
+                return ERR_NONE;
+            }
+            err = submit(queue, i);
+            if (err != ERR_NONE) {
+                return err;
+            }
+        }
+    }
+    return ERR_NONE;
+}
+
+size_t resize_queue_complete(struct resize_queue* queue)
+{
+    if (queue == NULL) {
+        return 0;
+    }
+
+    const size_t nb_completed = pool_complete(&queue->pool);
+    if (nb_completed > 0 && queue->has_overflow) {
+        resize_queue_resume(queue);
+    }
+    return nb_completed;
+}
+
+void resize_queue_end(struct resize_queue* queue)
+{
+    if (queue == NULL || queue->is_queued == NULL) {
+        return;
+    }
+    pool_end(&queue->pool);
+    free(queue->is_queued);
+    queue->is_queued = NULL;
+}
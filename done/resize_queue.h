@@ -0,0 +1,70 @@
+#pragma once
+
+/**
+ * @file resize_queue.h
+ * @brief Background generation of the thumbnail and small versions of inserted images.
+ *
+ * Images are flagged PENDING_RESIZE in their metadata (on disk) before being
+ * queued, and the flag is only cleared once both versions are stored, so that
+ * images whose generation was interrupted are found again by resize_queue_resume.
+ * Images that do not fit in the bounded queue stay flagged and are queued as
+ * soon as room is made.
+ *
+ * Only the generation runs on the worker; the imgst_file is updated by the
+ * thread calling resize_queue_complete (or resize_queue_end), which must be
+ * the one owning the file.
+ */
+
+#include "imgStore.h"
+#include "work_pool.h"
+
+#define RESIZE_QUEUE_LENGTH 64
+
+struct resize_queue {
+    struct work_pool pool;
+    struct imgst_file* file;
+    uint8_t* is_queued; // per metadata slot, image currently in the queue
+    uint32_t nb_slots;  // size of is_queued (the metadata table may have grown since)
+    int has_overflow;   // some flagged images are not queued
+};
+
+/**
+ * Starts the background worker for the given file
+ *
+ * @param queue queue to be initialized
+ * @param im_file file whose images are resized
+ * @return same error code as in error.c
+ */
+int resize_queue_start(struct resize_queue* queue, struct imgst_file* im_file);
+
+/**
+ * Flags the image at index and queues the generation of its missing versions
+ *
+ * @param queue the queue
+ * @param index index of the metadata of the image in file
+ * @return same error code as in error.c
+ */
+int resize_queue_add(struct resize_queue* queue, size_t index);
+
+/**
+ * Queues (as much as possible of) the images flagged in the file, e.g. after a restart
+ *
+ * @param queue the queue
+ * @return same error code as in error.c
+ */
+int resize_queue_resume(struct resize_queue* queue);
+
+/**
+ * Stores the versions generated so far, and queues flagged images if room was made
+ *
+ * @param queue the queue
+ * @return number of images completed
+ */
+size_t resize_queue_complete(struct resize_queue* queue);
+
+/**
+ * Waits for the queued images to be completed and stops the worker
+ *
+ * @param queue the queue to be released
+ */
+void resize_queue_end(struct resize_queue* queue);
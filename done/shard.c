@@ -0,0 +1,362 @@
+/**
+ * @file shard.c
+ * @brief imgStore library: sharded imgStores implementation.
+ */
+
+#include "shard.h"
+#include "work_pool.h"
+#include <inttypes.h> // for PRIu32, SCNu32
+#include <stdlib.h> // for calloc, malloc, free
+#include <string.h> // for strlen, strrchr, memcpy
+
+/**
+ * Shard collected by a worker of shard_gbcollect
+ */
+struct gc_job {
+    const char* filename;
+    char* tmp_filename;
+    int error;
+    int* first_error;            // error of shard_gbcollect, set on completion
+};
+
+/**
+ * Hashes an image id: the shard of an image never changes. The img_id index
+ * takes the low bits of a 32-bit FNV-1a; the shards take the high bits of a
+ * 64-bit FNV-1a, mixed by Fibonacci hashing, so that the ids of a shard still
+ * spread over all the buckets of its index.
+ *
+ * @param img_id id of the image
+ * @return the hash
+ */
+static uint32_t id_hash(const char* img_id)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= 1099511628211u;
+    }
+    return (uint32_t) ((hash * 11400714819323198485u) >> 32);
+}
+
+/**
+ * Allocates the names of the shards of a set
+ *
+ * @param set the set, whose nb_shards is set
+ * @return same error code as in error.c
+ */
+static int alloc_filenames(struct shard_set* set)
+{
+    set->filenames = calloc(set->nb_shards, sizeof(char*));
+    return set->filenames == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+/**
+ * Builds the path of a file named in a manifest: relative to its directory
+ *
+ * @param manifest the manifest
+ * @param name name of the file, as in the manifest
+ * @return the path, to be freed by the caller, NULL if out of memory
+ */
+static char* shard_path(const char* manifest, const char* name)
+{
+    const char* slash = strrchr(manifest, '/');
+    const size_t dir_length = slash == NULL ? 0 : (size_t) (slash - manifest) + 1;
+    char* path = malloc(dir_length + strlen(name) + 1);
+    if (path != NULL) {
+        memcpy(path, manifest, dir_length);
+        strcpy(path + dir_length, name);
+    }
+    return path;
+}
+
+/**
+ * Reads the shards listed by a manifest, after its first line
+ *
+ * @param manifest the manifest file, at its second line
+ * @param filename name of the manifest
+ * @param set the set to be filled
+ * @return same error code as in error.c
+ */
+static int read_manifest(FILE* manifest, const char* filename, struct shard_set* set)
+{
+    char line[MAX_SHARD_LINE];
+    if (fgets(line, sizeof(line), manifest) == NULL || sscanf(line, "%" SCNu32, &set->nb_shards) != 1
+        || set->nb_shards == 0 || set->nb_shards > MAX_SHARDS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int err = alloc_filenames(set);
+    for (uint32_t i = 0; err == ERR_NONE && i < set->nb_shards; ++i) {
+        if (fgets(line, sizeof(line), manifest) == NULL) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            return ERR_INVALID_FILENAME;
+        }
+        set->filenames[i] = shard_path(filename, line);
+        if (set->filenames[i] == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        }
+    }
+    return err;
+}
+
+int shard_load(const char* filename, struct shard_set* set)
+{
+    if (filename == NULL || set == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(set, 0, sizeof(struct shard_set));
+
+    FILE* manifest = fopen(filename, "r");
+    char line[MAX_SHARD_LINE] = "";
+    unsigned int revision = 0;
+    if (manifest == NULL || fgets(line, sizeof(line), manifest) == NULL
+        || strncmp(line, SHARD_MAGIC " ", strlen(SHARD_MAGIC " "))) {
+        // a plain imgStore file: any error about it is left to do_open
+        if (manifest != NULL) {
+            fclose(manifest);
+        }
+        set->nb_shards = 1;
+        int err = alloc_filenames(set);
+        if (err == ERR_NONE && (set->filenames[0] = malloc(strlen(filename) + 1)) == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        }
+        if (err != ERR_NONE) {
+            shard_free(set);
+            return err;
+        }
+        strcpy(set->filenames[0], filename);
+        return ERR_NONE;
+    }
+
+    set->is_sharded = 1;
+    int err = sscanf(line + strlen(SHARD_MAGIC), "%u", &revision) == 1 && revision == SHARD_REVISION
+              ? read_manifest(manifest, filename, set) : ERR_INVALID_ARGUMENT;
+    fclose(manifest);
+    if (err != ERR_NONE) {
+        shard_free(set);
+    }
+    return err;
+}
+
+/**
+ * Removes the shards created by shard_create, and its manifest if written
+ *
+ * @param manifest path to the manifest
+ * @param base base name of the shards
+ * @param name buffer for the name of a shard
+ * @param nb_shards number of shards to be removed
+ * @param has_manifest the manifest was opened for writing
+ */
+static void remove_created(const char* manifest, const char* base, char* name, uint32_t nb_shards,
+                           int has_manifest)
+{
+    for (uint32_t i = 0; i < nb_shards; ++i) {
+        sprintf(name, "%s.%" PRIu32, base, i);
+        char* path = shard_path(manifest, name);
+        if (path != NULL) {
+            remove(path);
+        }
+        free(path);
+    }
+    if (has_manifest) {
+        remove(manifest);
+    }
+}
+
+int shard_create(const char* manifest, uint32_t nb_shards, const struct imgst_header* model)
+{
+    if (manifest == NULL || model == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (nb_shards == 0 || nb_shards > MAX_SHARDS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const char* slash = strrchr(manifest, '/');
+    const char* base = slash == NULL ? manifest : slash + 1;
+    // base name, '.' and up to two digits
+    char* name = malloc(strlen(base) + 4);
+    if (name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int err = ERR_NONE;
+    uint32_t nb_created = 0; // files created, the last one possibly in part
+    for (uint32_t i = 0; err == ERR_NONE && i < nb_shards; ++i) {
+        sprintf(name, "%s.%" PRIu32, base, i);
+        char* path = shard_path(manifest, name);
+        struct imgst_file shard;
+        memset(&shard, 0, sizeof(shard));
+        shard.header = *model;
+        err = path == NULL ? ERR_OUT_OF_MEMORY : do_create(path, &shard);
+        if (shard.file != NULL) {
+            nb_created = i + 1;
+        }
+        do_close(&shard);
+        free(path);
+    }
+
+    // the manifest is written last: it never names a shard that does not exist
+    FILE* file = err == ERR_NONE ? fopen(manifest, "w") : NULL;
+    if (err == ERR_NONE && file == NULL) {
+        err = ERR_IO;
+    }
+    if (file != NULL) {
+        fprintf(file, "%s %d\n%" PRIu32 "\n", SHARD_MAGIC, SHARD_REVISION, nb_shards);
+        for (uint32_t i = 0; i < nb_shards; ++i) {
+            fprintf(file, "%s.%" PRIu32 "\n", base, i);
+        }
+        if (fclose(file) != 0) {
+            err = ERR_IO;
+        }
+    }
+    // nothing is left of a store that could not be created in full
+    if (err != ERR_NONE) {
+        remove_created(manifest, base, name, nb_created, file != NULL);
+    }
+    free(name);
+    return err;
+}
+
+int shard_open(struct shard_set* set, const char* open_mode, enum durability durability)
+{
+    if (set == NULL || set->filenames == NULL || set->shards != NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    set->shards = calloc(set->nb_shards, sizeof(struct imgst_file));
+    if (set->shards == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (uint32_t i = 0; i < set->nb_shards; ++i) {
+        const int err = do_open_durable(set->filenames[i], open_mode, durability, &set->shards[i]);
+        if (err != ERR_NONE) {
+            while (i > 0) {
+                do_close(&set->shards[--i]);
+            }
+            free(set->shards);
+            set->shards = NULL;
+            return err;
+        }
+    }
+    return ERR_NONE;
+}
+
+void shard_free(struct shard_set* set)
+{
+    if (set == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < set->nb_shards; ++i) {
+        if (set->shards != NULL) {
+            do_close(&set->shards[i]);
+        }
+        if (set->filenames != NULL) {
+            free(set->filenames[i]);
+        }
+    }
+    free(set->shards);
+    free(set->filenames);
+    memset(set, 0, sizeof(struct shard_set));
+}
+
+uint32_t shard_of(const struct shard_set* set, const char* img_id)
+{
+    // the high bits of the hash pick the shard, without a modulo
+    return set->nb_shards <= 1 ? 0 : (uint32_t) (((uint64_t) id_hash(img_id) * set->nb_shards) >> 32);
+}
+
+int shard_open_id(const char* filename, const char* img_id, const char* open_mode, enum durability durability,
+                  struct imgst_file* imgst_file)
+{
+    if (img_id == NULL || imgst_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct shard_set set;
+    int err = shard_load(filename, &set);
+    if (err == ERR_NONE) {
+        err = do_open_durable(set.filenames[shard_of(&set, img_id)], open_mode, durability, imgst_file);
+        shard_free(&set);
+    }
+    return err;
+}
+
+uint32_t shard_version(const struct shard_set* set)
+{
+    uint32_t version = 0;
+    for (uint32_t i = 0; set->shards != NULL && i < set->nb_shards; ++i) {
+        version += set->shards[i].header.imgst_version;
+    }
+    return version;
+}
+
+/**
+ * Worker side of shard_gbcollect: compacts one shard
+ *
+ * @param arg the gc_job
+ */
+static void run_gc(void* arg)
+{
+    struct gc_job* job = arg;
+    job->error = do_gbcollect(job->filename, job->tmp_filename);
+}
+
+/**
+ * Calling thread side of shard_gbcollect: keeps the first error
+ *
+ * @param arg the gc_job
+ */
+static void complete_gc(void* arg)
+{
+    struct gc_job* job = arg;
+    if (job->error != ERR_NONE && *job->first_error == ERR_NONE) {
+        *job->first_error = job->error;
+    }
+    free(job->tmp_filename);
+    free(job);
+}
+
+int shard_gbcollect(const struct shard_set* set, const char* tmp_filename, uint32_t shard)
+{
+    if (set == NULL || set->filenames == NULL || tmp_filename == NULL || shard > set->nb_shards) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (!set->is_sharded) {
+        return do_gbcollect(set->filenames[0], tmp_filename);
+    }
+
+    const uint32_t nb_collected = shard < set->nb_shards ? 1 : set->nb_shards;
+    struct work_pool pool;
+    int err = pool_init(&pool, nb_collected < SHARD_GC_WORKERS ? nb_collected : SHARD_GC_WORKERS, 0);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    int first_error = ERR_NONE;
+    for (uint32_t i = 0; i < set->nb_shards && err == ERR_NONE; ++i) {
+        if (shard < set->nb_shards && i != shard) {
+            continue;
+        }
+        struct gc_job* job = calloc(1, sizeof(struct gc_job));
+        // temporary file, '.' and up to two digits
+        char* tmp = malloc(strlen(tmp_filename) + 4);
+        if (job == NULL || tmp == NULL) {
+            free(job);
+            free(tmp);
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        sprintf(tmp, "%s.%" PRIu32, tmp_filename, i);
+        job->filename = set->filenames[i];
+        job->tmp_filename = tmp;
+        job->first_error = &first_error;
+        err = pool_submit(&pool, run_gc, complete_gc, job);
+        if (err != ERR_NONE) {
+            free(tmp);
+            free(job);
+        }
+    }
+    pool_end(&pool);
+    return err != ERR_NONE ? err : first_error;
+}
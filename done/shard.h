@@ -0,0 +1,116 @@
+#pragma once
+
+/**
+ * @file shard.h
+ * @brief Sharded imgStores: a manifest naming several imgStore files (the shards),
+ *        each image being stored in the shard its id hashes to.
+ *
+ * The manifest is a text file:
+ *
+ *     IMGSTORE-SHARDS 1
+ *     <number of shards>
+ *     <file of shard 0>
+ *     ...
+ *
+ * where the files are relative to the directory of the manifest. Every shard
+ * is a complete imgStore, with its own header, lock domain and journal: shards
+ * are updated, and garbage collected, independently of each other.
+ * Anywhere a manifest is expected, a plain imgStore file is taken as a store
+ * of one shard.
+ */
+
+#include "imgStore.h"
+#include <stdint.h> // for uint32_t
+
+#define SHARD_MAGIC "IMGSTORE-SHARDS"
+#define SHARD_REVISION 1
+#define MAX_SHARDS 64
+#define MAX_SHARD_LINE 4096
+// shards garbage collected at the same time by shard_gbcollect
+#define SHARD_GC_WORKERS 4
+
+struct shard_set {
+    int is_sharded;             // 0 for a plain imgStore file
+    uint32_t nb_shards;
+    char** filenames;           // imgStore file of each shard
+    struct imgst_file* shards;  // opened by shard_open, NULL otherwise
+};
+
+/**
+ * Reads the manifest of a sharded store (or takes a plain imgStore file as
+ * the only shard), without opening the shards
+ *
+ * @param filename the manifest, or an imgStore file
+ * @param set the set to be filled, released with shard_free
+ * @return same error code as in error.c
+ */
+int shard_load(const char* filename, struct shard_set* set);
+
+/**
+ * Creates the shards of a new sharded store, then its manifest
+ *
+ * @param manifest the manifest, shards are named after it
+ * @param nb_shards number of shards, at most MAX_SHARDS
+ * @param model header of every shard (max_files, resolutions and format)
+ * @return same error code as in error.c
+ */
+int shard_create(const char* manifest, uint32_t nb_shards, const struct imgst_header* model);
+
+/**
+ * Opens every shard of a loaded set
+ *
+ * @param set the set, as filled by shard_load
+ * @param open_mode mode for do_open
+ * @param durability how updates are made durable (see do_open_durable)
+ * @return same error code as in error.c
+ */
+int shard_open(struct shard_set* set, const char* open_mode, enum durability durability);
+
+/**
+ * Closes the shards (if opened) and releases the set
+ *
+ * @param set the set
+ */
+void shard_free(struct shard_set* set);
+
+/**
+ * Finds the shard of an image
+ *
+ * @param set the set
+ * @param img_id id of the image
+ * @return index of the shard
+ */
+uint32_t shard_of(const struct shard_set* set, const char* img_id);
+
+/**
+ * Opens only the shard of an image
+ *
+ * @param filename the manifest, or an imgStore file
+ * @param img_id id of the image
+ * @param open_mode mode for do_open
+ * @param durability how updates are made durable (see do_open_durable)
+ * @param imgst_file the shard, to be closed with do_close
+ * @return same error code as in error.c
+ */
+int shard_open_id(const char* filename, const char* img_id, const char* open_mode, enum durability durability,
+                  struct imgst_file* imgst_file);
+
+/**
+ * Sum of the versions of the opened shards: it changes with every insertion
+ * or deletion in any of them
+ *
+ * @param set the opened set
+ * @return the version of the store
+ */
+uint32_t shard_version(const struct shard_set* set);
+
+/**
+ * Garbage collects the shards of a loaded set, SHARD_GC_WORKERS at a time:
+ * each shard is compacted (and replaced) on its own
+ *
+ * @param set the set, as filled by shard_load
+ * @param tmp_filename temporary file, suffixed by the index of the shard for a sharded store
+ * @param shard index of the only shard to be collected, or nb_shards for all of them
+ * @return same error code as in error.c (the first error met)
+ */
+int shard_gbcollect(const struct shard_set* set, const char* tmp_filename, uint32_t shard);
@@ -306,7 +306,8 @@ check_imgstore_size() {
 test_read () {
     info="$1"; shift
     printf "${magenta}Test %1d${end} (read $info):\n" $((++test))
-    local reffile="tests/data/$3"
+    local reffile="$3"
+    [ "${reffile#/}" = "$reffile" ] && reffile="tests/data/$3"
     [ -f "$reffile" ] || quit "Cannot launch test, reference file $reffile not present"
 
     set_sizes ${4:-0} ${5:-0}
@@ -464,10 +465,20 @@ test_url imgStore/list '{ "Images": [ "pic1", "pic2" ] }' || ok=0
 test_read 'first img' pic1 orig papillon.jpg    || ok=0
 test_read '2nd img'   pic2 orig coquelicots.jpg || ok=0
 
-# read with resized creation
+# read with resized creation: the resized images are shrunk on load by libvips, whose
+# output depends on its version, so the reference is made by the command line tool on
+# a scratch copy (reading the thumbnail creates the small image as well)
+scratch="$(new_tmp_file)"
+thumb_ref="$(new_tmp_file)"
+cp tests/data/test02.imgst_dynamic "$scratch"
+imgStoreMgr read "$scratch" pic1 thumb > /dev/null 2>&1
+mv pic1_thumb.jpg "$thumb_ref"
+imgStoreMgr read "$scratch" pic1 small > /dev/null 2>&1
+small_size=$($stat -c%s pic1_small.jpg)
+rm -f pic1_small.jpg "$scratch"
 size_before=$original_size
-size_after=$(($size_before + 12126))
-test_read 'thumb first time' pic1 thumb papillon_thumb.jpg $size_before $size_after || ok=0
+size_after=$(($size_before + $($stat -c%s "$thumb_ref") + $small_size))
+test_read 'thumb first time' pic1 thumb "$thumb_ref" $size_before $size_after || ok=0
 
 ## --------------------------------------------------
 ## test of delete
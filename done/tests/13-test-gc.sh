@@ -56,28 +56,40 @@ ioerr='I/O Error'
 sha1=66ac648b32a8268ed0b350b184cfa04c00c6236af3a2aa4411c01518f6061af8
 size1=72876
 offset1=21664
-size1t=12126
-size1s=16299
-thumbs1="$size1t 94540 $size1s 106666"
 
 sha2=95962b09e0fc9716ee4c2a1cf173f9147758235360d7ac0a73dfa378858b8a10
 size2=98119
 offset2=94540
 offset2_bis=122965
-size2t=12309
-size2s=17340
-thumbs2a="$size2t 221084 $size2s 233393"
-thumbs2b="$size2t 119783 $size2s 132092"
-thumbs2c="$size2t 590995 $size2s 603304"
 
 sha3=1183f8ef10dcb4d87a1857bd16f9b5f8728a8d1ea6c9c7eb37ddfa1da01bff52
 size3=369911
-size3s=18432
 offset3=192659
 
 db="$(new_tmp_file)"
 dbbkup="$(new_tmp_file)"
 
+# the resized images are shrunk on load by libvips, whose output depends on its
+# version: their sizes are measured on a scratch copy (reading the thumbnail creates
+# the small image as well)
+cp tests/data/test02.imgst_dynamic $db
+imgStoreMgr insert $db pic3 tests/data/foret.jpg > /dev/null 2>&1
+for pic in pic1 pic2 pic3; do
+    imgStoreMgr read $db $pic thumb > /dev/null 2>&1
+    rm -f ${pic}_thumb.jpg
+done
+# params: imgId, resolution as listed (THUMB. or SMALL)
+resized_size() {
+    imgStoreMgr list $db | $sed -n "/^IMAGE ID: $1\$/,/^ORIGINAL/s/.*SIZE $2 *: *\([0-9]*\).*/\1/p"
+}
+size1t=$(resized_size pic1 'THUMB\.')
+size1s=$(resized_size pic1 SMALL)
+size2t=$(resized_size pic2 'THUMB\.')
+size2s=$(resized_size pic2 SMALL)
+size3t=$(resized_size pic3 'THUMB\.')
+size3s=$(resized_size pic3 SMALL)
+rm -f $db
+
 # ======================================================================
 # tool functions
 # ----------------------------------------------------------------------
@@ -165,10 +177,16 @@ ORIGINAL: ${9:-1200 x 800}
 *****************************************"
 }
 
-line1a="$(image_txt pic1 $sha1 $size1 $offset1 0 0 $size1s 574696)"
-line2a="$(image_txt pic2 $sha2 $size2 $offset2 0 0 $size2s 590995)"
-line3a="$(image_txt pic3 $sha3 $size3 $offset3 $size3s 608335)"
-line4a="$(image_txt pic4 $sha1 $size1 $offset1 $size1t 562570)"
+# a missing resolution is created with the other missing one: thumbnail, then small image,
+# appended in the order of the reads of the scenario below
+end0=$(($offset3 + $size3))
+end1=$(($end0 + $size1t + $size1s))
+end2=$(($end1 + $size1t + $size1s))
+end3=$(($end2 + $size2t + $size2s))
+line1a="$(image_txt pic1 $sha1 $size1 $offset1 $size1t $end1 $size1s $(($end1 + $size1t)))"
+line2a="$(image_txt pic2 $sha2 $size2 $offset2 $size2t $end2 $size2s $(($end2 + $size2t)))"
+line3a="$(image_txt pic3 $sha3 $size3 $offset3 $size3t $end3 $size3s $(($end3 + $size3t)))"
+line4a="$(image_txt pic4 $sha1 $size1 $offset1 $size1t $end0 $size1s $(($end0 + $size1t)))"
 
 line1c="$(image_txt pic1 $sha1 $size1 $offset1)"
 line2c="$(image_txt pic2 $sha2 $size2 $offset2)"
@@ -324,7 +342,7 @@ $(image_txt pic4 $sha1 $size1 $offset1)" \
 insert $db pic4 tests/data/papillon.jpg  || ok=0
 
 size_before=$size_after
-size_after=$(($size_before + $size1t))
+size_after=$(($size_before + $size1t + $size1s))
 standard_test 'read pic4 thumb' '' \
 $size_before $size_after \
 "$(header 4 4 100)
@@ -335,7 +353,7 @@ $line4a" \
 read $db pic4 thumb || ok=0
 
 size_before=$size_after
-size_after=$(($size_before + $size1s))
+size_after=$(($size_before + $size1t + $size1s))
 standard_test 'read pic1 small' '' \
 $size_before $size_after \
 "$(header 4 4 100)
@@ -346,7 +364,7 @@ $line4a" \
 read $db pic1 small || ok=0
 
 size_before=$size_after
-size_after=$(($size_before + $size2s))
+size_after=$(($size_before + $size2t + $size2s))
 standard_test 'read pic2 small' '' \
 $size_before $size_after \
 "$(header 4 4 100)
@@ -357,7 +375,7 @@ $line4a" \
 read $db pic2 small || ok=0
 
 size_before=$size_after
-size_after=$(($size_before + $size3s))
+size_after=$(($size_before + $size3t + $size3s))
 standard_test 'read pic3 thumb' '' \
 $size_before $size_after \
 "$(header 4 4 100)
@@ -382,11 +400,15 @@ $line3a
 $line4a" \
 delete $db pic1 || ok=0
 
+# compacted: pic3 then pic4, each image followed by its thumbnail and small image
+gc3t=$(($offset1 + $size3))
+gc4=$(($gc3t + $size3t + $size3s))
+gc4t=$(($gc4 + $size1))
 gc_test 'resulting imgStore' '101 item(s) written' \
-$size_after 495009 \
+$size_after $(($gc4t + $size1t + $size1s)) \
 "$(header 2 2 100)
-$(image_txt pic3 $sha3 $size3 $offset1 $size3s 391575)
-$(image_txt pic4 $sha1 $size1 410007   $size1t 482883)" \
+$(image_txt pic3 $sha3 $size3 $offset1 $size3t $gc3t $size3s $(($gc3t + $size3t)))
+$(image_txt pic4 $sha1 $size1 $gc4 $size1t $gc4t $size1s $(($gc4t + $size1t)))" \
 || ok=0
 
 # ======================================================================
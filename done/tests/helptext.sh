@@ -13,15 +13,28 @@ helptxt_next="  create <imgstore_filename> [options]: create a new imgStore.
                                   maximum value is 128x128
           -small_res <X_RES> <Y_RES>: resolution for small images.
                                   default value is 256x256
-                                  maximum value is 512x512"
+                                  maximum value is 512x512
+          -growable: extend the metadata table when full, instead of failing.
+                                  up to 50000000 files
+          -shards <NB_SHARDS>: spread images over NB_SHARDS imgStore files, by id.
+                                  imgstore_filename is then their manifest, options apply to each
+                                  maximum value is 64"
 helptxt_next="$helptxt_next
   read   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:
       read an image from the imgStore and save it to a file.
       default resolution is \"original\".
-  insert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore."
+  insert <imgstore_filename> <imgID> <filename> [-eager]: insert a new image in the imgStore.
+      -eager: generate its thumbnail and small images right away.
+  insert-batch <imgstore_filename> <manifest|directory>: insert many images in one session.
+      the manifest has one \"<imgID> <filename>\" per line, images of a directory
+      are named after their file name without extension."
 helptxt_next="$helptxt_next
+  export <imgstore_filename> <output_directory> [-res <RES>]... [-ids <ids_file>]:
+      save many images of the imgStore to files in one pass.
+      default resolution is \"original\", all images unless listed in ids_file.
   delete <imgstore_filename> <imgID>: delete image imgID from imgStore."
 helptxt_next="$helptxt_next
-  gc <imgstore_filename> <tmp imgstore_filename>: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore."
+  gc <imgstore_filename> <tmp imgstore_filename> [-shard <SHARD>]: performs garbage collecting on imgStore. Requires a temporary filename for copying the imgStore.
+      shards are collected concurrently (or only SHARD), each one on its own."
 helptxt="$helptxt
 $helptxt_next"
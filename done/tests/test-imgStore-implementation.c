@@ -16,7 +16,7 @@
 #define SIZE_imgst_header   64
 #define SIZE_img_metadata  216
 
-#define SIZE_imgst_file   80
+#define SIZE_imgst_file  136
 
 #define OFFSET_imgst_header_imgst_name       0
 #define OFFSET_imgst_header_imgst_version   32
@@ -0,0 +1,121 @@
+/**
+ * @file unit-test-byte_range.c
+ * @brief Unit tests for the parsing of HTTP Range headers
+ */
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "byte_range.h"
+
+#define SIZE 1000
+
+// ======================================================================
+// tool macro
+#define check_range(SPEC, START, LENGTH) \
+    do { \
+        uint32_t start = 0; \
+        uint32_t length = 0; \
+        ck_assert_int_eq(byte_range_parse(SPEC, SIZE, &start, &length), 1); \
+        ck_assert_int_eq(start, START); \
+        ck_assert_int_eq(length, LENGTH); \
+    } while (0)
+
+#define check_whole(SPEC) \
+    do { \
+        uint32_t start = 0; \
+        uint32_t length = 0; \
+        ck_assert_int_eq(byte_range_parse(SPEC, SIZE, &start, &length), 0); \
+    } while (0)
+
+#define check_unsatisfiable(SPEC) \
+    do { \
+        uint32_t start = 0; \
+        uint32_t length = 0; \
+        ck_assert_int_eq(byte_range_parse(SPEC, SIZE, &start, &length), -1); \
+    } while (0)
+
+// ======================================================================
+START_TEST(bounded)
+{
+    check_range("bytes=0-0", 0, 1);
+    check_range("bytes=0-499", 0, 500);
+    check_range("bytes=500-999", 500, 500);
+    // the end is clamped to the content
+    check_range("bytes=900-5000", 900, 100);
+    check_range("bytes=0-18446744073709551615", 0, SIZE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(open_ended)
+{
+    check_range("bytes=0-", 0, SIZE);
+    check_range("bytes=999-", 999, 1);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(suffix)
+{
+    check_range("bytes=-1", 999, 1);
+    check_range("bytes=-100", 900, 100);
+    // more than the content: all of it
+    check_range("bytes=-5000", 0, SIZE);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(unsatisfiable)
+{
+    check_unsatisfiable("bytes=1000-");
+    check_unsatisfiable("bytes=1000-1001");
+    check_unsatisfiable("bytes=-0");
+
+    uint32_t start = 0;
+    uint32_t length = 0;
+    ck_assert_int_eq(byte_range_parse("bytes=-10", 0, &start, &length), -1);
+    ck_assert_int_eq(byte_range_parse("bytes=0-", 0, &start, &length), -1);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(ignored)
+{
+    // several ranges, other units and invalid syntax: the whole content
+    check_whole("bytes=0-1,5-6");
+    check_whole("items=0-1");
+    check_whole("bytes=");
+    check_whole("bytes=-");
+    check_whole("bytes=5");
+    check_whole("bytes=6-5");
+    check_whole("bytes=a-5");
+    check_whole("bytes=0-5x");
+    check_whole("bytes=--5");
+    check_whole("bytes= 0-5");
+    check_whole("bytes=0-18446744073709551616");
+
+    uint32_t start = 0;
+    uint32_t length = 0;
+    ck_assert_int_eq(byte_range_parse(NULL, SIZE, &start, &length), 0);
+    ck_assert_int_eq(byte_range_parse("bytes=0-1", SIZE, NULL, &length), 0);
+}
+END_TEST
+
+// ======================================================================
+Suite* byte_range_test_suite()
+{
+    Suite* s = suite_create("Tests of Range headers");
+
+    Add_Case(s, tc1, "byte range tests");
+    tcase_add_test(tc1, bounded);
+    tcase_add_test(tc1, open_ended);
+    tcase_add_test(tc1, suffix);
+    tcase_add_test(tc1, unsatisfiable);
+    tcase_add_test(tc1, ignored);
+
+    return s;
+}
+
+TEST_SUITE(byte_range_test_suite)
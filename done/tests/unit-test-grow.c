@@ -0,0 +1,184 @@
+/**
+ * @file unit-test-grow.c
+ * @brief Unit tests for the extension of growable imgStores
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "img_index.h"
+#include "journal.h"
+
+#define TEST_FILE "tmp-unit-test-grow.imgst"
+
+// ======================================================================
+// tool macro
+#define init_imgst(X) \
+    struct imgst_file X = { \
+      .header.max_files   = 2, \
+      .header.res_resized = { 64, 64, 256, 256} \
+    }
+
+// ------------------------------------------------------------
+static void create_store(uint32_t format)
+{
+    init_imgst(imgst);
+    imgst.header.unused_32 = format;
+    ck_assert_err_none(do_create(TEST_FILE, &imgst));
+    do_close(&imgst);
+}
+
+// ------------------------------------------------------------
+static void remove_store(void)
+{
+    remove(TEST_FILE);
+    remove(TEST_FILE JOURNAL_SUFFIX);
+}
+
+// ------------------------------------------------------------
+static void set_image(struct imgst_file* imgst, uint32_t index)
+{
+    struct img_metadata* meta = &imgst->metadata[index];
+    snprintf(meta->img_id, sizeof(meta->img_id), "img%" PRIu32, index);
+    memset(meta->SHA, 0, SHA256_DIGEST_LENGTH);
+    memcpy(meta->SHA, &index, sizeof(index));
+    meta->is_valid = NON_EMPTY;
+}
+
+// ------------------------------------------------------------
+// fills the slots from first to end (excluded), as insertions would
+static void fill(struct imgst_file* imgst, uint32_t first, uint32_t end)
+{
+    for (uint32_t i = first; i < end; ++i) {
+        set_image(imgst, i);
+        index_add(imgst, i);
+    }
+    imgst->header.num_files += end - first;
+    ck_assert_err_none(write_metadata_range(imgst, first, end - first));
+    ck_assert_err_none(write_header(imgst));
+}
+
+// ------------------------------------------------------------
+static void check_images(const struct imgst_file* imgst, uint32_t nb_images)
+{
+    char id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < nb_images; ++i) {
+        snprintf(id, sizeof(id), "img%" PRIu32, i);
+        uint32_t index = 0;
+        ck_assert_err_none(index_find_id(imgst, id, &index));
+        ck_assert_int_eq(index, i);
+    }
+    for (uint32_t i = nb_images; i < imgst->header.max_files; ++i) {
+        ck_assert_int_eq(imgst->metadata[i].is_valid, EMPTY);
+    }
+}
+
+// ======================================================================
+START_TEST(grow)
+{
+    create_store(IMGST_GROWABLE);
+
+    init_imgst(imgst);
+    ck_assert_err_none(do_open(TEST_FILE, "r+b", &imgst));
+    const uint32_t first_max = imgst.header.max_files;
+    fill(&imgst, 0, first_max);
+    ck_assert_int_eq(index_free_count(&imgst), 0);
+
+    // the metadata stays in place, and the new slots are free
+    const struct img_metadata* metadata = imgst.metadata;
+    ck_assert_err_none(do_grow(&imgst));
+    ck_assert_ptr_eq(imgst.metadata, metadata);
+    ck_assert_int_lt(2 * first_max - 1, imgst.header.max_files);
+    ck_assert_int_eq(index_free_count(&imgst), imgst.header.max_files - first_max);
+    check_images(&imgst, first_max);
+
+    uint32_t index = 0;
+    ck_assert_err_none(index_first_free(&imgst, &index));
+    ck_assert_int_eq(index, first_max);
+    const uint32_t second_max = imgst.header.max_files;
+    fill(&imgst, first_max, second_max);
+    ck_assert_err_none(do_grow(&imgst));
+    const uint32_t third_max = imgst.header.max_files;
+    do_close(&imgst);
+
+    // the extents are found again
+    init_imgst(reader);
+    ck_assert_err_none(do_open(TEST_FILE, "rb", &reader));
+    ck_assert_int_eq(reader.header.max_files, third_max);
+    ck_assert_int_eq(reader.header.num_files, second_max);
+    check_images(&reader, second_max);
+    // read-only
+    ck_assert_int_eq(do_grow(&reader), ERR_FULL_IMGSTORE);
+    do_close(&reader);
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(grow_journaled)
+{
+    create_store(IMGST_GROWABLE);
+
+    init_imgst(imgst);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "r+b", DURABILITY_BATCH, &imgst));
+    const uint32_t first_max = imgst.header.max_files;
+    fill(&imgst, 1, first_max - 1);
+    // updated in memory, not logged yet (as by deferred insertions), one of them at
+    // the end of the table: moved to the new extent by do_grow
+    set_image(&imgst, 0);
+    index_add(&imgst, 0);
+    set_image(&imgst, first_max - 1);
+    index_add(&imgst, first_max - 1);
+
+    ck_assert_err_none(do_grow(&imgst));
+    check_images(&imgst, first_max);
+    ck_assert_err_none(write_metadata(&imgst, 0));
+    ck_assert_err_none(write_metadata(&imgst, first_max - 1));
+    do_close(&imgst);
+
+    init_imgst(reader);
+    ck_assert_err_none(do_open(TEST_FILE, "rb", &reader));
+    check_images(&reader, first_max);
+    do_close(&reader);
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(fixed_store)
+{
+    create_store(IMGST_FIXED);
+
+    init_imgst(imgst);
+    ck_assert_err_none(do_open(TEST_FILE, "r+b", &imgst));
+    ck_assert_int_eq(do_grow(&imgst), ERR_FULL_IMGSTORE);
+    ck_assert_int_eq(imgst.header.max_files, 2);
+    do_close(&imgst);
+
+    ck_assert_invalid_arg(do_grow(NULL));
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+Suite* grow_test_suite()
+{
+    Suite* s = suite_create("Tests of do_grow");
+
+    Add_Case(s, tc1, "grow tests");
+    tcase_add_test(tc1, grow);
+    tcase_add_test(tc1, grow_journaled);
+    tcase_add_test(tc1, fixed_store);
+
+    return s;
+}
+
+TEST_SUITE(grow_test_suite)
@@ -0,0 +1,263 @@
+/**
+ * @file unit-test-img_index.c
+ * @brief Unit tests for the img_id, SHA and free slots index
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "img_index.h"
+
+#define MAX_FILES 8 // 16 buckets: bucket of a SHA is its first byte, modulo 16
+
+// ======================================================================
+// tool macro
+#define init_imgst(X, N) \
+    struct imgst_file X = { \
+      .header.max_files   = N, \
+      .header.res_resized = { 64, 64, 256, 256} \
+    }; \
+    ck_assert_ptr_nonnull((X).metadata = calloc(X.header.max_files, sizeof(struct img_metadata)))
+
+// ------------------------------------------------------------
+static void release_imgst(struct imgst_file* imgst)
+{
+    index_free(imgst);
+    free(imgst->metadata);
+    imgst->metadata = NULL;
+}
+
+// ------------------------------------------------------------
+static void insert(struct imgst_file* imgst, uint32_t index, const char* id, unsigned char sha_first, unsigned char sha_last)
+{
+    ck_assert_int_lt(index, imgst->header.max_files);
+
+    struct img_metadata* meta = &imgst->metadata[index];
+    strncpy(meta->img_id, id, MAX_IMG_ID);
+    memset(meta->SHA, 0, SHA256_DIGEST_LENGTH);
+    meta->SHA[0] = sha_first;
+    meta->SHA[SHA256_DIGEST_LENGTH - 1] = sha_last;
+    meta->is_valid = NON_EMPTY;
+    index_add(imgst, index);
+}
+
+// ------------------------------------------------------------
+static void delete(struct imgst_file* imgst, uint32_t index)
+{
+    index_remove(imgst, index);
+    imgst->metadata[index].is_valid = EMPTY;
+}
+
+// ------------------------------------------------------------
+static void check_sha_found(const struct imgst_file* imgst, uint32_t index)
+{
+    uint32_t found = MAX_FILES;
+    ck_assert_err_none(index_find_sha(imgst, imgst->metadata[index].SHA, MAX_FILES, &found));
+    ck_assert_int_eq(found, index);
+}
+
+// ======================================================================
+START_TEST(find_id)
+{
+    init_imgst(imgst, MAX_FILES);
+    ck_assert_err_none(index_attach(&imgst));
+
+    insert(&imgst, 2, "first", 1, 1);
+    insert(&imgst, 5, "second", 2, 2);
+
+    uint32_t index = 0;
+    ck_assert_err_none(index_find_id(&imgst, "first", &index));
+    ck_assert_int_eq(index, 2);
+    ck_assert_err_none(index_find_id(&imgst, "second", &index));
+    ck_assert_int_eq(index, 5);
+    ck_assert_int_eq(index_find_id(&imgst, "third", &index), ERR_FILE_NOT_FOUND);
+
+    delete(&imgst, 2);
+    ck_assert_int_eq(index_find_id(&imgst, "first", &index), ERR_FILE_NOT_FOUND);
+    ck_assert_err_none(index_find_id(&imgst, "second", &index));
+    ck_assert_int_eq(index, 5);
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(find_sha)
+{
+    init_imgst(imgst, MAX_FILES);
+    ck_assert_err_none(index_attach(&imgst));
+
+    // same content twice
+    insert(&imgst, 1, "a", 3, 7);
+    insert(&imgst, 4, "b", 3, 7);
+
+    uint32_t index = 0;
+    ck_assert_err_none(index_find_sha(&imgst, imgst.metadata[1].SHA, 1, &index));
+    ck_assert_int_eq(index, 4);
+    ck_assert_err_none(index_find_sha(&imgst, imgst.metadata[1].SHA, 4, &index));
+    ck_assert_int_eq(index, 1);
+
+    delete(&imgst, 4);
+    ck_assert_int_eq(index_find_sha(&imgst, imgst.metadata[1].SHA, 1, &index), ERR_FILE_NOT_FOUND);
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(backward_shift_deletion)
+{
+    init_imgst(imgst, MAX_FILES);
+    ck_assert_err_none(index_attach(&imgst));
+
+    // a cluster wrapping around the end of the table: three entries of home bucket 15,
+    // then one of home bucket 0 and one of home bucket 1, pushed after them
+    insert(&imgst, 0, "a", 15, 0);
+    insert(&imgst, 1, "b", 15, 1);
+    insert(&imgst, 2, "c", 15, 2);
+    insert(&imgst, 3, "d", 16, 3);
+    insert(&imgst, 4, "e", 17, 4);
+
+    // removing the head of the cluster shifts the others back
+    delete(&imgst, 0);
+    for (uint32_t i = 1; i <= 4; ++i) {
+        check_sha_found(&imgst, i);
+    }
+    ck_assert_int_eq(imgst.lookup->sha_table[15], 2);
+
+    // the entries after a hole move back as long as they stay at or after their home bucket
+    delete(&imgst, 2);
+    for (uint32_t i = 1; i <= 4; ++i) {
+        if (i != 2) {
+            check_sha_found(&imgst, i);
+        }
+    }
+    ck_assert_int_eq(imgst.lookup->sha_table[0], 4);
+    ck_assert_int_eq(imgst.lookup->sha_table[1], 5);
+    ck_assert_int_eq(imgst.lookup->sha_table[2], 0);
+
+    // the ids are removed as well
+    uint32_t index = 0;
+    ck_assert_int_eq(index_find_id(&imgst, "a", &index), ERR_FILE_NOT_FOUND);
+    ck_assert_int_eq(index_find_id(&imgst, "c", &index), ERR_FILE_NOT_FOUND);
+    ck_assert_err_none(index_find_id(&imgst, "e", &index));
+    ck_assert_int_eq(index, 4);
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(many_ids)
+{
+    // a full table: long probing sequences, and deletions in all of them
+    init_imgst(imgst, 200);
+    ck_assert_err_none(index_attach(&imgst));
+
+    char id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < imgst.header.max_files; ++i) {
+        snprintf(id, sizeof(id), "img%" PRIu32, i);
+        insert(&imgst, i, id, (unsigned char) i, (unsigned char) (i >> 8));
+    }
+    for (uint32_t i = 0; i < imgst.header.max_files; i += 3) {
+        delete(&imgst, i);
+    }
+
+    for (uint32_t i = 0; i < imgst.header.max_files; ++i) {
+        snprintf(id, sizeof(id), "img%" PRIu32, i);
+        uint32_t index = 0;
+        if (i % 3 == 0) {
+            ck_assert_int_eq(index_find_id(&imgst, id, &index), ERR_FILE_NOT_FOUND);
+        } else {
+            ck_assert_err_none(index_find_id(&imgst, id, &index));
+            ck_assert_int_eq(index, i);
+        }
+    }
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(free_bitmap)
+{
+    // more than one word of bitmap
+    init_imgst(imgst, 130);
+    imgst.metadata[0].is_valid = NON_EMPTY;
+    imgst.metadata[1].is_valid = NON_EMPTY;
+    ck_assert_err_none(index_attach(&imgst));
+    ck_assert_int_eq(index_free_count(&imgst), 128);
+
+    uint32_t index = 0;
+    ck_assert_err_none(index_first_free(&imgst, &index));
+    ck_assert_int_eq(index, 2);
+
+    // the first two words filled up
+    for (uint32_t i = 2; i < 128; ++i) {
+        insert(&imgst, i, "", (unsigned char) i, 0);
+    }
+    ck_assert_int_eq(index_free_count(&imgst), 2);
+    ck_assert_err_none(index_first_free(&imgst, &index));
+    ck_assert_int_eq(index, 128);
+
+    // a slot freed before the hint is found again
+    delete(&imgst, 70);
+    ck_assert_int_eq(index_free_count(&imgst), 3);
+    ck_assert_err_none(index_first_free(&imgst, &index));
+    ck_assert_int_eq(index, 70);
+
+    insert(&imgst, 70, "", 70, 0);
+    insert(&imgst, 128, "", 128, 0);
+    insert(&imgst, 129, "", 129, 0);
+    ck_assert_int_eq(index_free_count(&imgst), 0);
+    ck_assert_int_eq(index_first_free(&imgst, &index), ERR_FULL_IMGSTORE);
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(without_index)
+{
+    // filled by hand: linear scans of the metadata
+    init_imgst(imgst, MAX_FILES);
+    strcpy(imgst.metadata[3].img_id, "here");
+    imgst.metadata[3].is_valid = NON_EMPTY;
+    imgst.metadata[0].is_valid = NON_EMPTY;
+
+    uint32_t index = 0;
+    ck_assert_err_none(index_find_id(&imgst, "here", &index));
+    ck_assert_int_eq(index, 3);
+    ck_assert_err_none(index_first_free(&imgst, &index));
+    ck_assert_int_eq(index, 1);
+    ck_assert_int_eq(index_free_count(&imgst), MAX_FILES - 2);
+
+    ck_assert_invalid_arg(index_attach(NULL));
+    ck_assert_invalid_arg(index_find_id(&imgst, NULL, &index));
+
+    release_imgst(&imgst);
+}
+END_TEST
+
+// ======================================================================
+Suite* img_index_test_suite()
+{
+    Suite* s = suite_create("Tests of the img_id, SHA and free slots index");
+
+    Add_Case(s, tc1, "index tests");
+    tcase_add_test(tc1, find_id);
+    tcase_add_test(tc1, find_sha);
+    tcase_add_test(tc1, backward_shift_deletion);
+    tcase_add_test(tc1, many_ids);
+    tcase_add_test(tc1, free_bitmap);
+    tcase_add_test(tc1, without_index);
+
+    return s;
+}
+
+TEST_SUITE(img_index_test_suite)
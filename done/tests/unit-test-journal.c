@@ -0,0 +1,269 @@
+/**
+ * @file unit-test-journal.c
+ * @brief Unit tests for the write-ahead journal: logging, commit and replay
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "journal.h"
+
+#define TEST_FILE "tmp-unit-test-journal.imgst"
+#define TEST_JOURNAL TEST_FILE JOURNAL_SUFFIX
+#define MAX_FILES 10
+
+// ======================================================================
+// tool macro
+#define init_imgst(X) \
+    struct imgst_file X = { \
+      .header.max_files   = MAX_FILES, \
+      .header.res_resized = { 64, 64, 256, 256} \
+    }
+
+// ------------------------------------------------------------
+static void create_store(void)
+{
+    init_imgst(imgst);
+    ck_assert_err_none(do_create(TEST_FILE, &imgst));
+    do_close(&imgst);
+}
+
+// ------------------------------------------------------------
+static void remove_store(void)
+{
+    remove(TEST_FILE);
+    remove(TEST_JOURNAL);
+}
+
+// ------------------------------------------------------------
+static size_t read_whole(const char* filename, char** content)
+{
+    FILE* file = fopen(filename, "rb");
+    ck_assert_ptr_nonnull(file);
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    ck_assert_ptr_nonnull(*content = malloc((size_t) size + 1));
+    ck_assert_int_eq(fread(*content, 1, (size_t) size, file), size);
+    fclose(file);
+    return (size_t) size;
+}
+
+// ------------------------------------------------------------
+static void write_whole(const char* filename, const char* content, size_t size)
+{
+    FILE* file = fopen(filename, "wb");
+    ck_assert_ptr_nonnull(file);
+    ck_assert_int_eq(fwrite(content, 1, size, file), size);
+    fclose(file);
+}
+
+// ------------------------------------------------------------
+// the metadata at index, as found in the file (not in any mapping)
+static void read_on_disk(uint32_t index, struct img_metadata* meta)
+{
+    const int fd = open(TEST_FILE, O_RDONLY);
+    ck_assert_int_ne(fd, -1);
+    const off_t offset = (off_t) (sizeof(struct imgst_header) + index * sizeof(struct img_metadata));
+    ck_assert_int_eq(pread(fd, meta, sizeof(*meta), offset), sizeof(*meta));
+    close(fd);
+}
+
+// ------------------------------------------------------------
+static void set_image(struct imgst_file* imgst, uint32_t index, const char* id, uint64_t offset)
+{
+    struct img_metadata* meta = &imgst->metadata[index];
+    strncpy(meta->img_id, id, MAX_IMG_ID);
+    meta->offset[RES_ORIG] = offset;
+    meta->size[RES_ORIG] = 10;
+    meta->is_valid = NON_EMPTY;
+    imgst->header.num_files += 1;
+}
+
+// ======================================================================
+START_TEST(committed_before_written)
+{
+    create_store();
+    struct img_metadata on_disk;
+
+    init_imgst(imgst);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "r+b", DURABILITY_BATCH, &imgst));
+    set_image(&imgst, 2, "kept", sizeof(struct imgst_header));
+    ck_assert_err_none(write_metadata(&imgst, 2));
+    ck_assert_err_none(write_header(&imgst));
+
+    // logged only
+    read_on_disk(2, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, EMPTY);
+    ck_assert_int_eq(imgst.metadata[2].is_valid, NON_EMPTY);
+
+    // written once committed
+    ck_assert_err_none(journal_commit(&imgst));
+    read_on_disk(2, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, NON_EMPTY);
+    ck_assert_str_eq(on_disk.img_id, "kept");
+
+    // committed by do_close, and the journal removed
+    set_image(&imgst, 3, "closed", sizeof(struct imgst_header));
+    ck_assert_err_none(write_metadata(&imgst, 3));
+    do_close(&imgst);
+    read_on_disk(3, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, NON_EMPTY);
+    ck_assert_int_eq(access(TEST_JOURNAL, F_OK), -1);
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(replay)
+{
+    create_store();
+    char* empty_store = NULL;
+    const size_t store_size = read_whole(TEST_FILE, &empty_store);
+
+    init_imgst(imgst);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "r+b", DURABILITY_BATCH, &imgst));
+    set_image(&imgst, 2, "kept", sizeof(struct imgst_header));
+    // content past the end of the file
+    set_image(&imgst, 3, "no content", store_size + 1000);
+    ck_assert_err_none(write_metadata_range(&imgst, 2, 2));
+    ck_assert_err_none(write_header(&imgst));
+    ck_assert_err_none(journal_commit(&imgst));
+    // not committed
+    set_image(&imgst, 5, "lost", sizeof(struct imgst_header));
+    ck_assert_err_none(write_metadata(&imgst, 5));
+
+    char* journal = NULL;
+    const size_t journal_size = read_whole(TEST_JOURNAL, &journal);
+    do_close(&imgst);
+
+    // as if the process died right after the commit, before writing anything in place,
+    // in the middle of appending a record
+    write_whole(TEST_FILE, empty_store, store_size);
+    memcpy(journal + journal_size - 3, "\xff\xff\xff", 3);
+    write_whole(TEST_JOURNAL, journal, journal_size);
+
+    // replayed in memory only, the journal is kept
+    init_imgst(reader);
+    ck_assert_err_none(do_open(TEST_FILE, "rb", &reader));
+    ck_assert_int_eq(reader.metadata[2].is_valid, NON_EMPTY);
+    ck_assert_str_eq(reader.metadata[2].img_id, "kept");
+    ck_assert_int_eq(reader.metadata[3].is_valid, EMPTY);
+    ck_assert_int_eq(reader.metadata[5].is_valid, EMPTY);
+    ck_assert_int_eq(reader.header.num_files, 1);
+    do_close(&reader);
+    ck_assert_int_eq(access(TEST_JOURNAL, F_OK), 0);
+
+    // replayed in place by a writer, the journal is removed
+    init_imgst(writer);
+    ck_assert_err_none(do_open(TEST_FILE, "r+b", &writer));
+    do_close(&writer);
+    ck_assert_int_eq(access(TEST_JOURNAL, F_OK), -1);
+    struct img_metadata on_disk;
+    read_on_disk(2, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, NON_EMPTY);
+    read_on_disk(3, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, EMPTY);
+
+    free(journal);
+    free(empty_store);
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_modes)
+{
+    create_store();
+    struct img_metadata on_disk;
+
+    // every record committed at once
+    init_imgst(always);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "r+b", DURABILITY_ALWAYS, &always));
+    ck_assert_int_eq(access(TEST_JOURNAL, F_OK), 0);
+    set_image(&always, 1, "always", sizeof(struct imgst_header));
+    ck_assert_err_none(write_metadata(&always, 1));
+    read_on_disk(1, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, NON_EMPTY);
+    do_close(&always);
+
+    // no journal, written in place at once
+    init_imgst(none);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "r+b", DURABILITY_NONE, &none));
+    ck_assert_ptr_null(none.journal);
+    ck_assert_int_eq(access(TEST_JOURNAL, F_OK), -1);
+    set_image(&none, 4, "none", sizeof(struct imgst_header));
+    ck_assert_err_none(write_metadata(&none, 4));
+    read_on_disk(4, &on_disk);
+    ck_assert_int_eq(on_disk.is_valid, NON_EMPTY);
+    do_close(&none);
+
+    // never journaled when read-only
+    init_imgst(reader);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "rb", DURABILITY_ALWAYS, &reader));
+    ck_assert_ptr_null(reader.journal);
+    do_close(&reader);
+
+    init_imgst(invalid);
+    ck_assert_invalid_arg(do_open_durable(TEST_FILE, "r+b", (enum durability) 3, &invalid));
+
+    ck_assert_int_eq(durability_atoi("batch"), DURABILITY_BATCH);
+    ck_assert_int_eq(durability_atoi("sometimes"), -1);
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+START_TEST(single_writer)
+{
+    create_store();
+
+    init_imgst(writer);
+    ck_assert_err_none(do_open_durable(TEST_FILE, "r+b", DURABILITY_BATCH, &writer));
+    set_image(&writer, 1, "pending", sizeof(struct imgst_header));
+    ck_assert_err_none(write_metadata(&writer, 1));
+
+    // the journal of the live writer is neither replayed nor truncated by another one
+    init_imgst(other);
+    ck_assert_int_eq(do_open_durable(TEST_FILE, "r+b", DURABILITY_NONE, &other), ERR_IO);
+    ck_assert_int_eq(do_open(TEST_FILE, "r+b", &other), ERR_IO);
+    ck_assert_int_eq(access(TEST_JOURNAL, F_OK), 0);
+
+    // readers are not locked out
+    init_imgst(reader);
+    ck_assert_err_none(do_open(TEST_FILE, "rb", &reader));
+    do_close(&reader);
+
+    do_close(&writer);
+    ck_assert_err_none(do_open(TEST_FILE, "r+b", &other));
+    ck_assert_int_eq(other.metadata[1].is_valid, NON_EMPTY);
+    do_close(&other);
+
+    remove_store();
+}
+END_TEST
+
+// ======================================================================
+Suite* journal_test_suite()
+{
+    Suite* s = suite_create("Tests of the journal");
+
+    Add_Case(s, tc1, "journal tests");
+    tcase_add_test(tc1, committed_before_written);
+    tcase_add_test(tc1, replay);
+    tcase_add_test(tc1, durability_modes);
+    tcase_add_test(tc1, single_writer);
+
+    return s;
+}
+
+TEST_SUITE(journal_test_suite)
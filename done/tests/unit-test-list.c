@@ -0,0 +1,162 @@
+/**
+ * @file unit-test-list.c
+ * @brief Unit tests for the JSON listing by pieces, its cursor and limit
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+
+#define MAX_FILES 10
+#define MAX_LISTING 4096
+
+// ======================================================================
+// tool macro
+#define init_imgst(X) \
+    struct imgst_file X = { \
+      .header.max_files   = MAX_FILES, \
+      .header.res_resized = { 64, 64, 256, 256} \
+    }; \
+    ck_assert_ptr_nonnull((X).metadata = calloc(X.header.max_files, sizeof(struct img_metadata)))
+
+// ------------------------------------------------------------
+static void insert(struct imgst_file* imgst, uint32_t index, const char* id)
+{
+    strncpy(imgst->metadata[index].img_id, id, MAX_IMG_ID);
+    imgst->metadata[index].is_valid = NON_EMPTY;
+}
+
+// ------------------------------------------------------------
+// lists the given files by pieces as small as allowed, into listing
+static void list(const struct imgst_file* files, uint32_t nb_files, uint64_t cursor, uint32_t limit, char* listing)
+{
+    struct list_stream stream;
+    do_list_json_start(&stream, cursor, limit);
+
+    char piece[MAX_LIST_PIECE_STRLEN];
+    size_t length = 0;
+    size_t written = 0;
+    while ((written = do_list_json_next_all(files, nb_files, &stream, piece, sizeof(piece))) > 0) {
+        ck_assert_int_lt(length + written, MAX_LISTING);
+        memcpy(listing + length, piece, written);
+        length += written;
+    }
+    listing[length] = '\0';
+}
+
+// ======================================================================
+START_TEST(whole_listing)
+{
+    init_imgst(imgst);
+    char listing[MAX_LISTING];
+
+    list(&imgst, 1, 0, 0, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ ] }");
+
+    insert(&imgst, 1, "one");
+    insert(&imgst, 4, "two\"quoted\"");
+    insert(&imgst, 9, "three");
+    list(&imgst, 1, 0, 0, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"one\", \"two\\\"quoted\\\"\", \"three\" ] }");
+
+    free(imgst.metadata);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(cursor_and_limit)
+{
+    init_imgst(imgst);
+    insert(&imgst, 1, "one");
+    insert(&imgst, 4, "two");
+    insert(&imgst, 9, "three");
+    char listing[MAX_LISTING];
+
+    // the next page starts after the last image listed
+    list(&imgst, 1, 0, 2, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"one\", \"two\" ], \"next\": 5 }");
+    list(&imgst, 1, 5, 2, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"three\" ] }");
+
+    // the last image of the table ends the listing: no next page
+    list(&imgst, 1, 2, 2, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"two\", \"three\" ] }");
+
+    // past the end of the table, even beyond 32 bits
+    list(&imgst, 1, MAX_FILES, 2, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ ] }");
+    list(&imgst, 1, (uint64_t) UINT32_MAX + 2, 0, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ ] }");
+
+    free(imgst.metadata);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(several_files)
+{
+    // positions alternate between the files
+    init_imgst(first);
+    init_imgst(second);
+    struct imgst_file files[2];
+    insert(&first, 0, "a0");
+    insert(&first, 3, "a3");
+    insert(&second, 0, "b0");
+    insert(&second, 9, "b9");
+    files[0] = first;
+    files[1] = second;
+    char listing[MAX_LISTING];
+
+    list(files, 2, 0, 0, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"a0\", \"b0\", \"a3\", \"b9\" ] }");
+
+    // position 1 is slot 0 of the second file, position 6 slot 3 of the first one
+    list(files, 2, 0, 2, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"a0\", \"b0\" ], \"next\": 2 }");
+    list(files, 2, 2, 1, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"a3\" ], \"next\": 7 }");
+    list(files, 2, 7, 0, listing);
+    ck_assert_str_eq(listing, "{ \"Images\": [ \"b9\" ] }");
+
+    free(first.metadata);
+    free(second.metadata);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(error_cases)
+{
+    init_imgst(imgst);
+    struct list_stream stream;
+    char piece[MAX_LIST_PIECE_STRLEN];
+    do_list_json_start(&stream, 0, 0);
+
+    ck_assert_int_eq(do_list_json_next(NULL, &stream, piece, sizeof(piece)), 0);
+    ck_assert_int_eq(do_list_json_next(&imgst, NULL, piece, sizeof(piece)), 0);
+    ck_assert_int_eq(do_list_json_next(&imgst, &stream, piece, sizeof(piece) - 1), 0);
+    ck_assert_int_eq(do_list_json_next_all(&imgst, 0, &stream, piece, sizeof(piece)), 0);
+
+    free(imgst.metadata);
+}
+END_TEST
+
+// ======================================================================
+Suite* list_test_suite()
+{
+    Suite* s = suite_create("Tests of the JSON listing");
+
+    Add_Case(s, tc1, "listing tests");
+    tcase_add_test(tc1, whole_listing);
+    tcase_add_test(tc1, cursor_and_limit);
+    tcase_add_test(tc1, several_files);
+    tcase_add_test(tc1, error_cases);
+
+    return s;
+}
+
+TEST_SUITE(list_test_suite)
@@ -0,0 +1,191 @@
+/**
+ * @file unit-test-shard.c
+ * @brief Unit tests for sharded imgStores: manifest, creation and placement
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <inttypes.h>
+
+#include "tests.h"
+#include "imgStore.h"
+#include "shard.h"
+
+#define TEST_DIR "tmp-unit-test-shard"
+#define TEST_MANIFEST TEST_DIR "/store"
+#define NB_SHARDS 3
+
+// ------------------------------------------------------------
+static struct imgst_header model(void)
+{
+    struct imgst_header header;
+    memset(&header, 0, sizeof(header));
+    header.max_files = 10;
+    header.res_resized[0] = header.res_resized[1] = 64;
+    header.res_resized[2] = header.res_resized[3] = 256;
+    return header;
+}
+
+// ------------------------------------------------------------
+static void write_manifest(const char* content)
+{
+    FILE* file = fopen(TEST_MANIFEST, "w");
+    ck_assert_ptr_nonnull(file);
+    fputs(content, file);
+    fclose(file);
+}
+
+// ------------------------------------------------------------
+static void remove_store(uint32_t nb_shards)
+{
+    char shard[sizeof(TEST_MANIFEST) + 11]; // '.' and up to ten digits
+    for (uint32_t i = 0; i < nb_shards; ++i) {
+        snprintf(shard, sizeof(shard), TEST_MANIFEST ".%" PRIu32, i);
+        remove(shard);
+    }
+    remove(TEST_MANIFEST);
+    rmdir(TEST_DIR);
+}
+
+// ======================================================================
+START_TEST(create_and_load)
+{
+    remove_store(NB_SHARDS);
+    ck_assert_int_eq(mkdir(TEST_DIR, 0755), 0);
+    const struct imgst_header header = model();
+    ck_assert_err_none(shard_create(TEST_MANIFEST, NB_SHARDS, &header));
+
+    struct shard_set set;
+    ck_assert_err_none(shard_load(TEST_MANIFEST, &set));
+    ck_assert(set.is_sharded);
+    ck_assert_int_eq(set.nb_shards, NB_SHARDS);
+    ck_assert_ptr_null(set.shards);
+    // relative to the directory of the manifest
+    ck_assert_str_eq(set.filenames[0], TEST_MANIFEST ".0");
+    ck_assert_str_eq(set.filenames[2], TEST_MANIFEST ".2");
+
+    ck_assert_err_none(shard_open(&set, "rb", DURABILITY_NONE));
+    for (uint32_t i = 0; i < NB_SHARDS; ++i) {
+        ck_assert_int_eq(set.shards[i].header.max_files, 10);
+        ck_assert_int_eq(set.shards[i].header.num_files, 0);
+    }
+    ck_assert_int_eq(shard_version(&set), 0);
+    shard_free(&set);
+    ck_assert_ptr_null(set.filenames);
+
+    // a shard is a plain imgStore, taken as a store of one shard
+    ck_assert_err_none(shard_load(TEST_MANIFEST ".1", &set));
+    ck_assert(!set.is_sharded);
+    ck_assert_int_eq(set.nb_shards, 1);
+    ck_assert_str_eq(set.filenames[0], TEST_MANIFEST ".1");
+    shard_free(&set);
+
+    remove_store(NB_SHARDS);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(placement)
+{
+    const char* manifest = SHARD_MAGIC " 1\n3\na\nb\nc\n";
+    remove_store(0);
+    ck_assert_int_eq(mkdir(TEST_DIR, 0755), 0);
+    write_manifest(manifest);
+
+    struct shard_set set;
+    ck_assert_err_none(shard_load(TEST_MANIFEST, &set));
+    uint32_t used[NB_SHARDS] = { 0 };
+    char id[MAX_IMG_ID + 1];
+    for (uint32_t i = 0; i < 300; ++i) {
+        snprintf(id, sizeof(id), "img%" PRIu32, i);
+        const uint32_t shard = shard_of(&set, id);
+        ck_assert_int_lt(shard, NB_SHARDS);
+        // the same for every run and every process
+        ck_assert_int_eq(shard_of(&set, id), shard);
+        used[shard] += 1;
+    }
+    for (uint32_t i = 0; i < NB_SHARDS; ++i) {
+        ck_assert_int_lt(50, used[i]);
+    }
+    // "a" hashes to 0x60c5f143: 0x60c5f143 * 3 >> 32
+    ck_assert_int_eq(shard_of(&set, "a"), 1);
+    shard_free(&set);
+
+    // everything in the only shard of a plain imgStore
+    ck_assert_err_none(shard_load(TEST_MANIFEST "-plain", &set));
+    ck_assert_int_eq(shard_of(&set, "a"), 0);
+    shard_free(&set);
+
+    remove_store(0);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(invalid_manifests)
+{
+    remove_store(0);
+    ck_assert_int_eq(mkdir(TEST_DIR, 0755), 0);
+    struct shard_set set;
+
+    write_manifest(SHARD_MAGIC " 2\n1\na\n");
+    ck_assert_invalid_arg(shard_load(TEST_MANIFEST, &set));
+    write_manifest(SHARD_MAGIC " 1\n0\n");
+    ck_assert_invalid_arg(shard_load(TEST_MANIFEST, &set));
+    write_manifest(SHARD_MAGIC " 1\n65\n");
+    ck_assert_invalid_arg(shard_load(TEST_MANIFEST, &set));
+    // fewer shards than announced
+    write_manifest(SHARD_MAGIC " 1\n3\na\nb\n");
+    ck_assert_invalid_arg(shard_load(TEST_MANIFEST, &set));
+    write_manifest(SHARD_MAGIC " 1\n2\na\n\n");
+    ck_assert_int_eq(shard_load(TEST_MANIFEST, &set), ERR_INVALID_FILENAME);
+
+    const struct imgst_header header = model();
+    ck_assert_invalid_arg(shard_create(TEST_MANIFEST, 0, &header));
+    ck_assert_invalid_arg(shard_create(TEST_MANIFEST, MAX_SHARDS + 1, &header));
+    ck_assert_invalid_arg(shard_create(NULL, 1, &header));
+    ck_assert_invalid_arg(shard_load(NULL, &set));
+
+    remove_store(0);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(failed_creation)
+{
+    remove_store(NB_SHARDS);
+    ck_assert_int_eq(mkdir(TEST_DIR, 0755), 0);
+    // the second shard cannot be created
+    ck_assert_int_eq(mkdir(TEST_MANIFEST ".1", 0755), 0);
+
+    const struct imgst_header header = model();
+    ck_assert_int_eq(shard_create(TEST_MANIFEST, NB_SHARDS, &header), ERR_IO);
+    ck_assert_int_eq(access(TEST_MANIFEST ".0", F_OK), -1);
+    ck_assert_int_eq(access(TEST_MANIFEST ".2", F_OK), -1);
+    ck_assert_int_eq(access(TEST_MANIFEST, F_OK), -1);
+    // only what shard_create created is removed
+    ck_assert_int_eq(access(TEST_MANIFEST ".1", F_OK), 0);
+
+    rmdir(TEST_MANIFEST ".1");
+    remove_store(NB_SHARDS);
+}
+END_TEST
+
+// ======================================================================
+Suite* shard_test_suite()
+{
+    Suite* s = suite_create("Tests of sharded imgStores");
+
+    Add_Case(s, tc1, "shard tests");
+    tcase_add_test(tc1, create_and_load);
+    tcase_add_test(tc1, placement);
+    tcase_add_test(tc1, invalid_manifests);
+    tcase_add_test(tc1, failed_creation);
+
+    return s;
+}
+
+TEST_SUITE(shard_test_suite)
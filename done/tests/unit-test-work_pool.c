@@ -0,0 +1,164 @@
+/**
+ * @file unit-test-work_pool.c
+ * @brief Unit tests for the pool of worker threads
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "tests.h"
+#include "work_pool.h"
+
+#define NB_JOBS 100
+
+/**
+ * Job of the tests: where it was run, and whether it was completed
+ */
+struct job {
+    pthread_t runner;
+    pthread_t completer;
+    int is_run;
+    int is_completed;
+    pthread_mutex_t* gate;   // held by the test to keep the job running, if not NULL
+};
+
+// ------------------------------------------------------------
+static void run_job(void* arg)
+{
+    struct job* job = arg;
+    if (job->gate != NULL) {
+        pthread_mutex_lock(job->gate);
+        pthread_mutex_unlock(job->gate);
+    }
+    job->runner = pthread_self();
+    job->is_run = 1;
+}
+
+// ------------------------------------------------------------
+static void complete_job(void* arg)
+{
+    struct job* job = arg;
+    // the job is run before being completed
+    job->is_completed = job->is_run;
+    job->completer = pthread_self();
+}
+
+// ======================================================================
+START_TEST(run_and_complete)
+{
+    struct work_pool pool;
+    ck_assert_err_none(pool_init(&pool, 4, 0));
+
+    struct job jobs[NB_JOBS] = { 0 };
+    for (size_t i = 0; i < NB_JOBS; ++i) {
+        ck_assert_err_none(pool_submit(&pool, run_job, complete_job, &jobs[i]));
+    }
+    pool_drain(&pool);
+
+    for (size_t i = 0; i < NB_JOBS; ++i) {
+        ck_assert(jobs[i].is_completed);
+        // run by a worker, completed by the calling thread
+        ck_assert(!pthread_equal(jobs[i].runner, pthread_self()));
+        ck_assert(pthread_equal(jobs[i].completer, pthread_self()));
+    }
+    ck_assert_int_eq(pool_complete(&pool), 0);
+
+    pool_end(&pool);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(max_pending)
+{
+    struct work_pool pool;
+    ck_assert_err_none(pool_init(&pool, 1, 2));
+
+    pthread_mutex_t gate;
+    pthread_mutex_init(&gate, NULL);
+    pthread_mutex_lock(&gate);
+
+    struct job jobs[3] = { { .gate = &gate }, { .gate = &gate }, { .gate = &gate } };
+    ck_assert(pool_has_room(&pool));
+    ck_assert_err_none(pool_submit(&pool, run_job, complete_job, &jobs[0]));
+    ck_assert(pool_has_room(&pool));
+    ck_assert_err_none(pool_submit(&pool, run_job, complete_job, &jobs[1]));
+    // both jobs are held in run_job, or queued
+    ck_assert(!pool_has_room(&pool));
+
+    pthread_mutex_unlock(&gate);
+    // waits for one of them to finish, and completes it
+    ck_assert_err_none(pool_submit(&pool, run_job, complete_job, &jobs[2]));
+    ck_assert(jobs[0].is_completed);
+
+    pool_end(&pool);
+    for (size_t i = 0; i < 3; ++i) {
+        ck_assert(jobs[i].is_completed);
+    }
+    pthread_mutex_destroy(&gate);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(notification)
+{
+    int fds[2];
+    ck_assert_int_eq(pipe(fds), 0);
+
+    struct work_pool pool;
+    ck_assert_err_none(pool_init(&pool, 2, 0));
+    pool.notify_fd = fds[1];
+
+    struct job jobs[2] = { 0 };
+    ck_assert_err_none(pool_submit(&pool, run_job, NULL, &jobs[0]));
+    ck_assert_err_none(pool_submit(&pool, run_job, NULL, &jobs[1]));
+
+    // one byte per finished job
+    char wakeup[2];
+    size_t nb_read = 0;
+    while (nb_read < sizeof(wakeup)) {
+        const ssize_t n = read(fds[0], wakeup + nb_read, sizeof(wakeup) - nb_read);
+        ck_assert_int_lt(0, n);
+        nb_read += (size_t) n;
+    }
+    ck_assert_int_eq(pool_complete(&pool), 2);
+    ck_assert(jobs[0].is_run && jobs[1].is_run);
+    ck_assert(!jobs[0].is_completed && !jobs[1].is_completed);
+
+    pool_end(&pool);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+// ======================================================================
+START_TEST(error_cases)
+{
+    struct work_pool pool;
+    ck_assert_invalid_arg(pool_init(NULL, 1, 0));
+    ck_assert_invalid_arg(pool_init(&pool, 0, 0));
+
+    ck_assert_err_none(pool_init(&pool, 1, 0));
+    ck_assert_invalid_arg(pool_submit(&pool, NULL, complete_job, NULL));
+    ck_assert_invalid_arg(pool_submit(NULL, run_job, complete_job, NULL));
+    pool_end(&pool);
+}
+END_TEST
+
+// ======================================================================
+Suite* work_pool_test_suite()
+{
+    Suite* s = suite_create("Tests of the work pool");
+
+    Add_Case(s, tc1, "work pool tests");
+    tcase_add_test(tc1, run_and_complete);
+    tcase_add_test(tc1, max_pending);
+    tcase_add_test(tc1, notification);
+    tcase_add_test(tc1, error_cases);
+
+    return s;
+}
+
+TEST_SUITE(work_pool_test_suite)
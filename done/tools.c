@@ -6,11 +6,17 @@
  */
 
 #include "imgStore.h"
+#include "img_index.h"
+#include "journal.h"
 
 #include <stdint.h> // for uint8_t
 #include <stdio.h> // for sprintf
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <stdlib.h> // for calloc
+#include <string.h> // for strchr, memcpy
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include <unistd.h> // for pread
 
 
 /********************************************************************//**
@@ -67,39 +73,295 @@ print_metadata (const struct img_metadata* metadata)
 }
 
 
+/**
+ * Tells whether a mode for fopen() allows writing
+ *
+ * @param open_mode the mode
+ * @return 1 if writable, 0 otherwise
+ */
+static int is_writable_mode(const char* open_mode)
+{
+    return strchr(open_mode, '+') != NULL || strchr(open_mode, 'w') != NULL || strchr(open_mode, 'a') != NULL;
+}
+
+/**
+ * Reads the chain of extents of a growable imgStore file, and checks that they
+ * cover its metadata table from the beginning of the file on
+ *
+ * @param imgst_file structure whose file and header are already set
+ * @param file_size size of the file
+ * @param extents output descriptors, the newest first
+ * @param offsets output offsets of the extents in the file
+ * @param nb_extents output number of extents
+ * @return same error code as in error.c
+ */
+static int read_extents(const struct imgst_file* imgst_file, uint64_t file_size, struct metadata_extent* extents,
+                        uint64_t* offsets, size_t* nb_extents)
+{
+    const int fd = fileno(imgst_file->file);
+    const uint64_t table_end = sizeof(struct imgst_header)
+                               + (uint64_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+    uint64_t end = table_end; // where the next (older) extent has to end
+    uint64_t descriptor = imgst_file->header.unused_64;
+    size_t nb = 0;
+    while (descriptor != 0) {
+        struct metadata_extent* extent = &extents[nb];
+        if (nb == MAX_EXTENTS || descriptor % EXTENT_ALIGN != 0
+            || pread(fd, extent, sizeof(struct metadata_extent), (off_t) descriptor) != sizeof(struct metadata_extent)) {
+            return ERR_IO;
+        }
+        const int is_newest = nb == 0;
+        if (extent->magic != EXTENT_MAGIC || extent->start % EXTENT_ALIGN != 0 || extent->length % EXTENT_ALIGN != 0
+            || extent->start == 0 || extent->length > GROWABLE_MAP_SIZE - extent->start
+            || (is_newest ? extent->start + extent->length < end : extent->start + extent->length != end)
+            || descriptor + EXTENT_ALIGN + extent->length > file_size) {
+            return ERR_IO;
+        }
+        offsets[nb] = descriptor + EXTENT_ALIGN;
+        end = extent->start;
+        descriptor = extent->older;
+        nb += 1;
+    }
+    *nb_extents = nb;
+    return end <= file_size ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * Maps the header and metadata table of a growable imgStore file in a range
+ * reserved for the largest table: the beginning of the file, then each extent
+ *
+ * @param imgst_file structure whose file and header are already set
+ * @param file_size size of the file
+ * @param flags MAP_SHARED or MAP_PRIVATE
+ * @return the mapping, MAP_FAILED on error
+ */
+static void* map_growable(const struct imgst_file* imgst_file, uint64_t file_size, int flags)
+{
+    struct metadata_extent extents[MAX_EXTENTS];
+    uint64_t offsets[MAX_EXTENTS];
+    size_t nb_extents = 0;
+    if (read_extents(imgst_file, file_size, extents, offsets, &nb_extents) != ERR_NONE) {
+        return MAP_FAILED;
+    }
+
+    char* map = mmap(NULL, GROWABLE_MAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    const int fd = fileno(imgst_file->file);
+    const size_t first_size = nb_extents > 0 ? extents[nb_extents - 1].start
+                              : sizeof(struct imgst_header) + (size_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+    int is_mapped = mmap(map, first_size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0) != MAP_FAILED;
+    for (size_t i = 0; i < nb_extents && is_mapped; ++i) {
+        is_mapped = mmap(map + extents[i].start, extents[i].length, PROT_READ | PROT_WRITE, flags | MAP_FIXED,
+                         fd, (off_t) offsets[i]) != MAP_FAILED;
+    }
+    if (!is_mapped) {
+        munmap(map, GROWABLE_MAP_SIZE);
+        return MAP_FAILED;
+    }
+    return map;
+}
+
+/**
+ * Maps the header and metadata region of an opened imgStore file
+ *
+ * @param open_mode mode the file was opened with
+ * @param imgst_file structure whose file and header are already set
+ * @return ERR_NONE if mapped, an error code otherwise (then the metadata has to be read)
+ */
+static int map_metadata(const char* open_mode, struct imgst_file* imgst_file)
+{
+    const int is_growable = imgst_file->header.unused_32 == IMGST_GROWABLE;
+    const size_t table_size = sizeof(struct imgst_header)
+                              + (size_t) imgst_file->header.max_files * sizeof(struct img_metadata);
+    const size_t map_size = is_growable ? GROWABLE_MAP_SIZE : table_size;
+    const int fd = fileno(imgst_file->file);
+
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || (!is_growable && (uint64_t) st.st_size < table_size)) {
+        return ERR_IO;
+    }
+
+    const int is_shared = is_writable_mode(open_mode);
+    const int flags = is_shared ? MAP_SHARED : MAP_PRIVATE;
+    void* map = is_growable ? map_growable(imgst_file, (uint64_t) st.st_size, flags)
+                : mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (map == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    imgst_file->map = map;
+    imgst_file->map_size = map_size;
+    imgst_file->is_map_shared = is_shared;
+    imgst_file->metadata = (struct img_metadata*) ((char*) map + sizeof(struct imgst_header));
+    return ERR_NONE;
+}
+
+/**
+ * Maps the table of a journaled imgStore file once more, privately, as its
+ * metadata: updates stay in this view until committed, then are written back
+ * through the shared mapping
+ *
+ * @param imgst_file structure whose shared mapping is set
+ * @return same error code as in error.c
+ */
+static int map_view(struct imgst_file* imgst_file)
+{
+    const int fd = fileno(imgst_file->file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return ERR_IO;
+    }
+    void* view = imgst_file->header.unused_32 == IMGST_GROWABLE
+                 ? map_growable(imgst_file, (uint64_t) st.st_size, MAP_PRIVATE)
+                 : mmap(NULL, imgst_file->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED) {
+        return ERR_IO;
+    }
+    imgst_file->view = view;
+    imgst_file->metadata = (struct img_metadata*) ((char*) view + sizeof(struct imgst_header));
+    return ERR_NONE;
+}
+
 int
 do_open (const char* imgst_filename, const char* open_mode, struct imgst_file* imgst_file)
+{
+    return do_open_durable(imgst_filename, open_mode, DURABILITY_NONE, imgst_file);
+}
+
+int do_open_durable(const char* imgst_filename, const char* open_mode, enum durability durability,
+                    struct imgst_file* imgst_file)
 {
     if (imgst_filename==NULL || open_mode == NULL || imgst_file == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
 
+    imgst_file->file = NULL;
+    imgst_file->metadata = NULL;
+    imgst_file->lookup = NULL;
+    imgst_file->map = NULL;
+    imgst_file->map_size = 0;
+    imgst_file->is_map_shared = 0;
+    imgst_file->view = NULL;
+    imgst_file->data_map = NULL;
+    imgst_file->journal = NULL;
+
     FILE* file = fopen(imgst_filename, open_mode);
     if (file==NULL) {
         return ERR_IO;
     }
+    imgst_file->file = file;
 
     size_t nb_read = 0;
     nb_read += fread(&imgst_file->header, sizeof(struct imgst_header), 1, file);
-    if(imgst_file->header.max_files > MAX_MAX_FILES) { //do not read a valid file (not even from software)
+    const int is_growable = imgst_file->header.unused_32 == IMGST_GROWABLE;
+    if(nb_read != 1 || imgst_file->header.max_files > (is_growable ? MAX_GROWN_FILES : MAX_MAX_FILES)
+       || (!is_growable && imgst_file->header.unused_32 != IMGST_FIXED)) { //do not read a valid file (not even from software)
         do_close(imgst_file);
         return ERR_IO;
     }
 
-    imgst_file->metadata = calloc(imgst_file->header.max_files, sizeof(struct img_metadata));
-    if(imgst_file->metadata == NULL) {
+    if (map_metadata(open_mode, imgst_file) != ERR_NONE) {
+        if (is_growable && imgst_file->header.unused_64 != 0) {
+            do_close(imgst_file); // the extents can only be mapped
+            return ERR_IO;
+        }
+        // fallback: read the whole metadata table
+        imgst_file->metadata = calloc(imgst_file->header.max_files, sizeof(struct img_metadata));
+        if(imgst_file->metadata == NULL) {
+            do_close(imgst_file);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        nb_read += fread(imgst_file->metadata, sizeof(struct img_metadata), imgst_file->header.max_files, file);
+        //num_files+1 is the number of metadatas + the header
+        if (imgst_file->header.max_files+1!=nb_read) {
+            do_close(imgst_file);
+            return ERR_IO;
+        }
+    }
+
+    int err = journal_open(imgst_file, imgst_filename, is_writable_mode(open_mode), durability);
+    if (err == ERR_NONE && imgst_file->journal != NULL && imgst_file->map != NULL) {
+        err = map_view(imgst_file);
+    }
+    if (err != ERR_NONE) {
         do_close(imgst_file);
-        return ERR_OUT_OF_MEMORY;
+        return err;
     }
 
-    nb_read += fread(imgst_file->metadata, sizeof(struct img_metadata), imgst_file->header.max_files, file);
-    imgst_file->file = file;
-    //num_files+1 is the number of metadatas + the header
-    if (imgst_file->header.max_files+1!=nb_read) {
+    err = index_attach(imgst_file);
+    if (err != ERR_NONE) {
         do_close(imgst_file);
+        return err;
+    }
+
+    return ERR_NONE;
+}
+
+int write_header(const struct imgst_file* imgst_file)
+{
+    if (imgst_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (imgst_file->map != NULL && !imgst_file->is_map_shared) {
+        return ERR_IO; // opened read-only
+    }
+    if (imgst_file->journal != NULL) {
+        // written in place once committed
+        return journal_log(imgst_file, JOURNAL_HEADER, 0, &imgst_file->header, sizeof(struct imgst_header));
+    }
+
+    if (imgst_file->map != NULL) {
+        memcpy(imgst_file->map, &imgst_file->header, sizeof(struct imgst_header));
+        // no fseek will flush the image data appended through stdio: do it here
+        return fflush(imgst_file->file) == 0 ? ERR_NONE : ERR_IO;
+    }
+
+    fseek(imgst_file->file, 0, SEEK_SET);
+    size_t nb_written = fwrite(&imgst_file->header, sizeof(struct imgst_header), 1, imgst_file->file);
+    if (nb_written != 1) {
         return ERR_IO;
     }
+    return ERR_NONE;
+}
+
+int write_metadata(const struct imgst_file* imgst_file, size_t index)
+{
+    return write_metadata_range(imgst_file, index, 1);
+}
+
+int write_metadata_range(const struct imgst_file* imgst_file, size_t first, size_t count)
+{
+    if (imgst_file == NULL || count == 0 || first >= imgst_file->header.max_files
+        || count > imgst_file->header.max_files - first) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (imgst_file->map != NULL && !imgst_file->is_map_shared) {
+        return ERR_IO; // opened read-only
+    }
+    if (imgst_file->journal != NULL) {
+        // written in place once committed
+        return journal_log(imgst_file, JOURNAL_METADATA, first, &imgst_file->metadata[first],
+                           count * sizeof(struct img_metadata));
+    }
+
+    if (imgst_file->map != NULL) {
+        // the metadata already lives in the mapping, only appended data may be pending
+        return fflush(imgst_file->file) == 0 ? ERR_NONE : ERR_IO;
+    }
 
+    //safe cast: the metadata region is far smaller than INT64_MAX
+    int64_t offset = (int64_t) (sizeof(struct imgst_header) + sizeof(struct img_metadata) * first);
+    fseek(imgst_file->file, offset, SEEK_SET);
+    size_t nb_written = fwrite(&imgst_file->metadata[first], sizeof(struct img_metadata), count, imgst_file->file);
+    if (nb_written != count) {
+        return ERR_IO;
+    }
     return ERR_NONE;
 }
 
@@ -112,12 +374,28 @@ do_close (struct imgst_file* imgst_file)
 {
     if (imgst_file != NULL) {
         if(imgst_file->file != NULL) {
+            journal_close(imgst_file);
             fclose(imgst_file->file);
         }
-        if (imgst_file->metadata != NULL) {
+        if (imgst_file->view != NULL) {
+            munmap(imgst_file->view, imgst_file->map_size);
+            imgst_file->view = NULL;
+        }
+        if (imgst_file->map != NULL) {
+            munmap(imgst_file->map, imgst_file->map_size);
+            imgst_file->map = NULL;
+            imgst_file->metadata = NULL;
+        } else if (imgst_file->metadata != NULL) {
             free(imgst_file->metadata);
             imgst_file->metadata = NULL;
         }
+        index_free(imgst_file);
+        while (imgst_file->data_map != NULL) {
+            struct data_map* older = imgst_file->data_map->older;
+            munmap(imgst_file->data_map->base, imgst_file->data_map->size);
+            free(imgst_file->data_map);
+            imgst_file->data_map = older;
+        }
         imgst_file->file = NULL;
     }
 
@@ -44,3 +44,4 @@ atouint ## N(const char* str) \
 
 define_atouintN(16)
 define_atouintN(32)
+define_atouintN(64)
@@ -64,3 +64,12 @@ atouint16(const char* str);
  */
 uint32_t
 atouint32(const char* str);
+
+/**
+ * @brief String to uint64_t conversion function
+ *
+ * @param str a string containing some integer value to be extracted
+ * @return converted value in uint64_t format
+ */
+uint64_t
+atouint64(const char* str);
@@ -0,0 +1,212 @@
+/**
+ * @file work_pool.c
+ * @brief imgStore library: worker threads pool implementation.
+ */
+
+#include "work_pool.h"
+#include "error.h"
+#include <stdlib.h> // for calloc, free
+#include <unistd.h> // for write
+
+struct work_item {
+    work_fn run;
+    work_fn complete;
+    void* arg;
+    struct work_item* next;
+};
+
+/**
+ * Body of the workers: runs queued jobs until the pool stops
+ *
+ * @param arg the pool
+ * @return NULL
+ */
+static void* worker_main(void* arg)
+{
+    struct work_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->todo == NULL && !pool->is_stopping) {
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        }
+        if (pool->todo == NULL) {
+            break; // stopping, and nothing left to be run
+        }
+
+        struct work_item* item = pool->todo;
+        pool->todo = item->next;
+        if (pool->todo == NULL) {
+            pool->todo_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        item->run(item->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        item->next = NULL;
+        if (pool->done_tail != NULL) {
+            pool->done_tail->next = item;
+        } else {
+            pool->done = item;
+        }
+        pool->done_tail = item;
+        pthread_cond_broadcast(&pool->has_room);
+        if (pool->notify_fd >= 0) {
+            const char wakeup = 1;
+            // a full socket buffer already means a pending wakeup: the result can be ignored
+            ssize_t ignored = write(pool->notify_fd, &wakeup, 1);
+            (void) ignored;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int pool_init(struct work_pool* pool, size_t nb_threads, size_t max_pending)
+{
+    if (pool == NULL || nb_threads == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    pool->todo = pool->todo_tail = NULL;
+    pool->done = pool->done_tail = NULL;
+    pool->nb_pending = 0;
+    pool->max_pending = max_pending;
+    pool->notify_fd = -1;
+    pool->is_stopping = 0;
+    pool->nb_threads = 0;
+    pool->threads = calloc(nb_threads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->has_room, NULL);
+
+    for (size_t i = 0; i < nb_threads; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            pool_end(pool);
+            return ERR_OUT_OF_MEMORY;
+        }
+        pool->nb_threads += 1;
+    }
+    return ERR_NONE;
+}
+
+int pool_submit(struct work_pool* pool, work_fn run, work_fn complete, void* arg)
+{
+    if (pool == NULL || run == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct work_item* item = calloc(1, sizeof(struct work_item));
+    if (item == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    item->run = run;
+    item->complete = complete;
+    item->arg = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->max_pending != 0 && pool->nb_pending >= pool->max_pending && pool->done == NULL) {
+        pthread_cond_wait(&pool->has_room, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    // finished jobs give their room back once completed, on this (the completing) thread
+    pool_complete(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->todo_tail != NULL) {
+        pool->todo_tail->next = item;
+    } else {
+        pool->todo = item;
+    }
+    pool->todo_tail = item;
+    pool->nb_pending += 1;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+    return ERR_NONE;
+}
+
+int pool_has_room(struct work_pool* pool)
+{
+    if (pool == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    const int has_room = pool->max_pending == 0 || pool->nb_pending < pool->max_pending || pool->done != NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return has_room;
+}
+
+size_t pool_complete(struct work_pool* pool)
+{
+    if (pool == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct work_item* item = pool->done;
+    pool->done = pool->done_tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t nb_completed = 0;
+    while (item != NULL) {
+        struct work_item* next = item->next;
+        if (item->complete != NULL) {
+            item->complete(item->arg);
+        }
+        free(item);
+        item = next;
+        nb_completed += 1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_pending -= nb_completed;
+    pthread_mutex_unlock(&pool->lock);
+    return nb_completed;
+}
+
+void pool_drain(struct work_pool* pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nb_pending > 0) {
+        while (pool->done == NULL) {
+            pthread_cond_wait(&pool->has_room, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        pool_complete(pool);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_end(struct work_pool* pool)
+{
+    if (pool == NULL || pool->threads == NULL) {
+        return;
+    }
+
+    pool_drain(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->is_stopping = 1;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->nb_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nb_threads = 0;
+
+    pthread_cond_destroy(&pool->has_room);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_mutex_destroy(&pool->lock);
+}
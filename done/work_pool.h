@@ -0,0 +1,86 @@
+#pragma once
+
+/**
+ * @file work_pool.h
+ * @brief Fixed-size pool of worker threads running jobs off the calling thread.
+ *
+ * A job is a pair of functions on a user argument: run() is executed by one of
+ * the workers, complete() later by the thread calling pool_complete (e.g. the
+ * thread owning the imgst_file), so that only run() needs to be thread-safe.
+ * When a notification descriptor is set, a byte is written to it each time a
+ * job is finished, to wake up a thread waiting in poll/select.
+ */
+
+#include <pthread.h>
+#include <stddef.h> // for size_t
+
+typedef void (*work_fn)(void* arg);
+
+struct work_item;
+
+struct work_pool {
+    pthread_t* threads;
+    size_t nb_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;     // signaled when a job is queued or the pool stops
+    pthread_cond_t has_room;     // signaled when a job is finished
+    struct work_item* todo;      // queued jobs, oldest first
+    struct work_item* todo_tail;
+    struct work_item* done;      // finished jobs waiting for their completion, oldest first
+    struct work_item* done_tail;
+    size_t nb_pending;           // jobs submitted and not yet completed
+    size_t max_pending;          // pool_submit waits above this (0 = unbounded)
+    int notify_fd;               // written to when a job is finished (-1 = none)
+    int is_stopping;
+};
+
+/**
+ * Starts the worker threads of a pool
+ *
+ * @param pool the pool to be initialized
+ * @param nb_threads number of workers (at least one)
+ * @param max_pending maximum number of jobs not yet completed, 0 for no limit
+ * @return same error code as in error.c
+ */
+int pool_init(struct work_pool* pool, size_t nb_threads, size_t max_pending);
+
+/**
+ * Queues a job; waits for a job to finish first when the pool is at its limit
+ *
+ * @param pool the pool
+ * @param run function executed by a worker
+ * @param complete function executed by pool_complete once run returned (may be NULL)
+ * @param arg argument of both functions
+ * @return same error code as in error.c
+ */
+int pool_submit(struct work_pool* pool, work_fn run, work_fn complete, void* arg);
+
+/**
+ * Tells whether a job can be submitted without waiting
+ *
+ * @param pool the pool
+ * @return 1 if pool_submit would not wait, 0 otherwise
+ */
+int pool_has_room(struct work_pool* pool);
+
+/**
+ * Runs, on the calling thread, the completion of every finished job
+ *
+ * @param pool the pool
+ * @return number of jobs completed
+ */
+size_t pool_complete(struct work_pool* pool);
+
+/**
+ * Waits until every submitted job is finished, and completes them
+ *
+ * @param pool the pool
+ */
+void pool_drain(struct work_pool* pool);
+
+/**
+ * Completes every submitted job, then stops and joins the workers
+ *
+ * @param pool the pool to be released
+ */
+void pool_end(struct work_pool* pool);